@@ -25,49 +25,159 @@ ortho.prototype.getServices = function() {
   return [informationService, switchService];
 };
 
-const request = require('request');
+const http = require('http');
 const url = require('url');
 
+// Ortho pushes its state down a server-sent event stream, which we keep open and cache, so
+// HomeKit's gets are answered here without a request. Orders go over one kept-alive
+// connection. If the stream is down, gets fall back to asking /api/status.
 function ortho(log, config) {
   this.log = log;
   this.getUrl = url.parse(config['getUrl']);
   this.postUrl = url.parse(config['postUrl']);
+  this.eventsUrl = url.parse(config['eventsUrl'] || url.resolve(config['getUrl'], '/api/events'));
+  this.agent = new http.Agent({ keepAlive: true, maxSockets: 1 });
+  this.state = null; // null until the stream has told us
+  this.retryDelay = 1000;
+  this.subscribe();
 }
 
-ortho.prototype.getState = function(callback) {
-  this.log("About to getState ortho at getUrl ", this.getUrl);
-  request.get({
-    url: this.getUrl,
+ortho.prototype.subscribe = function() {
+  let options = Object.assign({}, this.eventsUrl, {
     method: 'GET',
-  },
-  function (error, response, body) {
-    if (error) {
-      if (response) {
-        this.log('STATUS: ' + response.statusCode);
+    headers: { 'Accept': 'text/event-stream' },
+    agent: false, // the stream holds its socket for good, keep it out of the pool
+  });
+  // however the stream goes down, tear it down once and start over
+  let lost = false;
+  let streamLost = function() {
+    if (lost) {
+      return;
+    }
+    lost = true;
+    req.destroy();
+    this.resubscribe();
+  }.bind(this);
+  let req = http.request(options, function(response) {
+    if (response.statusCode != 200) {
+      this.log('Event stream STATUS: ' + response.statusCode);
+      response.resume();
+      return streamLost();
+    }
+    this.log("Subscribed to ortho events at ", this.eventsUrl.href);
+    this.retryDelay = 1000;
+    response.setEncoding('utf8');
+    let buffered = '';
+    response.on('data', function(chunk) {
+      buffered += chunk;
+      let end;
+      while ((end = buffered.indexOf('\n\n')) != -1) {
+        this.handleEvent(buffered.slice(0, end));
+        buffered = buffered.slice(end + 2);
       }
-      this.log(error.message);
+    }.bind(this));
+    response.on('end', streamLost);
+    response.on('error', streamLost);
+    response.on('aborted', streamLost);
+    response.on('close', streamLost);
+  }.bind(this));
+  // ortho sends a keep-alive every 15 s, so this much silence means the connection is
+  // half-open (the Pi rebooted, the Wi-Fi dropped) and won't tell us itself
+  req.setTimeout(45000, function() {
+    this.log('Event stream went quiet, reconnecting');
+    streamLost();
+  }.bind(this));
+  req.on('error', function(error) {
+    this.log(error.message);
+    streamLost();
+  }.bind(this));
+  req.end();
+};
+
+ortho.prototype.resubscribe = function() {
+  if (this.resubscribeTimer) {
+    return;
+  }
+  this.state = null;
+  this.resubscribeTimer = setTimeout(function() {
+    this.resubscribeTimer = null;
+    this.subscribe();
+  }.bind(this), this.retryDelay);
+  this.retryDelay = Math.min(this.retryDelay * 2, 30000);
+};
+
+ortho.prototype.handleEvent = function(text) {
+  let event = 'message', data = '';
+  text.split('\n').forEach(function(line) {
+    if (line.startsWith('event:')) {
+      event = line.slice(6).trim();
+    } else if (line.startsWith('data:')) {
+      data += line.slice(5).trim();
+    }
+  });
+  if (event != 'state') {
+    return;
+  }
+  let on = (data == 'true');
+  if (on !== this.state && this.switchService) {
+    this.switchService.getCharacteristic(Characteristic.On).updateValue(on);
+  }
+  this.state = on;
+};
+
+ortho.prototype.getState = function(callback) {
+  if (this.state !== null) {
+    return callback(null, this.state);
+  }
+  this.log("About to getState ortho at getUrl ", this.getUrl.href);
+  this.send('GET', this.getUrl, null, function(error, body) {
+    if (error) {
       return callback(error);
     }
     return callback(null, body == "true" ? true : false);
-  }.bind(this));
+  });
 };
 
 ortho.prototype.setState = function(on, callback) {
-  this.log("About to switch ortho " + on + " at postUrl ", this.postUrl);
-  request.post({
-    url: this.postUrl,
-    body: JSON.stringify({'targetState': on}),
-    method: 'POST',
-    headers: {'Content-type': 'application/json'}
-  },
-  function (error, response) {
+  this.log("About to switch ortho " + on + " at postUrl ", this.postUrl.href);
+  this.send('POST', this.postUrl, JSON.stringify({'targetState': on}), function(error) {
     if (error) {
-      if (response) {
-        this.log('STATUS: ' + response.statusCode);
-      }
-      this.log(error.message);
       return callback(error);
     }
+    // the stream will say so too, but don't answer a get with the old state meanwhile
+    if (this.state !== null) {
+      this.state = on;
+    }
     return callback();
   }.bind(this));
 };
+
+ortho.prototype.send = function(method, target, body, callback) {
+  let options = Object.assign({}, target, { method: method, agent: this.agent, headers: {} });
+  if (body !== null) {
+    options.headers['Content-Type'] = 'application/json';
+    options.headers['Content-Length'] = Buffer.byteLength(body);
+  }
+  let req = http.request(options, function(response) {
+    let received = '';
+    response.setEncoding('utf8');
+    response.on('data', function(chunk) {
+      received += chunk;
+    });
+    response.on('end', function() {
+      if (response.statusCode != 200) {
+        this.log('STATUS: ' + response.statusCode);
+        return callback(new Error('ortho answered ' + response.statusCode));
+      }
+      return callback(null, received);
+    }.bind(this));
+  }.bind(this));
+  req.on('error', function(error) {
+    this.log(error.message);
+    return callback(error);
+  }.bind(this));
+  if (body !== null) {
+    req.write(body);
+  }
+  req.end();
+};
@@ -0,0 +1,576 @@
+#ifndef AUDIOANALYZER_H
+#define AUDIOANALYZER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include <atomic>
+#include <thread>
+
+#if ORTHO_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#include "util.h"
+#include "Seqlock.h"
+#include "Metrics.h"
+#include "Trace.h"
+
+// What patterns get to know about the sound, published once per analysis hop.
+struct AudioFeatures {
+  static const int bandCount = 12;
+  float bands[bandCount]; // energy per log-spaced band, 0-1 against its recent peak
+  float level;            // overall loudness, 0-1
+  float onset;            // spectral flux over its recent average; a beat is well above 1
+  uint32_t beats;         // beats detected so far; compare with the last count seen
+  uint64_t captureNanos;  // monotonicNanos() when the newest analyzed sample was captured
+  uint64_t publishNanos;
+  uint32_t sequence;      // hops analyzed, 0 until the first one
+};
+
+/* ------------------- */
+
+// A mono 16-bit sample stream. read() blocks until 'count' samples are in and reports when
+// the newest of them was captured; it returns false when the stream is over, or as soon as
+// stopFd becomes readable. open() never blocks.
+class AudioSource {
+protected:
+  // Waits in poll() for one of fds, or until timeout if there is one. False once stopFd is
+  // readable, or if polling fails.
+  bool wait(struct pollfd *fds, int count, const struct timespec *timeout = NULL) {
+    struct pollfd all[8];
+    if (count >= (int)ARRAY_SIZE(all)) {
+      return false;
+    }
+    for (int i = 0; i < count; ++i) {
+      all[i] = fds[i];
+    }
+    all[count].fd = stopFd;
+    all[count].events = POLLIN;
+    while (true) {
+      int ready = ppoll(all, count + 1, timeout, NULL);
+      if (ready < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("ppoll");
+        return false;
+      }
+      if (all[count].revents) {
+        return false;
+      }
+      for (int i = 0; i < count; ++i) {
+        fds[i].revents = all[i].revents;
+      }
+      return true;
+    }
+  }
+public:
+  int sampleRate = 44100;
+  int stopFd = -1;
+  virtual ~AudioSource() { }
+  virtual bool open() = 0;
+  virtual bool read(int16_t *samples, int count, uint64_t *captureNanos) = 0;
+};
+
+// Raw S16_LE mono from a FIFO, a file or stdin ("-"), e.g.
+//   arecord -f S16_LE -c 1 -r 44100 -t raw > /tmp/ortho-audio
+// A FIFO is opened without waiting for a writer, and reopened when one goes away, so the
+// capture can be restarted.
+class RawAudioSource : public AudioSource {
+  const char *path;
+  int fd = -1;
+  bool fifo = false;
+
+  bool openPath() {
+    fd = (strcmp(path, "-") == 0 ? STDIN_FILENO : ::open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+    if (fd < 0) {
+      perror(path);
+      return false;
+    }
+    return true;
+  }
+public:
+  RawAudioSource(const char *path, int rate) : path(path) {
+    sampleRate = rate;
+  }
+
+  ~RawAudioSource() {
+    if (fd > 0) {
+      close(fd);
+    }
+  }
+
+  bool open() {
+    if (!openPath()) {
+      return false;
+    }
+    struct stat st;
+    fifo = (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) && fd != STDIN_FILENO);
+    return true;
+  }
+
+  bool read(int16_t *samples, int count, uint64_t *captureNanos) {
+    size_t wanted = count * sizeof(int16_t);
+    size_t filled = 0;
+    while (filled < wanted) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (!wait(&pfd, 1)) {
+        return false;
+      }
+      ssize_t n = ::read(fd, (char *)samples + filled, wanted - filled);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        continue;
+      }
+      if (n == 0 && fifo) {
+        logf("Audio: %s closed, waiting for the next writer", path);
+        close(fd);
+        if (!openPath()) {
+          return false;
+        }
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      filled += n;
+    }
+    // a pipe hands samples over as they're captured, so they're as fresh as the read
+    *captureNanos = monotonicNanos();
+    return true;
+  }
+};
+
+// A 16-bit PCM WAV file, played out in real time and looped, for testing without a mic.
+class WavAudioSource : public AudioSource {
+  const char *path;
+  FILE *file = NULL;
+  int channels = 1;
+  long dataStart = 0;
+  long dataLength = 0;
+  long dataRead = 0;
+  uint64_t startNanos = 0;
+  uint64_t samplesDelivered = 0;
+  int16_t frame[16];
+public:
+  WavAudioSource(const char *path) : path(path) { }
+
+  ~WavAudioSource() {
+    if (file) {
+      fclose(file);
+    }
+  }
+
+  bool open() {
+    file = fopen(path, "rb");
+    if (file == NULL) {
+      perror(path);
+      return false;
+    }
+    char id[4];
+    uint32_t size;
+    if (fread(id, 1, 4, file) != 4 || memcmp(id, "RIFF", 4) != 0 || fread(&size, 4, 1, file) != 1 ||
+        fread(id, 1, 4, file) != 4 || memcmp(id, "WAVE", 4) != 0) {
+      logf("%s is not a WAV file", path);
+      return false;
+    }
+    int bits = 0;
+    while (fread(id, 1, 4, file) == 4 && fread(&size, 4, 1, file) == 1) {
+      if (memcmp(id, "fmt ", 4) == 0) {
+        uint16_t format, channelCount, bitsPerSample;
+        uint32_t rate;
+        uint8_t rest[8];
+        if (fread(&format, 2, 1, file) != 1 || fread(&channelCount, 2, 1, file) != 1 ||
+            fread(&rate, 4, 1, file) != 1 || fread(rest, 1, 6, file) != 6 ||
+            fread(&bitsPerSample, 2, 1, file) != 1) {
+          break;
+        }
+        channels = channelCount;
+        sampleRate = rate;
+        bits = bitsPerSample;
+        fseek(file, size - 16, SEEK_CUR);
+        if (format != 1) {
+          bits = 0;
+        }
+      } else if (memcmp(id, "data", 4) == 0) {
+        dataStart = ftell(file);
+        dataLength = size;
+        break;
+      } else {
+        fseek(file, size + (size & 1), SEEK_CUR);
+      }
+    }
+    if (bits != 16 || channels < 1 || channels > (int)ARRAY_SIZE(frame) || dataLength == 0) {
+      logf("%s: only 16-bit PCM WAV files are supported", path);
+      return false;
+    }
+    startNanos = monotonicNanos();
+    return true;
+  }
+
+  bool read(int16_t *samples, int count, uint64_t *captureNanos) {
+    const long frameBytes = channels * sizeof(int16_t);
+    for (int i = 0; i < count; ++i) {
+      if (dataRead + frameBytes > dataLength) {
+        fseek(file, dataStart, SEEK_SET);
+        dataRead = 0;
+      }
+      if (fread(frame, frameBytes, 1, file) != 1) {
+        return false;
+      }
+      dataRead += frameBytes;
+      int mix = 0;
+      for (int c = 0; c < channels; ++c) {
+        mix += frame[c];
+      }
+      samples[i] = mix / channels;
+    }
+    // hand the samples over no sooner than a microphone would have
+    samplesDelivered += count;
+    uint64_t due = startNanos + samplesDelivered * 1000000000ULL / sampleRate;
+    uint64_t now = monotonicNanos();
+    if (due > now) {
+      struct timespec timeout = {(time_t)((due - now) / 1000000000ULL), (long)((due - now) % 1000000000ULL)};
+      if (!wait(NULL, 0, &timeout)) {
+        return false;
+      }
+    }
+    *captureNanos = due;
+    return true;
+  }
+};
+
+#if ORTHO_ALSA
+// Capture from an ALSA device such as "default" or "hw:1,0".
+class AlsaAudioSource : public AudioSource {
+  const char *device;
+  snd_pcm_t *pcm = NULL;
+  struct pollfd pollFds[4];
+  int pollCount = 0;
+public:
+  AlsaAudioSource(const char *device) : device(device) { }
+
+  ~AlsaAudioSource() {
+    if (pcm) {
+      snd_pcm_close(pcm);
+    }
+  }
+
+  bool open() {
+    int err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK);
+    if (err < 0) {
+      logf("ALSA: can't open %s: %s", device, snd_strerror(err));
+      return false;
+    }
+    // a small buffer keeps capture latency to a few milliseconds
+    err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, 1, sampleRate, 1, 20000);
+    if (err < 0) {
+      logf("ALSA: can't configure %s: %s", device, snd_strerror(err));
+      return false;
+    }
+    pollCount = snd_pcm_poll_descriptors(pcm, pollFds, ARRAY_SIZE(pollFds));
+    if (pollCount <= 0) {
+      logf("ALSA: can't poll %s", device);
+      return false;
+    }
+    return true;
+  }
+
+  bool read(int16_t *samples, int count, uint64_t *captureNanos) {
+    int filled = 0;
+    while (filled < count) {
+      snd_pcm_sframes_t n = snd_pcm_readi(pcm, samples + filled, count - filled);
+      if (n == -EAGAIN) {
+        unsigned short revents = 0;
+        do {
+          if (!wait(pollFds, pollCount)) {
+            return false;
+          }
+          snd_pcm_poll_descriptors_revents(pcm, pollFds, pollCount, &revents);
+        } while (revents == 0);
+        continue;
+      }
+      if (n < 0) {
+        // overruns and suspends are recoverable; anything else ends the stream
+        if (snd_pcm_recover(pcm, n, 1) < 0) {
+          logf("ALSA: read failed: %s", snd_strerror(n));
+          return false;
+        }
+        continue;
+      }
+      filled += n;
+    }
+    // samples still queued in the driver were captured after the newest one we have
+    snd_pcm_sframes_t delay = 0;
+    uint64_t now = monotonicNanos();
+    if (snd_pcm_delay(pcm, &delay) < 0 || delay < 0) {
+      delay = 0;
+    }
+    *captureNanos = now - delay * 1000000000ULL / sampleRate;
+    return true;
+  }
+};
+#endif
+
+/* ------------------- */
+
+// Listens on its own thread: a Hann-windowed FFT every hop gives band energies, level, and
+// beats from spectral flux. The render thread reads the latest features through a seqlock
+// without ever waiting on the analysis.
+class AudioAnalyzer {
+  static const int windowSize = 1024; // power of two
+  static const int hopSize = 256;     // ~6 ms at 44.1 kHz, well inside a frame
+  static const int historySize = 256; // hops of flux history for the beat threshold
+
+  Seqlock<AudioFeatures> features;
+  AudioSource *source = NULL;
+  std::thread thread;
+  int stopFd = -1; // an eventfd, signalled to wake the audio thread out of its source
+
+  // analysis state, audio thread only
+  float window[windowSize];
+  float hann[windowSize];
+  float re[windowSize], im[windowSize];
+  float lastMagnitude[windowSize / 2];
+  float cosTable[windowSize / 2], sinTable[windowSize / 2];
+  uint16_t bitReverse[windowSize];
+  int bandStart[AudioFeatures::bandCount + 1];
+  float bandPeak[AudioFeatures::bandCount];
+  float levelPeak = 0;
+  float flux[historySize];
+  int fluxIndex = 0;
+  uint64_t lastBeatNanos = 0;
+  AudioFeatures current;
+
+  void prepare() {
+    for (int i = 0; i < windowSize; ++i) {
+      window[i] = 0;
+      hann[i] = 0.5f - 0.5f * cosf(2 * M_PI * i / (windowSize - 1));
+      int r = 0;
+      for (int bit = 1, rbit = windowSize >> 1; bit < windowSize; bit <<= 1, rbit >>= 1) {
+        if (i & bit) {
+          r |= rbit;
+        }
+      }
+      bitReverse[i] = r;
+    }
+    for (int k = 0; k < windowSize / 2; ++k) {
+      cosTable[k] = cosf(2 * M_PI * k / windowSize);
+      sinTable[k] = -sinf(2 * M_PI * k / windowSize);
+      lastMagnitude[k] = 0;
+    }
+    // log-spaced from 40 Hz up to 16 kHz or Nyquist
+    float low = 40, high = fminf(16000, source->sampleRate / 2.f);
+    for (int b = 0; b <= AudioFeatures::bandCount; ++b) {
+      float hz = low * powf(high / low, b / (float)AudioFeatures::bandCount);
+      bandStart[b] = std::max(1, std::min(windowSize / 2, (int)lroundf(hz * windowSize / source->sampleRate)));
+      if (b > 0 && bandStart[b] <= bandStart[b - 1]) {
+        bandStart[b] = std::min(windowSize / 2, bandStart[b - 1] + 1);
+      }
+    }
+    for (int b = 0; b < AudioFeatures::bandCount; ++b) {
+      bandPeak[b] = 0;
+    }
+    for (int h = 0; h < historySize; ++h) {
+      flux[h] = 0;
+    }
+    memset(&current, 0, sizeof(current));
+  }
+
+  // In place, iterative radix-2.
+  void fft() {
+    for (int i = 0; i < windowSize; ++i) {
+      int j = bitReverse[i];
+      if (j > i) {
+        std::swap(re[i], re[j]);
+        std::swap(im[i], im[j]);
+      }
+    }
+    for (int size = 2; size <= windowSize; size <<= 1) {
+      int half = size >> 1, step = windowSize / size;
+      for (int start = 0; start < windowSize; start += size) {
+        for (int k = 0; k < half; ++k) {
+          float wr = cosTable[k * step], wi = sinTable[k * step];
+          int a = start + k, b = a + half;
+          float tr = re[b] * wr - im[b] * wi;
+          float ti = re[b] * wi + im[b] * wr;
+          re[b] = re[a] - tr;
+          im[b] = im[a] - ti;
+          re[a] += tr;
+          im[a] += ti;
+        }
+      }
+    }
+  }
+
+  void analyze(const int16_t *hop, uint64_t captureNanos) {
+    memmove(window, window + hopSize, (windowSize - hopSize) * sizeof(float));
+    float sumSquares = 0;
+    for (int i = 0; i < hopSize; ++i) {
+      float s = hop[i] / 32768.f;
+      window[windowSize - hopSize + i] = s;
+      sumSquares += s * s;
+    }
+    for (int i = 0; i < windowSize; ++i) {
+      re[i] = window[i] * hann[i];
+      im[i] = 0;
+    }
+    fft();
+
+    // spectral flux: how much louder each bin got since the last hop
+    float rise = 0;
+    for (int k = 1; k < windowSize / 2; ++k) {
+      float magnitude = log1pf(100 * sqrtf(re[k] * re[k] + im[k] * im[k]));
+      rise += fmaxf(0, magnitude - lastMagnitude[k]);
+      lastMagnitude[k] = magnitude;
+    }
+
+    for (int b = 0; b < AudioFeatures::bandCount; ++b) {
+      float energy = 0;
+      for (int k = bandStart[b]; k < bandStart[b + 1]; ++k) {
+        energy += re[k] * re[k] + im[k] * im[k];
+      }
+      float value = sqrtf(energy / (bandStart[b + 1] - bandStart[b]));
+      // automatic gain: a slowly decaying peak per band
+      bandPeak[b] = fmaxf(value, fmaxf(bandPeak[b] * 0.9995f, 1e-4f));
+      current.bands[b] = value / bandPeak[b];
+    }
+    float rms = sqrtf(sumSquares / hopSize);
+    levelPeak = fmaxf(rms, fmaxf(levelPeak * 0.9995f, 1e-3f));
+    current.level = rms / levelPeak;
+
+    float average = 0;
+    for (int h = 0; h < historySize; ++h) {
+      average += flux[h];
+    }
+    average /= historySize;
+    flux[fluxIndex] = rise;
+    fluxIndex = (fluxIndex + 1) % historySize;
+    current.onset = (average > 0 ? rise / average : 0);
+    // well above the recent average, and not within 100 ms of the last one
+    if (current.onset > 1.8f && rise > 1 && captureNanos - lastBeatNanos > 100000000ULL) {
+      ++current.beats;
+      lastBeatNanos = captureNanos;
+    }
+
+    current.captureNanos = captureNanos;
+    current.publishNanos = monotonicNanos();
+    ++current.sequence;
+    features.publish(current);
+    metrics.audioLatency.observe(current.publishNanos - captureNanos);
+  }
+
+  void run() {
+    TRACE_THREAD_NAME("audio");
+    int16_t hop[hopSize];
+    uint64_t captureNanos;
+    long lastReport = millis();
+    uint32_t lastBeats = 0;
+    while (source->read(hop, hopSize, &captureNanos)) {
+      analyze(hop, captureNanos);
+      if (millis() - lastReport >= 10000) {
+        logf("Audio: %u beats in the last %.0f s, level %.2f", current.beats - lastBeats,
+             (millis() - lastReport) / 1000., current.level);
+        lastBeats = current.beats;
+        lastReport = millis();
+      }
+    }
+    uint64_t signalled = 0;
+    if (::read(stopFd, &signalled, sizeof(signalled)) != sizeof(signalled)) {
+      logf("Audio: input ended");
+    }
+  }
+public:
+  ~AudioAnalyzer() {
+    stop();
+    delete source;
+    if (stopFd >= 0) {
+      close(stopFd);
+    }
+  }
+
+  // Starts listening to alsa:DEVICE, wav:PATH or raw:PATH[@RATE] (a FIFO, or - for stdin).
+  bool start(const char *spec) {
+    if (strncmp(spec, "alsa:", 5) == 0) {
+#if ORTHO_ALSA
+      source = new AlsaAudioSource(spec + 5);
+#else
+      logf("Audio: built without ALSA");
+      return false;
+#endif
+    } else if (strncmp(spec, "wav:", 4) == 0) {
+      source = new WavAudioSource(spec + 4);
+    } else if (strncmp(spec, "raw:", 4) == 0) {
+      static char path[256];
+      int rate = 44100;
+      snprintf(path, sizeof(path), "%s", spec + 4);
+      char *at = strrchr(path, '@');
+      if (at) {
+        *at = '\0';
+        rate = atoi(at + 1);
+      }
+      if (rate <= 0) {
+        return false;
+      }
+      source = new RawAudioSource(path, rate);
+    } else {
+      logf("Audio: unknown source %s", spec);
+      return false;
+    }
+    if ((stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+      perror("eventfd");
+      return false;
+    }
+    source->stopFd = stopFd;
+    if (!source->open()) {
+      return false;
+    }
+    prepare();
+    logf("Audio: listening to %s at %i Hz", spec, source->sampleRate);
+    thread = std::thread(&AudioAnalyzer::run, this);
+    return true;
+  }
+
+  // Wakes the audio thread wherever its source is waiting and joins it.
+  void stop() {
+    if (thread.joinable()) {
+      uint64_t one = 1;
+      if (write(stopFd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+      }
+      thread.join();
+    }
+  }
+
+  // The latest features without recording anything, for any thread.
+  AudioFeatures peek() {
+    return features.read();
+  }
+
+  // The latest features, from the render thread; also records how old they are.
+  AudioFeatures latest() {
+    AudioFeatures f = features.read();
+    if (f.sequence > 0) {
+      metrics.audioFeatureAge.observe(monotonicNanos() - f.captureNanos);
+    }
+    return f;
+  }
+
+  // Whether there's sound coming in now.
+  bool isLive() {
+    AudioFeatures f = features.read();
+    return f.sequence > 0 && monotonicNanos() - f.publishNanos < 1000000000ULL;
+  }
+};
+
+AudioAnalyzer audioAnalyzer;
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef BUTTONINPUT_H
+#define BUTTONINPUT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/gpio.h>
+
+#include <functional>
+#include <string>
+
+#include "util.h"
+#include "EventLoop.h"
+
+// Where the mode button's edges come from. Each backend hands out an fd that's readable
+// while edges are waiting, so the button wakes the event loop instead of being polled.
+class ButtonBackend {
+public:
+  virtual ~ButtonBackend() { }
+  virtual bool open() = 0;
+  virtual int fd() = 0;
+  // The next waiting edge and when it happened on the monotonic clock; false if none.
+  virtual bool nextEdge(bool *pressed, uint64_t *nanos) = 0;
+};
+
+// A line on a GPIO chip through the character device API. The kernel timestamps each edge
+// as it happens, so press lengths are exact however late we get around to reading them.
+class GpioButtonBackend : public ButtonBackend {
+  std::string chipPath;
+  int line;
+  int lineFd = -1;
+public:
+  GpioButtonBackend(const std::string &chipPath, int line) : chipPath(chipPath), line(line) { }
+
+  ~GpioButtonBackend() {
+    if (lineFd >= 0) {
+      close(lineFd);
+    }
+  }
+
+  bool open() {
+    int chipFd = ::open(chipPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (chipFd < 0) {
+      perror(chipPath.c_str());
+      return false;
+    }
+    struct gpio_v2_line_request request = {};
+    request.offsets[0] = line;
+    request.num_lines = 1;
+    strncpy(request.consumer, "ortho", sizeof(request.consumer) - 1);
+    // pulled down, so the button reads high while it's held
+    request.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING |
+                           GPIO_V2_LINE_FLAG_EDGE_FALLING | GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+    int result = ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &request);
+    close(chipFd);
+    if (result < 0) {
+      perror("GPIO_V2_GET_LINE_IOCTL");
+      return false;
+    }
+    lineFd = request.fd;
+    if (0 != fcntl(lineFd, F_SETFL, fcntl(lineFd, F_GETFL) | O_NONBLOCK)) {
+      perror("fcntl");
+      return false;
+    }
+    return true;
+  }
+
+  int fd() {
+    return lineFd;
+  }
+
+  bool nextEdge(bool *pressed, uint64_t *nanos) {
+    struct gpio_v2_line_event event;
+    if (read(lineFd, &event, sizeof(event)) != sizeof(event)) {
+      return false;
+    }
+    *pressed = (event.id == GPIO_V2_LINE_EVENT_RISING_EDGE);
+    *nanos = event.timestamp_ns;
+    return true;
+  }
+};
+
+// Stands in for the GPIO line on machines without one: write "down" or "up" lines to the
+// FIFO (created if it's missing), e.g.
+//   echo down > /tmp/ortho-button; sleep 3; echo up > /tmp/ortho-button
+// Edges are timestamped as they're read.
+class FifoButtonBackend : public ButtonBackend {
+  std::string path;
+  int fifoFd = -1;
+  std::string pending;
+public:
+  FifoButtonBackend(const std::string &path) : path(path) { }
+
+  ~FifoButtonBackend() {
+    if (fifoFd >= 0) {
+      close(fifoFd);
+    }
+  }
+
+  bool open() {
+    if (mkfifo(path.c_str(), 0666) != 0 && errno != EEXIST) {
+      perror(path.c_str());
+      return false;
+    }
+    // opened for writing too, so the FIFO never reads as closed between writers
+    fifoFd = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fifoFd < 0) {
+      perror(path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  int fd() {
+    return fifoFd;
+  }
+
+  bool nextEdge(bool *pressed, uint64_t *nanos) {
+    while (true) {
+      size_t end = pending.find('\n');
+      if (end == std::string::npos) {
+        char buffer[256];
+        ssize_t count = read(fifoFd, buffer, sizeof(buffer));
+        if (count <= 0) {
+          return false;
+        }
+        pending.append(buffer, count);
+        continue;
+      }
+      std::string command = pending.substr(0, end);
+      pending.erase(0, end + 1);
+      if (command == "down" || command == "1") {
+        *pressed = true;
+      } else if (command == "up" || command == "0") {
+        *pressed = false;
+      } else {
+        logf("Button: ignoring \"%s\"", command.c_str());
+        continue;
+      }
+      *nanos = monotonicNanos();
+      return true;
+    }
+  }
+};
+
+enum ButtonAction {
+  buttonShortPress, // released before the long press time
+  buttonLongPress,  // held for the long press time, reported while still held
+};
+
+// Turns a backend's raw edges into presses. Edges are debounced in software: after an edge
+// is taken, others are ignored until the contacts have had time to settle, and if the line
+// ended up somewhere else by then, that's taken as the next edge. Long presses are timed by
+// a timer on the press's own timestamp, so they fire on time even while the render loop is
+// asleep with the display off.
+class ButtonInput {
+  static const uint64_t debounceNanos = 30 * 1000000ULL;
+  static const uint64_t longPressNanos = 2000 * 1000000ULL;
+
+  ButtonBackend *backend = NULL;
+  OneShotTimer settleTimer;
+  OneShotTimer longPressTimer;
+  std::function<void(ButtonAction)> handler;
+
+  bool pressed = false;    // debounced
+  bool rawPressed = false; // as of the last edge read
+  bool settling = false;
+  uint64_t lastEdgeNanos = 0;
+  uint64_t pressedNanos = 0;
+  bool longPressFired = false;
+
+  void readEdges() {
+    bool edgePressed;
+    uint64_t nanos;
+    while (backend->nextEdge(&edgePressed, &nanos)) {
+      rawPressed = edgePressed;
+      if (!settling) {
+        takeEdge(edgePressed, nanos);
+      }
+    }
+  }
+
+  void takeEdge(bool edgePressed, uint64_t nanos) {
+    if (edgePressed == pressed) {
+      return;
+    }
+    pressed = edgePressed;
+    lastEdgeNanos = nanos;
+    settling = true;
+    settleTimer.startAt(nanos + debounceNanos);
+    if (pressed) {
+      logf("Mode button press down");
+      pressedNanos = nanos;
+      longPressFired = false;
+      longPressTimer.startAt(nanos + longPressNanos);
+    } else {
+      longPressTimer.stop();
+      logf("Mode button press up after %.0f ms", (nanos - pressedNanos) / 1e6);
+      if (!longPressFired) {
+        handler(buttonShortPress);
+      }
+    }
+  }
+
+  void settled() {
+    settling = false;
+    // a change the debounce window swallowed, timed from the end of the window
+    takeEdge(rawPressed, lastEdgeNanos + debounceNanos);
+  }
+public:
+  ~ButtonInput() {
+    delete backend;
+  }
+
+  // Opens gpio:CHIP:LINE (gpio:/dev/gpiochip0:18, say) or fifo:PATH and watches it on the
+  // event loop, calling handler on that loop's thread.
+  bool start(const char *spec, EventLoop &loop, std::function<void(ButtonAction)> handler) {
+    std::string s(spec);
+    size_t colon = s.rfind(':');
+    if (s.compare(0, 5, "gpio:") == 0 && colon > 5) {
+      backend = new GpioButtonBackend(s.substr(5, colon - 5), atoi(s.c_str() + colon + 1));
+    } else if (s.compare(0, 5, "fifo:") == 0) {
+      backend = new FifoButtonBackend(s.substr(5));
+    } else {
+      logf("Button: unknown source %s", spec);
+      return false;
+    }
+    if (!backend->open()) {
+      return false;
+    }
+    this->handler = handler;
+    loop.watch(backend->fd(), EPOLLIN, [this](uint32_t events) {
+      readEdges();
+    });
+    loop.watch(settleTimer.fd(), EPOLLIN, [this](uint32_t events) {
+      if (settleTimer.fired()) {
+        settled();
+      }
+    });
+    loop.watch(longPressTimer.fd(), EPOLLIN, [this](uint32_t events) {
+      if (longPressTimer.fired() && pressed) {
+        longPressFired = true;
+        this->handler(buttonLongPress);
+      }
+    });
+    logf("Button: watching %s", spec);
+    return true;
+  }
+};
+
+#endif
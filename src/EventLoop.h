@@ -0,0 +1,272 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include <functional>
+#include <unordered_map>
+#include <initializer_list>
+
+#include "util.h"
+#include "Trace.h"
+
+// Single-threaded epoll reactor. Handlers are called on the thread running run().
+class EventLoop {
+public:
+  typedef std::function<void(uint32_t events)> Handler;
+private:
+  int epoll_fd;
+  bool running = false;
+  std::unordered_map<int, Handler> handlers;
+
+  bool control(int op, int fd, uint32_t events) {
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    return epoll_ctl(epoll_fd, op, fd, &event) == 0;
+  }
+public:
+  EventLoop() {
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      perror("epoll_create1");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ~EventLoop() {
+    if (0 != close(epoll_fd)) {
+      perror("close");
+    }
+  }
+
+  // Returns false if the fd can't be watched; regular files, for one, can't be polled.
+  bool watch(int fd, uint32_t events, Handler handler) {
+    handlers[fd] = handler;
+    if (!modify(fd, events)) {
+      handlers.erase(fd);
+      return false;
+    }
+    return true;
+  }
+
+  // Changes the events for a watched fd. A closed fd drops out of epoll on its own,
+  // so a reused fd number is re-added rather than modified.
+  bool modify(int fd, uint32_t events) {
+    if (!control(EPOLL_CTL_MOD, fd, events)) {
+      if (errno != ENOENT || !control(EPOLL_CTL_ADD, fd, events)) {
+        if (errno != EPERM) {
+          perror("epoll_ctl");
+        }
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void unwatch(int fd) {
+    handlers.erase(fd);
+    // fd may already be closed, in which case epoll has forgotten it
+    control(EPOLL_CTL_DEL, fd, 0);
+  }
+
+  // Waits up to timeoutMs (-1 forever) and dispatches whatever is ready.
+  void runOnce(int timeoutMs) {
+    struct epoll_event events[16];
+    int count;
+    {
+      TRACE_SCOPE("epoll_wait");
+      count = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), timeoutMs);
+    }
+    if (count < 0) {
+      if (errno != EINTR) {
+        perror("epoll_wait");
+      }
+      return;
+    }
+    for (int i = 0; i < count; ++i) {
+      // a handler earlier in this batch may have unwatched this fd
+      auto it = handlers.find(events[i].data.fd);
+      if (it != handlers.end()) {
+        Handler handler = it->second;
+        handler(events[i].events);
+      }
+    }
+  }
+
+  void run() {
+    running = true;
+    while (running) {
+      runOnce(-1);
+    }
+  }
+
+  void stop() {
+    running = false;
+  }
+};
+
+// Periodic tick delivered through a timerfd, so the loop sleeps until the next frame is due.
+class FrameTimer {
+  int timer_fd;
+  long intervalNanos = 0;
+  uint64_t phaseNanos = 0; // when the first tick was due
+  uint64_t handledTicks = 0;
+  uint64_t oldestDueNanos = 0; // when the oldest tick from the last expirations() was due
+public:
+  FrameTimer() {
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+      perror("timerfd_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ~FrameTimer() {
+    close(timer_fd);
+  }
+
+  int fd() {
+    return timer_fd;
+  }
+
+  bool isRunning() {
+    return intervalNanos != 0;
+  }
+
+  // Arms the timer; calling again with the current interval keeps the tick phase.
+  void start(long nanos) {
+    if (nanos == intervalNanos) {
+      return;
+    }
+    uint64_t first = monotonicNanos() + nanos;
+    struct itimerspec spec = {};
+    spec.it_interval.tv_sec = nanos / 1000000000;
+    spec.it_interval.tv_nsec = nanos % 1000000000;
+    spec.it_value.tv_sec = first / 1000000000;
+    spec.it_value.tv_nsec = first % 1000000000;
+    if (0 != timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL)) {
+      perror("timerfd_settime");
+      return;
+    }
+    intervalNanos = nanos;
+    phaseNanos = first;
+    handledTicks = 0;
+  }
+
+  // How long ago the oldest tick from the last expirations() fell due, so the whole delay
+  // when frames were missed rather than just the part since the latest tick.
+  uint64_t lateness(uint64_t nanos) {
+    if (intervalNanos == 0 || nanos < oldestDueNanos) {
+      return 0;
+    }
+    return nanos - oldestDueNanos;
+  }
+
+  void stop() {
+    struct itimerspec spec = {};
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+    intervalNanos = 0;
+  }
+
+  // Returns the number of ticks since the last call; more than one means frames were missed.
+  uint64_t expirations() {
+    uint64_t count = 0;
+    if (read(timer_fd, &count, sizeof(count)) != sizeof(count)) {
+      return 0;
+    }
+    oldestDueNanos = phaseNanos + handledTicks * intervalNanos;
+    handledTicks += count;
+    return count;
+  }
+};
+
+// A single deadline on the monotonic clock, delivered through a timerfd.
+class OneShotTimer {
+  int timer_fd;
+public:
+  OneShotTimer() {
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+      perror("timerfd_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ~OneShotTimer() {
+    close(timer_fd);
+  }
+
+  int fd() {
+    return timer_fd;
+  }
+
+  // Fires once at monotonicNanos() == deadlineNanos, or straight away if that's passed.
+  void startAt(uint64_t deadlineNanos) {
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = deadlineNanos / 1000000000;
+    spec.it_value.tv_nsec = deadlineNanos % 1000000000;
+    if (deadlineNanos == 0) {
+      spec.it_value.tv_nsec = 1; // zero would disarm it
+    }
+    if (0 != timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL)) {
+      perror("timerfd_settime");
+    }
+  }
+
+  void stop() {
+    struct itimerspec spec = {};
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+  }
+
+  // Returns whether it fired since the last call.
+  bool fired() {
+    uint64_t count = 0;
+    return read(timer_fd, &count, sizeof(count)) == sizeof(count) && count > 0;
+  }
+};
+
+// Blocks the given signals and delivers them as readable events instead of async handlers.
+class SignalWatcher {
+  int signal_fd;
+public:
+  SignalWatcher(std::initializer_list<int> signums) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int signum : signums) {
+      sigaddset(&mask, signum);
+    }
+    if (0 != sigprocmask(SIG_BLOCK, &mask, NULL)) {
+      perror("sigprocmask");
+      exit(EXIT_FAILURE);
+    }
+    if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+      perror("signalfd");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ~SignalWatcher() {
+    close(signal_fd);
+  }
+
+  int fd() {
+    return signal_fd;
+  }
+
+  // Returns the next pending signal number, or 0 if there is none.
+  int next() {
+    struct signalfd_siginfo info;
+    if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+      return 0;
+    }
+    return info.ssi_signo;
+  }
+};
+
+#endif
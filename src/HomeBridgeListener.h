@@ -1,19 +1,29 @@
 #ifndef HOMEBRIDGELISTENER_H
 #define HOMEBRIDGELISTENER_H
 
-#include <unistd.h> 
-#include <stdio.h> 
+#include <unistd.h>
+#include <stdio.h>
 #include <sys/types.h>
-#include <sys/socket.h> 
-#include <stdlib.h> 
-#include <netinet/in.h> 
-#include <string.h> 
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <string.h>
 #include <fcntl.h>
-#include <sys/errno.h>
+#include <errno.h>
 
+#include <algorithm>
 #include <string>
-#include <sstream>
-#include <iostream>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+
+#include "EventLoop.h"
+#include "HttpParser.h"
+#include "SPSCQueue.h"
+#include "Seqlock.h"
+#include "Metrics.h"
+#include "Trace.h"
 
 #define PORT 8080
 
@@ -21,131 +31,406 @@ enum RemoteCommand {
     none, on, off
 };
 
+// Serves the HomeBridge REST API on its own thread. The render thread only ever touches
+// the command queue, the wake fds and the published status, none of which can block.
+//
+// GET /api/events is a server-sent event stream: it sends the display state straight away
+// and again whenever it changes, so HomeBridge can keep one connection open and cache the
+// state instead of polling /api/status.
 class HomeBridgeListener {
+public:
+    struct Status {
+        bool displayOn;
+    };
+
+    // Written by the listener thread, drained by the render thread after commandFd() wakes it.
+    SPSCQueue<RemoteCommand, 16> commands;
+
 private:
-    int server_fd; 
-    struct sockaddr_in address; 
-    int sockopt = 1; 
-    int addrlen = sizeof(address); 
-public: 
+    static const int maxConnections = 16;
+    static const long idleTimeoutMillis = 60000;
+    // event streams get a comment line this often so proxies and clients see they're alive
+    static const long streamKeepAliveMillis = 15000;
+
+    struct Connection {
+        int fd;
+        HttpParser parser;
+        std::string outgoing;
+        bool closeAfterFlush = false;
+        bool streaming = false; // an /api/events stream; requests after it are ignored
+        long lastActivity = 0;
+    };
+
+    int server_fd;
+    int command_fd; // eventfd signalled for each queued command
+    int stop_fd;    // eventfd telling the listener thread to exit
+    int status_fd;  // eventfd signalled when the render thread publishes a new status
+    struct sockaddr_in address;
+    int sockopt = 1;
+
+    EventLoop loop;
+    FrameTimer sweepTimer;
+    std::unordered_map<int, Connection *> connections;
+    Seqlock<Status> status;
+    uint32_t eventId = 0;
+    int streamCount = 0;
+    bool lastPushedDisplayOn = true;
+    std::thread thread;
+
+    static void setNonBlocking(int fd) {
+        if (0 != fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    void acceptConnections() {
+        while (1) {
+            int new_socket = accept(server_fd, NULL, NULL);
+            if (new_socket < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("accept");
+                }
+                return;
+            }
+            if (connections.size() >= maxConnections) {
+                close(new_socket);
+                continue;
+            }
+            setNonBlocking(new_socket);
+            Connection *connection = new Connection();
+            connection->fd = new_socket;
+            connection->lastActivity = millis();
+            connections[new_socket] = connection;
+            loop.watch(new_socket, EPOLLIN, [this, connection](uint32_t events) {
+                handleEvents(connection, events);
+            });
+        }
+    }
+
+    void closeConnection(Connection *connection) {
+        if (connection->streaming) {
+            metrics.eventStreams.set(--streamCount);
+        }
+        loop.unwatch(connection->fd);
+        connections.erase(connection->fd);
+        if (0 != close(connection->fd)) {
+            perror("close");
+        }
+        delete connection;
+    }
+
+    void handleEvents(Connection *connection, uint32_t events) {
+        connection->lastActivity = millis();
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            closeConnection(connection);
+            return;
+        }
+        if (events & EPOLLOUT) {
+            if (!flush(connection)) {
+                return;
+            }
+        }
+        if (events & EPOLLIN) {
+            readRequests(connection);
+        }
+    }
+
+    void readRequests(Connection *connection) {
+        char buffer[1024];
+        bool peerClosed = false;
+        while (1) {
+            ssize_t count = read(connection->fd, buffer, sizeof(buffer));
+            if (count > 0) {
+                if (!connection->streaming) {
+                    connection->parser.append(buffer, count);
+                }
+                continue;
+            }
+            if (count == 0) {
+                // half-closed; still answer whatever was sent before the FIN
+                peerClosed = true;
+                break;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            closeConnection(connection);
+            return;
+        }
+
+        HttpRequest request;
+        HttpParser::Status parseStatus;
+        while (!connection->closeAfterFlush && !connection->streaming
+               && (parseStatus = connection->parser.next(request)) != HttpParser::incomplete) {
+            if (parseStatus == HttpParser::malformed) {
+                respond(connection, "400 Bad Request", "text/plain", "", false);
+                break;
+            }
+            route(connection, request);
+        }
+        if (peerClosed) {
+            connection->closeAfterFlush = true;
+        }
+        flush(connection);
+    }
+
+    void route(Connection *connection, const HttpRequest &request) {
+        TRACE_SCOPE("http request");
+        if (request.method == "GET" && request.path == "/api/status") {
+            logDebug("Received a status request from HomeBridge!");
+            respond(connection, "200 OK", "application/json",
+                    status.read().displayOn ? "true" : "false", request.keepAlive);
+        } else if (request.method == "POST" && request.path == "/api/order") {
+            // {"targetState":true}
+            logDebug("Received a set-state request from HomeBridge!");
+            RemoteCommand command = none;
+            const char *target_str = "targetState\":";
+            size_t pos = request.body.find(target_str);
+            if (pos != std::string::npos) {
+                pos = request.body.find_first_not_of(" ", pos + strlen(target_str));
+                if (pos != std::string::npos && request.body.compare(pos, 4, "true") == 0) {
+                    command = on;
+                } else if (pos != std::string::npos && request.body.compare(pos, 5, "false") == 0) {
+                    command = off;
+                }
+            }
+            if (command == none) {
+                respond(connection, "400 Bad Request", "text/plain", "", request.keepAlive);
+            } else if (!commands.push(command)) {
+                respond(connection, "503 Service Unavailable", "text/plain", "", request.keepAlive);
+            } else {
+                uint64_t one = 1;
+                if (write(command_fd, &one, sizeof(one)) != sizeof(one)) {
+                    perror("write");
+                }
+                respond(connection, "200 OK", "text/plain", "", request.keepAlive);
+            }
+        } else if (request.method == "GET" && request.path == "/api/events") {
+            startEventStream(connection);
+        } else if (request.method == "GET" && request.path == "/api/metrics") {
+            respond(connection, "200 OK", "text/plain; version=0.0.4",
+                    metrics.renderPrometheus(), request.keepAlive);
+        } else if (request.method == "GET" && request.path.compare(0, 10, "/api/trace") == 0) {
+            // /api/trace?seconds=N, defaults to the last 10 s, at most 30
+            double seconds = 10;
+            size_t pos = request.path.find("seconds=");
+            if (pos != std::string::npos) {
+                seconds = atof(request.path.c_str() + pos + strlen("seconds="));
+            }
+            if (!(seconds > 0)) {
+                respond(connection, "400 Bad Request", "text/plain", "", request.keepAlive);
+            } else {
+                seconds = std::min(seconds, 30.0);
+                respond(connection, "200 OK", "application/json",
+                        traceDumpChromeJson(seconds * 1e9), request.keepAlive);
+            }
+        } else {
+            respond(connection, "404 Not Found", "text/plain", "", request.keepAlive);
+        }
+    }
+
+    void respond(Connection *connection, const char *statusLine, const char *contentType,
+                 const std::string &body, bool keepAlive) {
+        char header[256];
+        snprintf(header, sizeof(header),
+                 "HTTP/1.1 %s\r\nContent-Length: %u\r\nContent-Type: %s\r\nConnection: %s\r\n\r\n",
+                 statusLine, (unsigned int)body.size(), contentType, keepAlive ? "keep-alive" : "close");
+        connection->outgoing += header;
+        connection->outgoing += body;
+        if (!keepAlive) {
+            connection->closeAfterFlush = true;
+        }
+    }
+
+    void startEventStream(Connection *connection) {
+        connection->outgoing += "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                                "Cache-Control: no-cache\r\nConnection: keep-alive\r\n\r\n";
+        connection->streaming = true;
+        metrics.eventStreams.set(++streamCount);
+        appendStateEvent(connection, status.read().displayOn);
+    }
+
+    void appendStateEvent(Connection *connection, bool displayOn) {
+        char event[64];
+        snprintf(event, sizeof(event), "id: %u\nevent: state\ndata: %s\n\n", eventId, displayOn ? "true" : "false");
+        connection->outgoing += event;
+    }
+
+    // Runs when the render thread has published a status; pushes it if it changed.
+    void pushStatus() {
+        uint64_t count;
+        if (read(status_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("read");
+        }
+        bool displayOn = status.read().displayOn;
+        if (displayOn == lastPushedDisplayOn) {
+            return;
+        }
+        lastPushedDisplayOn = displayOn;
+        ++eventId;
+        std::vector<Connection *> streams;
+        for (auto &entry : connections) {
+            if (entry.second->streaming) {
+                streams.push_back(entry.second);
+            }
+        }
+        for (Connection *connection : streams) {
+            appendStateEvent(connection, displayOn);
+            flush(connection);
+        }
+    }
+
+    // Writes as much as the socket will take. Returns false if the connection was closed.
+    bool flush(Connection *connection) {
+        while (!connection->outgoing.empty()) {
+            ssize_t sent = send(connection->fd, connection->outgoing.data(), connection->outgoing.size(), MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                closeConnection(connection);
+                return false;
+            }
+            connection->outgoing.erase(0, sent);
+        }
+        if (connection->outgoing.empty() && connection->closeAfterFlush) {
+            closeConnection(connection);
+            return false;
+        }
+        loop.modify(connection->fd, connection->outgoing.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT));
+        return true;
+    }
+
+    void closeIdleConnections() {
+        long now = millis();
+        std::vector<Connection *> idle;
+        std::vector<Connection *> quietStreams;
+        for (auto &entry : connections) {
+            if (entry.second->streaming) {
+                if (now - entry.second->lastActivity > streamKeepAliveMillis) {
+                    quietStreams.push_back(entry.second);
+                }
+            } else if (now - entry.second->lastActivity > idleTimeoutMillis) {
+                idle.push_back(entry.second);
+            }
+        }
+        for (Connection *connection : quietStreams) {
+            // a stream whose peer has gone away fails here and gets closed
+            connection->lastActivity = now;
+            connection->outgoing += ": keep-alive\n\n";
+            flush(connection);
+        }
+        for (Connection *connection : idle) {
+            closeConnection(connection);
+        }
+    }
+
+    void run() {
+        TRACE_THREAD_NAME("listener");
+        loop.watch(server_fd, EPOLLIN, [this](uint32_t events) {
+            acceptConnections();
+        });
+        loop.watch(stop_fd, EPOLLIN, [this](uint32_t events) {
+            loop.stop();
+        });
+        loop.watch(status_fd, EPOLLIN, [this](uint32_t events) {
+            pushStatus();
+        });
+        loop.watch(sweepTimer.fd(), EPOLLIN, [this](uint32_t events) {
+            sweepTimer.expirations();
+            closeIdleConnections();
+        });
+        sweepTimer.start(5000 * 1000000L);
+        loop.run();
+
+        while (!connections.empty()) {
+            closeConnection(connections.begin()->second);
+        }
+    }
+
+public:
     HomeBridgeListener() {
-        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
             perror("socket failed");
             exit(EXIT_FAILURE);
         }
-        
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, 
-                                                      &sockopt, sizeof(sockopt))) { 
+
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR,
+                                                      &sockopt, sizeof(sockopt))) {
             perror("setsockopt");
             exit(EXIT_FAILURE);
         }
 
-        if (0 != fcntl(server_fd, F_SETFL, O_NONBLOCK)) {
-            perror("fcntl");
-            exit(EXIT_FAILURE);
-        }
+        setNonBlocking(server_fd);
 
-        address.sin_family = AF_INET; 
+        address.sin_family = AF_INET;
         address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
         address.sin_port = htons(PORT);
-        
+
         if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
             perror("bind failed");
             exit(EXIT_FAILURE);
         }
 
-        if (listen(server_fd, 3) < 0) {
+        if (listen(server_fd, 16) < 0) {
             perror("listen");
             exit(EXIT_FAILURE);
         }
-    }
 
-    ~HomeBridgeListener() {
-        if (0 != close(server_fd)) {
-            perror("close");
+        if ((command_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+            || (stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+            || (status_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            perror("eventfd");
+            exit(EXIT_FAILURE);
         }
+        status.publish({ .displayOn = true });
     }
 
-     RemoteCommand poll(bool status) {
-        int new_socket;
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) { 
-            if (errno == EAGAIN) {
-                return none;
+    ~HomeBridgeListener() {
+        if (thread.joinable()) {
+            uint64_t one = 1;
+            if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+                perror("write");
             }
-            perror("accept");
-            exit(EXIT_FAILURE);
+            thread.join();
         }
-        char buffer[1024] = {0};
-        int read_status = read(new_socket, buffer, 1024);
-        // printf("--\n%s\n--\n", buffer);
-
-        // Here we interpret a restful HTTP request with a janky restful http parsing.
-        // Need to support GET and POST
-
-        /*
-        GET /api/status HTTP/1.1
-        host: 127.0.0.1:8080
-        */
-
-        std::string kGetStateRequest("GET /api/status HTTP/");
-        std::string request(buffer);
-        auto res = std::mismatch(kGetStateRequest.begin(), kGetStateRequest.end(), request.begin());
-
-        if (res.first == kGetStateRequest.end()) {
-            // Made a status request!
-            printf("Received a status request from HomeBridge!\n");
-            const char *status_str = (status ? "true" : "false");
-            char response[128];
-            snprintf(response, 128, "HTTP/1.1 200 OK\nContent-Length: %i\nContent-Type: application/json\n\n%s", (unsigned int)strlen(status_str), status_str);
-            send(new_socket, response,  strlen(response), 0);
-            // printf("Response:\n--\n%s\n--\n", response);
+        if (0 != close(server_fd)) {
+            perror("close");
         }
+        close(command_fd);
+        close(stop_fd);
+        close(status_fd);
+    }
 
-        /*
-        POST /api/order HTTP/1.1
-        Content-type: application/json
-        host: 127.0.0.1:8080
-        content-length: 20
-        Connection: close
-
-        {"targetState":true}
-        */
-
-        RemoteCommand command = none;
-        std::string kSetStateRequest("POST /api/order HTTP/");
-        res = std::mismatch(kSetStateRequest.begin(), kSetStateRequest.end(), request.begin());
-
-        if (res.first == kSetStateRequest.end()) {
-            // Made a state-change request!
-            printf("Received a set-state request from HomeBridge!\n");
+    void start() {
+        thread = std::thread(&HomeBridgeListener::run, this);
+    }
 
-            const char *response;
-            const char *target_str = "targetState\":";
-            size_t pos = request.find(target_str, 0);
-            if (pos != std::string::npos) {
-                pos += strlen(target_str);
-                if (request.compare(pos, 4, "true") == 0) {
-                    command = on;
-                    response = "HTTP/1.1 200 OK\n\n";
-                } else if (request.compare(pos, 5, "false") == 0) {
-                    command = off;
-                    response = "HTTP/1.1 200 OK\n\n";
-                }
-            }
-            if (command == none) {
-                response = "HTTP/1.1 400 BAD REQUEST\n\n";
-            };
+    // Readable whenever commands are waiting in the queue.
+    int commandFd() {
+        return command_fd;
+    }
 
-            send(new_socket, response,  strlen(response), 0);
-            // printf("Response:\n--\n%s\n--\n", response);
+    void clearCommandFd() {
+        uint64_t count;
+        if (read(command_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("read");
         }
+    }
 
-        if (0 != close(new_socket)) {
-            perror("close");
-            exit(EXIT_FAILURE);
+    void publishStatus(bool displayOn) {
+        status.publish({ .displayOn = displayOn });
+        uint64_t one = 1;
+        if (write(status_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write");
         }
-        printf("Done polling\n");
-        return command;
     }
 };
 
@@ -0,0 +1,133 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <string>
+
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::string body;
+    bool keepAlive = true;
+};
+
+// Incremental HTTP/1.1 request parser. Bytes are appended as they arrive and requests are
+// pulled off the front once complete, so partial reads and pipelined requests both work.
+class HttpParser {
+    static const size_t maxHeaderLength = 8192;
+    static const size_t maxBodyLength = 4096;
+
+    std::string buffer;
+    size_t scanOffset = 0; // where to resume looking for the end of the headers
+public:
+    enum Status {
+        incomplete, complete, malformed
+    };
+
+    void append(const char *data, size_t length) {
+        buffer.append(data, length);
+    }
+
+    bool hasBufferedData() {
+        return !buffer.empty();
+    }
+
+    Status next(HttpRequest &request) {
+        // accept bare \n line endings as well, the old listener was this forgiving
+        size_t headerEnd = std::string::npos;
+        size_t separatorLength = 0;
+        for (size_t i = scanOffset; i < buffer.size(); ++i) {
+            if (buffer[i] != '\n') {
+                continue;
+            }
+            if (i + 1 < buffer.size() && buffer[i + 1] == '\n') {
+                headerEnd = i;
+                separatorLength = 2;
+                break;
+            }
+            if (i + 2 < buffer.size() && buffer[i + 1] == '\r' && buffer[i + 2] == '\n') {
+                headerEnd = i;
+                separatorLength = 3;
+                break;
+            }
+        }
+        if (headerEnd == std::string::npos) {
+            // the terminator may straddle this read and the next one
+            scanOffset = buffer.size() > 2 ? buffer.size() - 2 : 0;
+            return buffer.size() > maxHeaderLength ? malformed : incomplete;
+        }
+
+        request = HttpRequest();
+        size_t contentLength = 0;
+        bool http10 = false;
+
+        size_t lineStart = 0;
+        bool firstLine = true;
+        while (lineStart < headerEnd) {
+            size_t lineEnd = buffer.find('\n', lineStart);
+            if (lineEnd == std::string::npos || lineEnd > headerEnd) {
+                lineEnd = headerEnd;
+            }
+            std::string line = buffer.substr(lineStart, lineEnd - lineStart);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            lineStart = lineEnd + 1;
+
+            if (firstLine) {
+                firstLine = false;
+                size_t methodEnd = line.find(' ');
+                size_t pathEnd = line.find(' ', methodEnd + 1);
+                if (methodEnd == std::string::npos || pathEnd == std::string::npos
+                    || line.compare(pathEnd + 1, 5, "HTTP/") != 0) {
+                    return malformed;
+                }
+                request.method = line.substr(0, methodEnd);
+                request.path = line.substr(methodEnd + 1, pathEnd - methodEnd - 1);
+                http10 = (line.compare(pathEnd + 1, 8, "HTTP/1.0") == 0);
+                request.keepAlive = !http10;
+                continue;
+            }
+
+            size_t colon = line.find(':');
+            if (colon == std::string::npos) {
+                return malformed;
+            }
+            std::string name = line.substr(0, colon);
+            size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+            std::string value = (valueStart == std::string::npos ? "" : line.substr(valueStart));
+
+            if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+                char *end;
+                contentLength = strtoul(value.c_str(), &end, 10);
+                if (*end != '\0' || contentLength > maxBodyLength) {
+                    return malformed;
+                }
+            } else if (strcasecmp(name.c_str(), "Connection") == 0) {
+                if (strcasecmp(value.c_str(), "close") == 0) {
+                    request.keepAlive = false;
+                } else if (strcasecmp(value.c_str(), "keep-alive") == 0) {
+                    request.keepAlive = true;
+                }
+            } else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+                // nobody talking to us sends chunked bodies
+                return malformed;
+            }
+        }
+
+        size_t bodyStart = headerEnd + separatorLength;
+        if (buffer.size() < bodyStart + contentLength) {
+            scanOffset = headerEnd;
+            return incomplete;
+        }
+        request.body = buffer.substr(bodyStart, contentLength);
+        buffer.erase(0, bodyStart + contentLength);
+        scanOffset = 0;
+        return complete;
+    }
+};
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <atomic>
+#include <thread>
+
+// Asynchronous logging. Callers format straight into a preallocated slot of a lock-free
+// ring and return; a background thread writes the slots out. Logging from the render
+// thread therefore never blocks on a slow stdout pipe and makes no allocations; the only
+// syscall is waking the drain thread when it has gone to sleep on an empty ring. If the
+// ring is full the message is dropped and counted.
+
+enum LogLevel {
+  logLevelDebug, logLevelInfo, logLevelWarn, logLevelError
+};
+
+// Messages below this level are compiled out entirely.
+#ifndef LOG_MIN_LEVEL
+#if DEBUG
+#define LOG_MIN_LEVEL logLevelDebug
+#else
+#define LOG_MIN_LEVEL logLevelInfo
+#endif
+#endif
+
+class Logger {
+  static const size_t capacity = 256; // power of two
+  static const size_t maxMessage = 240;
+
+  // Bounded multi-producer ring: a slot's sequence says whether it is free for the
+  // producer claiming position p (sequence == p) or ready for the consumer (p + 1).
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    uint8_t level;
+    bool newline;
+    uint16_t length;
+    char text[maxMessage];
+  };
+
+  Slot slots[capacity];
+  alignas(64) std::atomic<uint64_t> enqueuePos{0};
+  alignas(64) uint64_t dequeuePos = 0; // drain thread only
+  std::atomic<uint64_t> dropped{0};
+
+  FILE *output = stdout;
+  std::thread thread;
+  std::atomic<bool> running{false};
+  std::atomic<bool> stopping{false};
+  // the drain thread blocks reading wakeFd while it has nothing to write, and says so here
+  int wakeFd = -1;
+  std::atomic<bool> sleeping{false};
+  std::atomic<bool> muted{false};
+
+  static const char *prefix(int level) {
+    switch (level) {
+      case logLevelDebug: return "[debug] ";
+      case logLevelWarn: return "[warn] ";
+      case logLevelError: return "[error] ";
+      default: return "";
+    }
+  }
+
+  // Writes out everything queued so far. Returns the number of messages written.
+  int drain() {
+    int written = 0;
+    while (1) {
+      Slot &slot = slots[dequeuePos & (capacity - 1)];
+      if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+        break;
+      }
+      fputs(prefix(slot.level), output);
+      fwrite(slot.text, 1, slot.length, output);
+      if (slot.newline) {
+        fputc('\n', output);
+      }
+      slot.sequence.store(dequeuePos + capacity, std::memory_order_release);
+      ++dequeuePos;
+      ++written;
+    }
+    uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost > 0) {
+      fprintf(output, "[warn] log ring full, dropped %llu messages\n", (unsigned long long)lost);
+    }
+    if (written > 0 || lost > 0) {
+      fflush(output);
+    }
+    return written;
+  }
+
+  bool isEmpty() {
+    return slots[dequeuePos & (capacity - 1)].sequence.load(std::memory_order_acquire) != dequeuePos + 1;
+  }
+
+  void wake() {
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) != sizeof(one)) {
+      perror("write");
+    }
+  }
+
+  void wakeIfSleeping() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false, std::memory_order_relaxed)) {
+      wake();
+    }
+  }
+
+  void run() {
+    while (!stopping.load(std::memory_order_acquire)) {
+      if (drain() > 0) {
+        continue;
+      }
+      // Announce the sleep before the last look at the ring; a producer publishes before
+      // it looks at the flag, so one of the two always sees the other.
+      sleeping.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (isEmpty() && dropped.load(std::memory_order_relaxed) == 0 && !stopping.load(std::memory_order_acquire)) {
+        uint64_t count;
+        if (read(wakeFd, &count, sizeof(count)) != sizeof(count)) {
+          perror("read");
+        }
+      }
+      sleeping.store(false, std::memory_order_relaxed);
+    }
+    drain();
+  }
+public:
+  Logger() {
+    for (size_t i = 0; i < capacity; ++i) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  ~Logger() {
+    stop();
+    if (wakeFd >= 0) {
+      close(wakeFd);
+    }
+  }
+
+  // Until start() is called, messages are written synchronously.
+  void start(FILE *out = stdout) {
+    output = out;
+    if ((wakeFd = eventfd(0, EFD_CLOEXEC)) < 0) {
+      perror("eventfd");
+      return;
+    }
+    running.store(true, std::memory_order_release);
+    thread = std::thread(&Logger::run, this);
+  }
+
+  // Flushes whatever is queued and joins the drain thread.
+  void stop() {
+    if (thread.joinable()) {
+      stopping.store(true, std::memory_order_release);
+      wake();
+      thread.join();
+      running.store(false, std::memory_order_release);
+    }
+  }
+
+  // Drops every message until unmuted, for timing code that logs without timing the logging.
+  void setMuted(bool mute) {
+    muted.store(mute, std::memory_order_relaxed);
+  }
+
+  void vlog(int level, bool newline, const char *format, va_list args) {
+    if (muted.load(std::memory_order_relaxed)) {
+      return;
+    }
+    if (!running.load(std::memory_order_acquire)) {
+      fputs(prefix(level), output);
+      vfprintf(output, format, args);
+      if (newline) {
+        fputc('\n', output);
+      }
+      return;
+    }
+
+    uint64_t pos = enqueuePos.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (1) {
+      slot = &slots[pos & (capacity - 1)];
+      int64_t diff = (int64_t)slot->sequence.load(std::memory_order_acquire) - (int64_t)pos;
+      if (diff == 0) {
+        if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        wakeIfSleeping();
+        return;
+      } else {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    int length = vsnprintf(slot->text, maxMessage, format, args);
+    if (length < 0) {
+      length = 0;
+    } else if (length >= (int)maxMessage) {
+      // truncated; mark it so it isn't mistaken for the whole message
+      length = maxMessage - 1;
+      memcpy(slot->text + maxMessage - 4, "...", 3);
+    }
+    slot->length = length;
+    slot->level = level;
+    slot->newline = newline;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    wakeIfSleeping();
+  }
+
+  void log(int level, bool newline, const char *format, ...) __attribute__((format(printf, 4, 5))) {
+    va_list args;
+    va_start(args, format);
+    vlog(level, newline, format, args);
+    va_end(args);
+  }
+};
+
+Logger logger;
+
+// Lets one message through per interval from a call site and reports how many were
+// swallowed in between. Safe to share between threads.
+class LogRateLimit {
+  std::atomic<uint64_t> nextAllowed{0};
+  std::atomic<uint32_t> suppressed{0};
+public:
+  // Returns true if the caller should log; *skipped is set to the count suppressed since.
+  bool allow(uint64_t intervalMillis, uint32_t *skipped) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    uint64_t next = nextAllowed.load(std::memory_order_relaxed);
+    if (now < next || !nextAllowed.compare_exchange_strong(next, now + intervalMillis, std::memory_order_relaxed)) {
+      suppressed.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    *skipped = suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+};
+
+#define LOG_AT(level, ...) do { \
+    if ((level) >= LOG_MIN_LEVEL) { \
+      logger.log((level), true, __VA_ARGS__); \
+    } \
+  } while (0)
+
+#define logDebug(...) LOG_AT(logLevelDebug, __VA_ARGS__)
+#define logWarn(...) LOG_AT(logLevelWarn, __VA_ARGS__)
+#define logError(...) LOG_AT(logLevelError, __VA_ARGS__)
+
+// Logs at most once per intervalMillis from this call site.
+#define logRateLimited(intervalMillis, level, ...) do { \
+    static LogRateLimit _logRateLimit; \
+    uint32_t _logSkipped; \
+    if ((level) >= LOG_MIN_LEVEL && _logRateLimit.allow((intervalMillis), &_logSkipped)) { \
+      logger.log((level), true, __VA_ARGS__); \
+      if (_logSkipped > 0) { \
+        logger.log((level), true, "  (%u similar messages suppressed)", _logSkipped); \
+      } \
+    } \
+  } while (0)
+
+#endif
@@ -0,0 +1,270 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+
+#include "util.h"
+
+// Counters and histograms for the Prometheus endpoint. Every metric has a single writer
+// (normally the render thread), so recording is a relaxed load and store with no
+// read-modify-write loop: wait-free, and cheap enough to leave on in the hot path.
+// The listener thread reads them concurrently and may see a histogram mid-update,
+// which Prometheus tolerates.
+
+class Counter {
+  std::atomic<uint64_t> value{0};
+public:
+  void inc(uint64_t amount = 1) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+  }
+  uint64_t get() const {
+    return value.load(std::memory_order_relaxed);
+  }
+};
+
+class Gauge {
+  std::atomic<double> value{0};
+public:
+  void set(double v) {
+    value.store(v, std::memory_order_relaxed);
+  }
+  double get() const {
+    return value.load(std::memory_order_relaxed);
+  }
+};
+
+// Durations in nanoseconds, exported in seconds with fixed buckets suited to frame timing.
+class Histogram {
+public:
+  static const int bucketCount = 11;
+  static constexpr uint64_t frameBounds[bucketCount] = {
+    250000, 500000, 1000000, 2000000, 4000000, 8000000,
+    16666667, 33333333, 66666667, 250000000, 1000000000,
+  };
+  // for scheduling delays, which are mostly well under a millisecond
+  static constexpr uint64_t wakeupBounds[bucketCount] = {
+    10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2000000, 4000000, 8000000, 16666667,
+  };
+private:
+  const uint64_t *bounds;
+  std::atomic<uint64_t> buckets[bucketCount + 1] = {}; // last one is +Inf
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> count{0};
+
+  static void bump(std::atomic<uint64_t> &v, uint64_t amount) {
+    v.store(v.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+  }
+public:
+  Histogram(const uint64_t *bounds = frameBounds) : bounds(bounds) { }
+
+  void observe(uint64_t nanos) {
+    int b = 0;
+    while (b < bucketCount && nanos > bounds[b]) {
+      ++b;
+    }
+    bump(buckets[b], 1);
+    bump(sum, nanos);
+    bump(count, 1);
+  }
+
+  void render(std::string &out, const char *name, const char *labels = NULL) const {
+    char line[256];
+    const char *sep = (labels ? "," : "");
+    labels = (labels ? labels : "");
+    uint64_t cumulative = 0;
+    for (int b = 0; b <= bucketCount; ++b) {
+      cumulative += buckets[b].load(std::memory_order_relaxed);
+      if (b < bucketCount) {
+        snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                 bounds[b] / 1e9, (unsigned long long)cumulative);
+      } else {
+        snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+                 (unsigned long long)cumulative);
+      }
+      out += line;
+    }
+    if (*labels) {
+      snprintf(line, sizeof(line), "%s_sum{%s} %.9f\n%s_count{%s} %llu\n", name, labels,
+               sum.load(std::memory_order_relaxed) / 1e9, name, labels,
+               (unsigned long long)count.load(std::memory_order_relaxed));
+    } else {
+      snprintf(line, sizeof(line), "%s_sum %.9f\n%s_count %llu\n", name,
+               sum.load(std::memory_order_relaxed) / 1e9, name,
+               (unsigned long long)count.load(std::memory_order_relaxed));
+    }
+    out += line;
+  }
+};
+
+constexpr uint64_t Histogram::frameBounds[];
+constexpr uint64_t Histogram::wakeupBounds[];
+
+// A fixed set of histograms keyed by a static string such as a pattern description.
+// Slots are claimed on first use by the single writer, so lookups never allocate.
+template <int SLOTS>
+class LabeledHistogram {
+  std::atomic<const char *> labels[SLOTS] = {};
+  Histogram histograms[SLOTS];
+public:
+  Histogram *get(const char *label) {
+    for (int i = 0; i < SLOTS; ++i) {
+      const char *l = labels[i].load(std::memory_order_relaxed);
+      if (l == label || (l && strcmp(l, label) == 0)) {
+        return &histograms[i];
+      }
+      if (l == NULL) {
+        labels[i].store(label, std::memory_order_release);
+        return &histograms[i];
+      }
+    }
+    return NULL;
+  }
+
+  void render(std::string &out, const char *name, const char *labelName) const {
+    char labelText[128];
+    for (int i = 0; i < SLOTS; ++i) {
+      const char *l = labels[i].load(std::memory_order_acquire);
+      if (l == NULL) {
+        break;
+      }
+      snprintf(labelText, sizeof(labelText), "%s=\"%s\"", labelName, l);
+      histograms[i].render(out, name, labelText);
+    }
+  }
+};
+
+// Records the lifetime of the scope into a histogram.
+class ScopedTimer {
+  Histogram *histogram;
+  uint64_t start;
+public:
+  ScopedTimer(Histogram *histogram) : histogram(histogram), start(monotonicNanos()) { }
+  ~ScopedTimer() {
+    if (histogram) {
+      histogram->observe(monotonicNanos() - start);
+    }
+  }
+};
+
+struct OrthoMetrics {
+  Histogram frameTime;
+  Histogram frameLateness{Histogram::wakeupBounds}; // frame tick due to the render thread picking it up
+  LabeledHistogram<16> patternUpdateTime;
+  Histogram blendTime;
+  Histogram opcSendTime;
+  Histogram audioLatency;    // audio captured to features published
+  Histogram audioFeatureAge; // audio captured to features read by a pattern
+  Histogram patternSwitchTime; // PatternManager::loop on frames that switch patterns
+
+  Counter frames;
+  Counter droppedFrames;      // frame ticks that were missed outright
+  Counter backpressureFrames; // rendered but not sent because fcserver was still draining
+  Counter lateFrames;         // took longer than the frame budget
+  Counter reconnects;
+  Counter bytesSent;
+  Counter powerLimitedFrames;
+  Counter preparedPatternSwitches;   // swapped in ready-made
+  Counter unpreparedPatternSwitches; // constructed on the render thread
+
+  std::atomic<const char *> activePattern{NULL};
+  Gauge paletteIndex;
+  Gauge displayOn;
+  Gauge qualityLevel;
+  Gauge averageFrameTime;
+  Gauge powerDraw;       // amps
+  Gauge powerLimitScale; // 1 when the power limiter isn't dimming
+  Gauge eventStreams;    // open /api/events connections
+
+  static void family(std::string &out, const char *name, const char *type, const char *help) {
+    out += "# HELP ";
+    out += name;
+    out += " ";
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " ";
+    out += type;
+    out += "\n";
+  }
+
+  static void sample(std::string &out, const char *name, double value, const char *labels = NULL) {
+    char line[256];
+    if (labels) {
+      snprintf(line, sizeof(line), "%s{%s} %.17g\n", name, labels, value);
+    } else {
+      snprintf(line, sizeof(line), "%s %.17g\n", name, value);
+    }
+    out += line;
+  }
+
+  std::string renderPrometheus() const {
+    std::string out;
+    family(out, "ortho_frame_seconds", "histogram", "Time to render and send one frame.");
+    frameTime.render(out, "ortho_frame_seconds");
+    family(out, "ortho_frame_lateness_seconds", "histogram", "Time from a frame tick falling due to the render thread starting on it.");
+    frameLateness.render(out, "ortho_frame_lateness_seconds");
+    family(out, "ortho_pattern_update_seconds", "histogram", "Time spent in Pattern::update, by pattern.");
+    patternUpdateTime.render(out, "ortho_pattern_update_seconds", "pattern");
+    family(out, "ortho_blend_seconds", "histogram", "Time spent in blendIntoContext.");
+    blendTime.render(out, "ortho_blend_seconds");
+    family(out, "ortho_opc_send_seconds", "histogram", "Time spent sending a frame to the OPC sink.");
+    opcSendTime.render(out, "ortho_opc_send_seconds");
+    family(out, "ortho_pattern_switch_seconds", "histogram", "Time spent in PatternManager::loop on frames that switch patterns.");
+    patternSwitchTime.render(out, "ortho_pattern_switch_seconds");
+    family(out, "ortho_audio_latency_seconds", "histogram", "Time from audio capture to its features being published.");
+    audioLatency.render(out, "ortho_audio_latency_seconds");
+    family(out, "ortho_audio_feature_age_seconds", "histogram", "Age of the audio features when a pattern reads them.");
+    audioFeatureAge.render(out, "ortho_audio_feature_age_seconds");
+
+    family(out, "ortho_frames_total", "counter", "Frames rendered.");
+    sample(out, "ortho_frames_total", frames.get());
+    family(out, "ortho_frames_dropped_total", "counter", "Frames not shown, by reason.");
+    sample(out, "ortho_frames_dropped_total", droppedFrames.get(), "reason=\"missed_tick\"");
+    sample(out, "ortho_frames_dropped_total", backpressureFrames.get(), "reason=\"backpressure\"");
+    family(out, "ortho_frames_late_total", "counter", "Frames that took longer than the frame budget.");
+    sample(out, "ortho_frames_late_total", lateFrames.get());
+    family(out, "ortho_opc_reconnects_total", "counter", "OPC sink connections opened.");
+    sample(out, "ortho_opc_reconnects_total", reconnects.get());
+    family(out, "ortho_opc_bytes_sent_total", "counter", "Bytes written to the OPC sink.");
+    sample(out, "ortho_opc_bytes_sent_total", bytesSent.get());
+
+    family(out, "ortho_pattern_switches_total", "counter", "Pattern switches, by whether the pattern was prepared in the background.");
+    sample(out, "ortho_pattern_switches_total", preparedPatternSwitches.get(), "prepared=\"true\"");
+    sample(out, "ortho_pattern_switches_total", unpreparedPatternSwitches.get(), "prepared=\"false\"");
+
+    family(out, "ortho_power_limited_frames_total", "counter", "Frames dimmed by the power limiter.");
+    sample(out, "ortho_power_limited_frames_total", powerLimitedFrames.get());
+
+    family(out, "ortho_display_on", "gauge", "1 if the display is on.");
+    sample(out, "ortho_display_on", displayOn.get());
+    const char *pattern = activePattern.load(std::memory_order_acquire);
+    if (pattern) {
+      char labels[128];
+      snprintf(labels, sizeof(labels), "pattern=\"%s\"", pattern);
+      family(out, "ortho_active_pattern", "gauge", "Currently running pattern.");
+      sample(out, "ortho_active_pattern", 1, labels);
+    }
+    family(out, "ortho_quality_level", "gauge", "Load shedding level chosen by the quality governor, 0 is full quality.");
+    sample(out, "ortho_quality_level", qualityLevel.get());
+    family(out, "ortho_frame_average_seconds", "gauge", "Smoothed frame time the quality governor is acting on.");
+    sample(out, "ortho_frame_average_seconds", averageFrameTime.get());
+    family(out, "ortho_power_draw_amps", "gauge", "Estimated LED current for the last frame sent.");
+    sample(out, "ortho_power_draw_amps", powerDraw.get());
+    family(out, "ortho_power_limit_scale", "gauge", "Scale the power limiter applied to the last frame, 1 is unlimited.");
+    sample(out, "ortho_power_limit_scale", powerLimitScale.get());
+    family(out, "ortho_http_event_streams", "gauge", "Open /api/events connections.");
+    sample(out, "ortho_http_event_streams", eventStreams.get());
+    family(out, "ortho_palette_index", "gauge", "Index of the most recently picked palette.");
+    sample(out, "ortho_palette_index", paletteIndex.get());
+    return out;
+  }
+};
+
+OrthoMetrics metrics;
+
+#endif
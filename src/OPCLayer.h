@@ -0,0 +1,155 @@
+#ifndef OPCLAYER_H
+#define OPCLAYER_H
+
+#include <algorithm>
+
+#include "opc/opc.h"
+#include "util.h"
+#include "drawing.h"
+#include "EventLoop.h"
+#include "Trace.h"
+
+// Pixels streamed in over OPC from another machine (say, a VJ laptop), composited with
+// the patterns. Each client's payloads are received straight into a drawing context of its
+// own, starting from what's shown, so a partial update composes on the current pixels. A
+// client that sends stream syncs has its frame shown on each sync, so the compositor only
+// sees whole frames; one that doesn't has each message shown as it completes, as fcserver
+// does. Showing copies the client's frame over the front context, so clients can't tear
+// each other's.
+template <typename BufferType>
+class OPCLayer {
+  struct Client {
+    BufferType frame;
+    bool synced = false;  // sends stream syncs, so frames end on those
+    bool touched = false; // has received pixels since its frame was last shown
+  };
+  BufferType front;
+  Client clients[OPC_MAX_CLIENTS];
+  opc_source source = -1;
+  long lastFrameMillis = -1;
+
+  EventLoop *eventLoop = NULL;
+  int watched[OPC_MAX_CLIENTS + 1];
+  int watchedCount = 0;
+
+  // drop the layer when the stream stops
+  static const long staleAfterMillis = 2000;
+
+  static OPCLayer *receiving;
+
+  static void handleEvent(u8 index, u8 event, u8 channel, u16 count, pixel *pixels) {
+    OPCLayer *layer = receiving;
+    Client &client = layer->clients[index];
+    switch (event) {
+      case OPC_EVENT_CONNECT:
+        client.synced = false;
+        layer->restart(client);
+        break;
+      case OPC_EVENT_PIXELS: {
+        int first = pixels - (pixel *)client.frame.leds;
+        for (int i = first; i < first + count; i += STICK_LENGTH) {
+          client.frame.touch(i);
+        }
+        if (count > 0) {
+          client.frame.touch(first + count - 1);
+        }
+        client.touched = true;
+        if (!client.synced) {
+          layer->show(client);
+        }
+        break;
+      }
+      case OPC_EVENT_SYNC:
+        client.synced = true;
+        layer->show(client);
+        break;
+    }
+  }
+
+  void restart(Client &client) {
+    client.frame = front;
+    client.touched = false;
+  }
+
+  void show(Client &shown) {
+    front = shown.frame;
+    lastFrameMillis = millis();
+    shown.touched = false;
+    // catch the others up on the new pixels, unless they've started a frame of their own
+    for (int i = 0; i < OPC_MAX_CLIENTS; ++i) {
+      if (&clients[i] != &shown && !clients[i].touched && !opc_client_receiving(source, i)) {
+        restart(clients[i]);
+      }
+    }
+  }
+
+  // The source's sockets come and go with its clients; keeps the event loop watching
+  // just the current ones.
+  void updateWatches() {
+    int fds[OPC_MAX_CLIENTS + 1];
+    int count = opc_source_fds(source, fds, ARRAY_SIZE(fds));
+    for (int i = 0; i < watchedCount; ++i) {
+      if (std::find(fds, fds + count, watched[i]) == fds + count) {
+        eventLoop->unwatch(watched[i]);
+      }
+    }
+    for (int i = 0; i < count; ++i) {
+      if (std::find(watched, watched + watchedCount, fds[i]) == watched + watchedCount) {
+        eventLoop->watch(fds[i], EPOLLIN, [this](uint32_t events) {
+          receive();
+        });
+      }
+    }
+    std::copy(fds, fds + count, watched);
+    watchedCount = count;
+  }
+public:
+  static_assert(sizeof(CRGB) == sizeof(pixel), "OPC payloads are received straight into the LED buffer");
+
+  bool listen(u16 port) {
+    source = opc_new_source(port);
+    if (source < 0) {
+      return false;
+    }
+    for (int i = 0; i < OPC_MAX_CLIENTS; ++i) {
+      opc_set_client_buffer(source, i, (pixel *)clients[i].frame.leds, NUM_LEDS);
+    }
+    return true;
+  }
+
+  // Takes in whatever has arrived as it arrives, so clients are read even while nothing
+  // is being rendered.
+  void watch(EventLoop &loop) {
+    if (source < 0) {
+      return;
+    }
+    eventLoop = &loop;
+    updateWatches();
+  }
+
+  // Takes in whatever has arrived without waiting.
+  void receive() {
+    if (source < 0) {
+      return;
+    }
+    TRACE_SCOPE("OPCLayer::receive");
+    receiving = this;
+    opc_receive_clients(source, handleEvent, 0);
+    if (eventLoop) {
+      updateWatches();
+    }
+  }
+
+  bool isLive() {
+    return lastFrameMillis != -1 && millis() - lastFrameMillis < staleAfterMillis;
+  }
+
+  void blendIntoContextWithOpacity(BufferType &ctx, BlendMode mode, uint8_t opacity=0xFF) {
+    front.blendIntoContextWithOpacity(ctx, mode, opacity);
+  }
+};
+
+template <typename BufferType>
+OPCLayer<BufferType> *OPCLayer<BufferType>::receiving = NULL;
+
+#endif
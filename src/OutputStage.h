@@ -0,0 +1,172 @@
+#ifndef OUTPUTSTAGE_H
+#define OUTPUTSTAGE_H
+
+#include <stdint.h>
+#include <math.h>
+
+#include "opc/opc.h"
+#include "util.h"
+#include "Metrics.h"
+
+// Turns the composited frame into the OPC payload in one pass: master brightness, gamma and
+// whitepoint are folded into a lookup table per channel, and a power limiter scales the
+// frame down to fit the PSU. Gamma and whitepoint are normally left to fcserver, which
+// corrects at 16 bits and dithers, so the tables only carry the brightness unless
+// setColorCorrection moves the correction here for a sink that doesn't do its own.
+//
+// The limiter estimates current from the duty each channel will actually be driven at: the
+// values sent, through whatever correction still happens downstream. The scale it applies
+// comes from the previous frame's draw, so the common case needs no second look at the
+// buffer; only when a frame jumps over the budget by more than that scale allows is the
+// payload rescaled in place, so the budget is never exceeded.
+template <int COUNT>
+class OutputStage {
+  uint8_t lut[3][256];
+  float gamma = 1;
+  float whitepoint[3] = {1, 1, 1};
+  uint8_t brightness = 0xFF;
+
+  // Duty per value sent, out of 0xFFFF. Starts out as fcserver's correction, matching
+  // fadecandy-config.json; linear once the correction is done here instead.
+  uint16_t duty[3][256];
+  float downstreamGamma = 2.2;
+
+  // WS2812-style pixels: about 20 mA per channel at full duty, ~1 mA quiescent per pixel
+  float milliampsPerChannel = 20;
+  float idleMilliampsPerPixel = 1;
+  long budgetMilliamps = 0; // 0 disables the limiter
+
+  uint16_t scale = 0x100; // 8.8 fixed point, applied after the lookup tables
+
+  void buildTables() {
+    for (int c = 0; c < 3; ++c) {
+      for (int v = 0; v < 256; ++v) {
+        float x = (v / 255.f) * (brightness / 255.f);
+        lut[c][v] = (uint8_t)lroundf(255 * whitepoint[c] * powf(x, gamma));
+      }
+    }
+  }
+
+  void buildDutyTables(float g, const float white[3]) {
+    downstreamGamma = g;
+    for (int c = 0; c < 3; ++c) {
+      for (int v = 0; v < 256; ++v) {
+        duty[c][v] = (uint16_t)lroundf(0xFFFF * white[c] * powf(v / 255.f, g));
+      }
+    }
+  }
+
+  float activeMilliamps(uint32_t dutySum) {
+    return dutySum / (float)0xFFFF * milliampsPerChannel;
+  }
+
+  // The largest 8.8 scale that keeps a frame with this (unscaled) duty sum in budget.
+  // Scaling the values sent by f scales the duty by f^gamma behind a downstream gamma.
+  uint16_t scaleForBudget(uint32_t dutySum) {
+    if (budgetMilliamps <= 0 || dutySum == 0) {
+      return 0x100;
+    }
+    float activeBudget = budgetMilliamps - COUNT * idleMilliampsPerPixel;
+    float activeDraw = activeMilliamps(dutySum);
+    if (activeDraw <= activeBudget) {
+      return 0x100;
+    }
+    if (activeBudget <= 0) {
+      return 0;
+    }
+    return (uint16_t)floorf(0x100 * powf(activeBudget / activeDraw, 1 / downstreamGamma));
+  }
+public:
+  OutputStage() {
+    const float fcserverWhitepoint[3] = {0.8, 0.8, 0.8};
+    buildTables();
+    buildDutyTables(2.2, fcserverWhitepoint);
+  }
+
+  void setBrightness(uint8_t b) {
+    brightness = b;
+    buildTables();
+  }
+
+  // Applies gamma and whitepoint here, for sinks that send the values straight to the LEDs.
+  void setColorCorrection(float g, const float white[3]) {
+    const float linear[3] = {1, 1, 1};
+    gamma = g;
+    for (int c = 0; c < 3; ++c) {
+      whitepoint[c] = white[c];
+    }
+    buildTables();
+    buildDutyTables(1, linear);
+  }
+
+  void setPowerBudget(long milliamps) {
+    budgetMilliamps = milliamps;
+    scale = 0x100;
+  }
+
+  // Writes the corrected pixels straight into an OPC frame laid out by opc_layout_frame,
+  // ready to send as is.
+  void process(const CRGB *in, u8 *frame, const opc_span *map, u8 spanCount) {
+    const uint16_t s = scale;
+    uint32_t sum = 0;
+    for (u8 span = 0; span < spanCount; ++span) {
+      sum += correct(in + map[span].first, opc_frame_pixels(frame, map, span), map[span].count, s);
+    }
+    uint16_t needed = scaleForBudget(sum);
+    if (needed < s) {
+      for (u8 span = 0; span < spanCount; ++span) {
+        rescale(opc_frame_pixels(frame, map, span), map[span].count, needed, s);
+      }
+    }
+    finishFrame(sum, needed, s);
+  }
+
+  void process(const CRGB *in, pixel *out) {
+    const uint16_t s = scale;
+    uint32_t sum = correct(in, out, COUNT, s);
+    uint16_t needed = scaleForBudget(sum);
+    if (needed < s) {
+      rescale(out, COUNT, needed, s);
+    }
+    finishFrame(sum, needed, s);
+  }
+private:
+  // Returns the summed duty of the corrected channel values before scaling.
+  uint32_t correct(const CRGB *in, pixel *out, int count, uint16_t s) {
+    uint32_t sum = 0;
+    for (int i = 0; i < count; ++i) {
+      uint8_t r = lut[0][in[i].r];
+      uint8_t g = lut[1][in[i].g];
+      uint8_t b = lut[2][in[i].b];
+      sum += duty[0][r] + duty[1][g] + duty[2][b];
+      out[i].r = (r * s) >> 8;
+      out[i].g = (g * s) >> 8;
+      out[i].b = (b * s) >> 8;
+    }
+    return sum;
+  }
+
+  // For a frame brighter than last frame by more than the limiter allowed for.
+  void rescale(pixel *out, int count, uint16_t needed, uint16_t s) {
+    for (int i = 0; i < count; ++i) {
+      out[i].r = (out[i].r * needed) / s;
+      out[i].g = (out[i].g * needed) / s;
+      out[i].b = (out[i].b * needed) / s;
+    }
+  }
+
+  void finishFrame(uint32_t sum, uint16_t needed, uint16_t s) {
+    uint16_t applied = (needed < s ? needed : s);
+    if (applied < 0x100) {
+      metrics.powerLimitedFrames.inc();
+    }
+    float drawMilliamps = COUNT * idleMilliampsPerPixel +
+                          activeMilliamps(sum) * powf(applied / 256.f, downstreamGamma);
+    scale = needed;
+
+    metrics.powerDraw.set(drawMilliamps / 1000);
+    metrics.powerLimitScale.set(applied / 256.);
+  }
+};
+
+#endif
@@ -1,39 +1,195 @@
 #ifndef PATTERNMANAGER_H
 #define PATTERNMANAGER_H
 
-#include <vector>
+#include <utility>
+#include <variant>
+#include <type_traits>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 #include "patterns.h"
+#include "OPCLayer.h"
+#include "Transitions.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Realtime.h"
 
 static const bool patternAutoRotateDefault = true;
 
-template <typename BufferType>
+// Compile-time pattern registry. Patterns live in variant slots sized for the largest one,
+// so switching patterns constructs in place without touching the heap, and update() is
+// dispatched with std::visit on the concrete type instead of through the vtable.
+template <typename... Patterns>
+struct PatternList {
+  static const int count = sizeof...(Patterns);
+  typedef std::variant<std::monostate, Patterns...> Storage;
+
+  static void emplace(Storage &slot, int index) {
+    emplace(slot, index, std::index_sequence_for<Patterns...>());
+  }
+private:
+  template <size_t... I>
+  static void emplace(Storage &slot, int index, std::index_sequence<I...>) {
+    // alternative 0 is the empty state
+    ((index == (int)I ? (void)slot.template emplace<I + 1>() : (void)0), ...);
+  }
+};
+
+typedef PatternList<RaverPlaid, Needles, Bits, Undulation, Breathe, Spectrum> OrthoPatterns;
+
+// A pattern to run for good as a layer over the rotation, as given on the command line:
+// INDEX[:over|brighten|darken[:OPACITY_PERCENT]]
+struct LayerSpec {
+  int patternIndex = -1;
+  BlendMode blendMode = blendBrighten;
+  uint8_t opacity = 0xFF;
+
+  bool parse(const char *spec) {
+    char mode[16] = "brighten";
+    int percent = 100;
+    if (sscanf(spec, "%d:%15[a-z]:%d", &patternIndex, mode, &percent) < 1 ||
+        !parseBlendMode(mode, &blendMode) || percent < 0 || percent > 100) {
+      return false;
+    }
+    opacity = percent * 0xFF / 100;
+    return true;
+  }
+};
+
+template <typename BufferType, typename Patterns = OrthoPatterns>
 class PatternManager {
+  typedef typename Patterns::Storage Storage;
+
   int patternIndex = -1;
 
+  // The active pattern, the one crossfading out and the next one being prepared each occupy
+  // one slot; pointers are kept alongside for the cold paths that don't care about the
+  // concrete type.
+  static const int slotCount = 3;
+  Storage slots[slotCount];
+
+  // Patterns with a preferred frame rate are only updated that often; the frames shown in
+  // between are interpolated from their last two renders, so they run one render behind.
+  struct Pacing {
+    long lastRenderMillis = -1;
+    BufferType earlier;
+    BufferType shown;
+  };
+  Pacing slotPacing[slotCount];
+
+  int activeSlot = -1;
+  int previousSlot = -1;
   Pattern *activePattern = NULL;
   Pattern *previousActivePattern = NULL;
-  const unsigned long crossfadeDuration = 1000;
+
+  static const unsigned long defaultCrossfadeDuration = 1000;
+  unsigned long crossfadeDuration = defaultCrossfadeDuration;
+  PatternQuality patternQuality = qualityFull;
   unsigned long activePatternStart = 0;
+  Transitions<NUM_LEDS> transitions;
 
   bool patternAutoRotate = patternAutoRotateDefault;
 
-  std::vector<Pattern * (*)(void)> patternConstructors;
-
   BufferType &ctx;
 
-  template<class T>
-  static Pattern *construct() {
-    return new T();
+  // Index of a pattern to always run instead of rotating, for testing idle patterns
+  int testIdlePatternIndex = -1;
+
+  // Layers composited along with the rotating patterns: patterns that run for good (Bits
+  // sparkling over whatever's rotating, say) or pixels streamed in over OPC. Each has its own
+  // blend mode and opacity; opacity mixes the blended result with what's underneath, as
+  // alpha would, so a half-opaque 'over' layer shows half of what it covers. Layers that
+  // are disabled, transparent or have nothing live to show are skipped without even
+  // updating, so idle slots cost nothing.
+  struct Layer {
+    bool inUse = false;
+    bool enabled = true;
+    bool abovePatterns = true;
+    BlendMode blendMode = blendBrighten;
+    uint8_t opacity = 0xFF;
+    Storage pattern;
+    Pacing pacing;
+    OPCLayer<BufferType> *external = NULL;
+  };
+  static const int maxLayers = 4;
+  Layer layers[maxLayers];
+
+  // whether anything has been drawn into this frame yet
+  bool frameDrawn = false;
+  // whether a pattern was switched in this frame, for the switch-frame timing
+  bool patternSwitched = false;
+
+  // Constructing and setting up a pattern takes long enough to hitch the frame it happens
+  // in, so with background preparation on the next pattern in the rotation is built on its
+  // own thread a little before the active one times out, and the switch just swaps it in.
+  // The render thread hands over a slot and reads back the state; it only ever waits on the
+  // preparing thread on cold paths, and the rotation holds off until the pattern is ready.
+  enum PrepareState {
+    prepareIdle,
+    preparePending,
+    prepareReady,
+    prepareDeclined, // the pattern didn't want to run
+  };
+  static const long prepareLeadMillis = 2000;
+  bool backgroundPreparation = false;
+  int preparedSlot = -1;
+  int preparedIndex = -1;
+  std::atomic<int> prepareState{prepareIdle};
+  std::thread prepareThread;
+  std::mutex prepareMutex;
+  std::condition_variable prepareCondition;
+  bool prepareStopping = false;
+
+  static Pattern *patternInSlot(Storage &slot) {
+    return std::visit([](auto &p) -> Pattern * {
+      if constexpr (std::is_same<std::decay_t<decltype(p)>, std::monostate>::value) {
+        return NULL;
+      } else {
+        return &p;
+      }
+    }, slot);
+  }
+
+  static void updatePatternInSlot(Storage &slot) {
+    std::visit([](auto &p) {
+      typedef std::decay_t<decltype(p)> T;
+      if constexpr (!std::is_same<T, std::monostate>::value) {
+        // qualified calls, so the compiler can inline the concrete step() and update()
+        for (int steps = p.stepsDue(); steps > 0; --steps) {
+          p.T::step(p.stepInterval());
+        }
+        p.T::update();
+        p.didUpdate();
+      }
+    }, slot);
   }
 
-  // Make testIdlePattern in this constructor instead of at global so the Pattern doesn't get made at launch
-  Pattern *TestIdlePattern() {
-    static Pattern *testIdlePattern = NULL;
-    if (testIdlePattern == NULL) {
+  void destroySlot(int slot) {
+    slots[slot].template emplace<0>();
+  }
+
+  Layer *unusedLayer() {
+    for (int i = 0; i < maxLayers; ++i) {
+      if (!layers[i].inUse) {
+        layers[i].enabled = true;
+        layers[i].abovePatterns = true;
+        layers[i].opacity = 0xFF;
+        return &layers[i];
+      }
+    }
+    logf("No more layers available");
+    return NULL;
+  }
 
+  int freeSlot() {
+    for (int s = 0; s < slotCount; ++s) {
+      if (s != activeSlot && s != previousSlot && s != preparedSlot) {
+        return s;
+      }
     }
-    return testIdlePattern;
+    return -1;
   }
 
   void paletteAutorotateWelcome() {
@@ -44,21 +200,28 @@ class PatternManager {
 
 public:
   PatternManager(BufferType &ctx) : ctx(ctx) {
-    patternConstructors.push_back(&(construct<RaverPlaid>));
-    patternConstructors.push_back(&(construct<Needles>));
-    patternConstructors.push_back(&(construct<Bits>));
-    patternConstructors.push_back(&(construct<Undulation>));
-    patternConstructors.push_back(&(construct<Breathe>));
   }
 
   ~PatternManager() {
-    delete activePattern;
-    delete previousActivePattern;
+    if (prepareThread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(prepareMutex);
+        prepareStopping = true;
+      }
+      prepareCondition.notify_all();
+      prepareThread.join();
+    }
+    for (int s = 0; s < slotCount; ++s) {
+      destroySlot(s);
+    }
+    for (int i = 0; i < maxLayers; ++i) {
+      removeLayer(i);
+    }
   }
 
   void nextPattern() {
     patternAutoRotate = patternAutoRotateDefault;
-    patternIndex = (patternIndex + 1) % patternConstructors.size();
+    patternIndex = (patternIndex + 1) % Patterns::count;
     if (!startPatternAtIndex(patternIndex)) {
       nextPattern();
     }
@@ -66,7 +229,7 @@ public:
 
   void previousPattern() {
     patternAutoRotate = patternAutoRotateDefault;
-    patternIndex = mod_wrap(patternIndex - 1, patternConstructors.size());
+    patternIndex = mod_wrap(patternIndex - 1, Patterns::count);
     if (!startPatternAtIndex(patternIndex)) {
       previousPattern();
     }
@@ -81,15 +244,21 @@ public:
 
   void prepareForNextPattern() {
     if (activePattern) {
+      // only one pattern can be fading out at a time
+      cleanupPreviousPattern();
+      previousSlot = activeSlot;
       previousActivePattern = activePattern;
+      activeSlot = -1;
       activePattern = NULL;
     }
   }
 
   void stopPattern() {
     if (activePattern) {
+      metrics.activePattern.store(NULL, std::memory_order_release);
       activePattern->stop();
-      delete activePattern;
+      destroySlot(activeSlot);
+      activeSlot = -1;
       activePattern = NULL;
     }
   }
@@ -97,11 +266,33 @@ public:
   void cleanupPreviousPattern() {
     if (previousActivePattern) {
       previousActivePattern->stop();
-      delete previousActivePattern;
+      destroySlot(previousSlot);
+      previousSlot = -1;
       previousActivePattern = NULL;
     }
   }
-  
+
+  // Load shedding
+
+  void setShortCrossfade(bool shortCrossfade) {
+    crossfadeDuration = (shortCrossfade ? defaultCrossfadeDuration * 2 / 5 : defaultCrossfadeDuration);
+  }
+
+  void setPatternQuality(PatternQuality quality) {
+    patternQuality = quality;
+    if (activePattern) {
+      activePattern->setQuality(quality);
+    }
+    if (previousActivePattern) {
+      previousActivePattern->setQuality(quality);
+    }
+    for (int i = 0; i < maxLayers; ++i) {
+      if (Pattern *pattern = patternInSlot(layers[i].pattern)) {
+        pattern->setQuality(quality);
+      }
+    }
+  }
+
   // Palettes
 
   void nextPalette() {
@@ -124,77 +315,357 @@ public:
     }
   }
 
+  // Prepare upcoming patterns on a background thread. Off by default, so rendering under a
+  // virtual clock keeps drawing random numbers in the same order.
+  void enableBackgroundPreparation() {
+    backgroundPreparation = true;
+  }
+
 private:
+  void activateSlot(int slot, int index) {
+    Pattern *pattern = patternInSlot(slots[slot]);
+    slotPacing[slot].lastRenderMillis = -1;
+    pattern->setQuality(patternQuality);
+    pattern->start();
+    activePatternStart = millis();
+    transitions.begin((TransitionKind)random8(transitionKindCount));
+    activeSlot = slot;
+    activePattern = pattern;
+    patternIndex = index;
+    patternSwitched = true;
+    metrics.activePattern.store(pattern->description(), std::memory_order_release);
+  }
+
   bool startPatternAtIndex(int index) {
     prepareForNextPattern();
-    auto ctor = patternConstructors[index];
-    Pattern *nextPattern = ctor();
-    if (startPattern(nextPattern)) {
-      patternIndex = index;
+    int slot = freeSlot();
+    Patterns::emplace(slots[slot], index);
+    Pattern *pattern = patternInSlot(slots[slot]);
+    if (pattern->wantsToRun()) {
+      activateSlot(slot, index);
+      metrics.unpreparedPatternSwitches.inc();
       return true;
     } else {
-      delete nextPattern; // patternConstructors returns retained
+      destroySlot(slot);
       return false;
     }
   }
-public:
-  bool startPattern(Pattern *pattern) {
-    prepareForNextPattern();
-    if (pattern->wantsToRun()) {
-      pattern->start();
-      activePatternStart = millis();
-      activePattern = pattern;
-      return true;
-    } else {
+
+  void prepareLoop() {
+    TRACE_THREAD_NAME("prepare");
+    realtime.enterBackgroundThread();
+    std::unique_lock<std::mutex> lock(prepareMutex);
+    while (true) {
+      prepareCondition.wait(lock, [this] { return prepareStopping || prepareState.load() == preparePending; });
+      if (prepareStopping) {
+        return;
+      }
+      int slot = preparedSlot;
+      int index = preparedIndex;
+      lock.unlock();
+      bool wantsToRun;
+      {
+        TRACE_SCOPE("prepare pattern");
+        Patterns::emplace(slots[slot], index);
+        Pattern *pattern = patternInSlot(slots[slot]);
+        wantsToRun = pattern->wantsToRun();
+        if (wantsToRun) {
+          pattern->prepare();
+        }
+      }
+      lock.lock();
+      prepareState.store(wantsToRun ? prepareReady : prepareDeclined, std::memory_order_release);
+      prepareCondition.notify_all();
+    }
+  }
+
+  void prepareNextPattern(int index) {
+    if (!prepareThread.joinable()) {
+      // started on first use so it inherits the render thread's signal mask
+      prepareThread = std::thread(&PatternManager::prepareLoop, this);
+    }
+    std::lock_guard<std::mutex> lock(prepareMutex);
+    preparedSlot = freeSlot();
+    preparedIndex = index;
+    prepareState.store(preparePending, std::memory_order_release);
+    prepareCondition.notify_all();
+  }
+
+  bool isPreparing() {
+    return prepareState.load(std::memory_order_acquire) == preparePending;
+  }
+
+  void discardPreparedPattern() {
+    if (preparedSlot == -1) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(prepareMutex);
+      prepareCondition.wait(lock, [this] { return prepareState.load() != preparePending; });
+    }
+    destroySlot(preparedSlot);
+    preparedSlot = -1;
+    prepareState.store(prepareIdle, std::memory_order_relaxed);
+  }
+
+  // Swaps in the prepared pattern if it's ready and still wants to run. One that's still
+  // being prepared is left alone.
+  bool startPreparedPattern() {
+    if (preparedSlot == -1 || isPreparing()) {
       return false;
     }
+    if (prepareState.load(std::memory_order_acquire) != prepareReady ||
+        !patternInSlot(slots[preparedSlot])->wantsToRun()) {
+      discardPreparedPattern();
+      return false;
+    }
+    prepareForNextPattern();
+    int slot = preparedSlot;
+    preparedSlot = -1;
+    prepareState.store(prepareIdle, std::memory_order_relaxed);
+    activateSlot(slot, preparedIndex);
+    metrics.preparedPatternSwitches.inc();
+    return true;
+  }
+
+  // Updates the pattern if it's due and returns the frame to show.
+  BufferType &renderFrame(Storage &slot, Pacing &pacing) {
+    Pattern *pattern = patternInSlot(slot);
+    const int rate = pattern->preferredFrameRate;
+    if (rate == 0) {
+      updatePattern(slot, pattern);
+      return pattern->ctx;
+    }
+    const long interval = 1000 / rate;
+    long now = millis();
+    if (pacing.lastRenderMillis == -1) {
+      updatePattern(slot, pattern);
+      pacing.earlier = pattern->ctx;
+      pacing.lastRenderMillis = now;
+    } else if (now - pacing.lastRenderMillis >= interval) {
+      pacing.earlier = pattern->ctx;
+      updatePattern(slot, pattern);
+      // keep to the pattern's own cadence unless we've fallen a whole render behind
+      pacing.lastRenderMillis += interval;
+      if (now - pacing.lastRenderMillis >= interval) {
+        pacing.lastRenderMillis = now;
+      }
+    }
+    uint8_t amount = (now - pacing.lastRenderMillis) * 256 / interval;
+    if (amount == 0) {
+      return pacing.earlier;
+    }
+    TRACE_SCOPE("interpolate");
+    pacing.shown.interpolate(pacing.earlier, pattern->ctx, amount);
+    return pacing.shown;
+  }
+
+  void updatePattern(Storage &slot, Pattern *pattern) {
+    TRACE_SCOPE(pattern->description());
+    ScopedTimer timer(metrics.patternUpdateTime.get(pattern->description()));
+    updatePatternInSlot(slot);
+  }
+
+  BufferType &renderSlot(int slot) {
+    return renderFrame(slots[slot], slotPacing[slot]);
+  }
+
+  void blendSlot(int slot, BlendMode blendMode, uint8_t brightness) {
+    BufferType &frame = renderSlot(slot);
+    TRACE_SCOPE("blendIntoContext");
+    ScopedTimer timer(&metrics.blendTime);
+    frame.blendIntoContext(ctx, blendModeFor(blendMode), brightness);
+  }
+
+  // The first layer drawn overwrites the frame, which saves clearing it first;
+  // brightening over black is the same as a plain copy. A partly opaque layer mixes with
+  // what's underneath, so that has to be black rather than the last frame.
+  BlendMode blendModeFor(BlendMode blendMode, uint8_t opacity = 0xFF) {
+    if (frameDrawn) {
+      return blendMode;
+    }
+    frameDrawn = true;
+    if (blendMode == blendDarken || opacity < 0xFF) {
+      clearFrame();
+      return blendMode;
+    }
+    return blendSourceOver;
+  }
+
+  void clearFrame() {
+    ctx.clear();
+  }
+
+  void compositeLayers(bool abovePatterns) {
+    for (int i = 0; i < maxLayers; ++i) {
+      Layer &layer = layers[i];
+      if (!layer.inUse || !layer.enabled || layer.opacity == 0 || layer.abovePatterns != abovePatterns) {
+        continue;
+      }
+      if (layer.external) {
+        if (!layer.external->isLive()) {
+          continue;
+        }
+        TRACE_SCOPE("external layer");
+        ScopedTimer timer(&metrics.blendTime);
+        BlendMode mode = blendModeFor(layer.blendMode, layer.opacity);
+        layer.external->blendIntoContextWithOpacity(ctx, mode, layer.opacity);
+      } else {
+        BufferType &frame = renderFrame(layer.pattern, layer.pacing);
+        TRACE_SCOPE("blendIntoContext");
+        ScopedTimer timer(&metrics.blendTime);
+        BlendMode mode = blendModeFor(layer.blendMode, layer.opacity);
+        frame.blendIntoContextWithOpacity(ctx, mode, layer.opacity);
+      }
+    }
   }
+public:
 
   void setup() {
     startPatternAtIndex(1);
   }
 
-  void loop() {
-    for (int i = 0; i < NUM_LEDS; ++i) {
-      ctx.leds[i] = CRGB::Black;
+  // Runs one pattern for good instead of rotating through them.
+  void pinPattern(int index) {
+    testIdlePatternIndex = index;
+    discardPreparedPattern();
+    stopPattern();
+    cleanupPreviousPattern();
+    startPatternAtIndex(index);
+  }
+
+  // Layers. Each of these returns the layer's index, or -1 if it couldn't be added.
+
+  // Runs a pattern for good alongside the rotation.
+  int addPatternLayer(int index, BlendMode blendMode, uint8_t opacity = 0xFF) {
+    if (index < 0 || index >= Patterns::count) {
+      return -1;
+    }
+    Layer *layer = unusedLayer();
+    if (layer == NULL) {
+      return -1;
+    }
+    Patterns::emplace(layer->pattern, index);
+    Pattern *pattern = patternInSlot(layer->pattern);
+    if (!pattern->wantsToRun()) {
+      layer->pattern.template emplace<0>();
+      return -1;
+    }
+    pattern->setQuality(patternQuality);
+    pattern->start();
+    layer->pacing.lastRenderMillis = -1;
+    layer->inUse = true;
+    layer->blendMode = blendMode;
+    layer->opacity = opacity;
+    return layer - layers;
+  }
+
+  int addExternalLayer(OPCLayer<BufferType> *source, BlendMode blendMode, bool abovePatterns) {
+    Layer *layer = unusedLayer();
+    if (layer == NULL) {
+      return -1;
+    }
+    layer->inUse = true;
+    layer->external = source;
+    layer->blendMode = blendMode;
+    layer->abovePatterns = abovePatterns;
+    return layer - layers;
+  }
+
+  void removeLayer(int index) {
+    Layer &layer = layers[index];
+    if (Pattern *pattern = patternInSlot(layer.pattern)) {
+      pattern->stop();
+      layer.pattern.template emplace<0>();
     }
+    layer.inUse = false;
+    layer.external = NULL;
+  }
+
+  void setLayerEnabled(int index, bool enabled) {
+    layers[index].enabled = enabled;
+  }
+
+  void setLayerOpacity(int index, uint8_t opacity) {
+    layers[index].opacity = opacity;
+  }
+
+  void setLayerBlendMode(int index, BlendMode blendMode) {
+    layers[index].blendMode = blendMode;
+  }
+
+  static int patternCount() {
+    return Patterns::count;
+  }
 
+  void loop() {
+    TRACE_SCOPE("PatternManager::loop");
+    uint64_t loopStartNanos = monotonicNanos();
+    patternSwitched = false;
     if (activePattern && activePattern->runTime() > crossfadeDuration) {
       cleanupPreviousPattern();
     }
 
+    // also the progress of the transition
     uint8_t activePatternBrightness = 0xFF;
     if (previousActivePattern || activePatternStart != 0 && millis() - activePatternStart < crossfadeDuration) {
       activePatternBrightness = (activePattern ? 0xFF * (activePattern->runTime() / (float)crossfadeDuration) : 0);
     }
 
-    if (previousActivePattern) {  
-      previousActivePattern->loop();
-      previousActivePattern->ctx.blendIntoContext(ctx, BlendMode::blendBrighten, dim8_raw(0xFF - activePatternBrightness));
+    frameDrawn = false;
+    compositeLayers(false);
+
+    if (previousActivePattern && activePattern && transitions.currentKind() != transitionCrossfade) {
+      BufferType &from = renderSlot(previousSlot);
+      BufferType &to = renderSlot(activeSlot);
+      TRACE_SCOPE("transition");
+      ScopedTimer timer(&metrics.blendTime);
+      transitions.apply(from.leds, to.leds, ctx.leds, activePatternBrightness, blendModeFor(blendBrighten));
+      ctx.touchAll();
+    } else {
+      if (previousActivePattern) {
+        blendSlot(previousSlot, blendBrighten, dim8_raw(0xFF - activePatternBrightness));
+      }
+      if (activePattern) {
+        blendSlot(activeSlot, blendBrighten, dim8_raw(activePatternBrightness));
+      }
     }
 
-    if (activePattern) {
-      activePattern->loop();
-      activePattern->ctx.blendIntoContext(ctx, BlendMode::blendBrighten, dim8_raw(activePatternBrightness));
+    compositeLayers(true);
+    if (!frameDrawn) {
+      clearFrame();
     }
 
     // time out idle patterns
-    if (patternAutoRotate && activePattern != NULL && activePattern->isRunning() && activePattern->runTime() > activePattern->expectedRunDuration * 1000) {
-      if (activePattern != TestIdlePattern() && activePattern->wantsToIdleStop()) {
+    if (patternAutoRotate && activePattern != NULL && activePattern->isRunning() &&
+        patternIndex != testIdlePatternIndex && activePattern->wantsToIdleStop()) {
+      long remaining = activePattern->expectedRunDuration * 1000L - (long)activePattern->runTime();
+      if (prepareState.load(std::memory_order_acquire) == prepareDeclined) {
+        // pick another one
+        discardPreparedPattern();
+      }
+      if (backgroundPreparation && preparedSlot == -1 && remaining < prepareLeadMillis) {
+        prepareNextPattern((int)random8(Patterns::count));
+      }
+      // rather than switch without it, hold on until the next pattern is ready
+      if (remaining < 0 && !isPreparing()) {
         prepareForNextPattern();
       }
     }
 
     // start a new random pattern if there is none
     if (activePattern == NULL) {
-      Pattern *testPattern = TestIdlePattern();
-      if (testPattern) {
-        startPattern(testPattern);
-      } else {
-        int choice = (int)random8(patternConstructors.size());
+      if (testIdlePatternIndex != -1) {
+        startPatternAtIndex(testIdlePatternIndex);
+      } else if (!startPreparedPattern()) {
+        int choice = (int)random8(Patterns::count);
         startPatternAtIndex(choice);
       }
     }
+
+    if (patternSwitched) {
+      metrics.patternSwitchTime.observe(monotonicNanos() - loopStartNanos);
+    }
   }
 };
 
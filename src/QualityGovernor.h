@@ -0,0 +1,107 @@
+#ifndef QUALITYGOVERNOR_H
+#define QUALITYGOVERNOR_H
+
+#include <stdint.h>
+
+#include "util.h"
+
+enum PatternQuality {
+  qualityFull, qualityReduced, qualityMinimal
+};
+
+// Watches how long frames take against the frame budget and sheds load one step at a time
+// when the Pi can't keep up (crossfades, heavy presets, thermal throttling). Each level
+// keeps everything the previous one gave up:
+//   1: shorter crossfades
+//   2: patterns asked to render at reduced quality
+//   3: half frame rate
+//   4: a third of the frame rate, patterns at minimal quality
+// Quality comes back one level at a time, and only after the cheaper level has had
+// plenty of headroom for a while, so it doesn't flap around the threshold.
+class QualityGovernor {
+public:
+  static const int maxLevel = 4;
+private:
+  const long baseIntervalNanos;
+  int level = 0;
+  double averageNanos = 0;
+  long overBudgetSince = -1;
+  long underBudgetSince = -1;
+
+  // frame work time as a fraction of the budget
+  const double shedAbove = 0.85;
+  const double restoreBelow = 0.55;
+  const long shedAfterMillis = 1000;
+  const long restoreAfterMillis = 8000;
+  const double smoothing = 0.05;
+
+  long intervalForLevel(int l) {
+    return baseIntervalNanos * (l >= 4 ? 3 : l >= 3 ? 2 : 1);
+  }
+public:
+  QualityGovernor(long baseIntervalNanos) : baseIntervalNanos(baseIntervalNanos) { }
+
+  // Returns true if the level changed.
+  bool recordFrame(uint64_t workNanos, long now) {
+    averageNanos += smoothing * ((double)workNanos - averageNanos);
+
+    if (level < maxLevel && averageNanos > shedAbove * intervalForLevel(level)) {
+      underBudgetSince = -1;
+      if (overBudgetSince == -1) {
+        overBudgetSince = now;
+      } else if (now - overBudgetSince > shedAfterMillis) {
+        ++level;
+        overBudgetSince = -1;
+        return true;
+      }
+      return false;
+    }
+    overBudgetSince = -1;
+
+    // judge restoring against the budget we'd have after stepping back up
+    if (level > 0 && averageNanos < restoreBelow * intervalForLevel(level - 1)) {
+      if (underBudgetSince == -1) {
+        underBudgetSince = now;
+      } else if (now - underBudgetSince > restoreAfterMillis) {
+        --level;
+        underBudgetSince = -1;
+        return true;
+      }
+    } else {
+      underBudgetSince = -1;
+    }
+    return false;
+  }
+
+  int currentLevel() {
+    return level;
+  }
+
+  double averageFrameNanos() {
+    return averageNanos;
+  }
+
+  long frameIntervalNanos() {
+    return intervalForLevel(level);
+  }
+
+  bool shortCrossfade() {
+    return level >= 1;
+  }
+
+  PatternQuality patternQuality() {
+    return level >= 4 ? qualityMinimal : level >= 2 ? qualityReduced : qualityFull;
+  }
+
+  const char *description() {
+    switch (level) {
+      case 0: return "full quality";
+      case 1: return "short crossfades";
+      case 2: return "reduced pattern quality";
+      case 3: return "half frame rate";
+      default: return "minimal";
+    }
+  }
+};
+
+#endif
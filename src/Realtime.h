@@ -0,0 +1,140 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "util.h"
+
+// --realtime: keeps frames on time while fcserver and homebridge compete for the Pi. Memory
+// is locked so the render thread never waits on a page fault, the render thread gets a CPU
+// of its own (the last one by default, which isolcpus can keep clear of everything else),
+// and with a priority it runs SCHED_FIFO so homebridge's garbage collector can't preempt it.
+// Every step that isn't permitted is reported and skipped, leaving normal scheduling.
+class Realtime {
+  bool enabled = false;
+  int priority = 0; // SCHED_FIFO priority, 0 to leave the scheduler alone
+  int renderCpu = -1;
+  bool pinned = false;
+  cpu_set_t backgroundCpus;
+
+  static const size_t stackPrefaultBytes = 256 * 1024;
+
+  static void prefaultStack() {
+    volatile char stack[stackPrefaultBytes];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+      stack[i] = 0;
+    }
+  }
+
+  static void setAffinity(const cpu_set_t &cpus, const char *what) {
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0) {
+      logf("Realtime: couldn't pin the %s thread: %s", what, strerror(error));
+    }
+  }
+public:
+  // Called on the main thread before any other thread starts. Locks memory and moves the
+  // main thread off the render CPU, so every thread started from here on inherits that.
+  void start(int priority, int renderCpu) {
+    enabled = true;
+    this->priority = priority;
+    // Under a finite memlock limit, MCL_FUTURE makes every allocation past it fail (thread
+    // stacks first), so it's all or nothing: raise the limit as far as allowed, then lock
+    // only if nothing can run into it.
+    struct rlimit limit;
+    getrlimit(RLIMIT_MEMLOCK, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_MEMLOCK, &limit);
+    if (limit.rlim_max != RLIM_INFINITY && geteuid() != 0) {
+      logf("Realtime: memlock limit is %lu KB; locking memory needs root or an unlimited "
+           "memlock limit (ulimit -l), carrying on with memory unlocked",
+           (unsigned long)(limit.rlim_max / 1024));
+    } else if (0 != mlockall(MCL_CURRENT | MCL_FUTURE)) {
+      logf("Realtime: mlockall failed: %s, carrying on with memory unlocked", strerror(errno));
+    } else {
+      // keep freed memory in the process, locked, rather than handing it back and faulting later
+      mallopt(M_TRIM_THRESHOLD, -1);
+      mallopt(M_MMAP_MAX, 0);
+    }
+
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    this->renderCpu = (renderCpu >= 0 ? renderCpu : cpus - 1);
+    if (cpus < 2) {
+      logf("Realtime: only one CPU, not pinning");
+      return;
+    }
+    if (this->renderCpu >= cpus) {
+      logf("Realtime: no CPU %i (have %i), not pinning", this->renderCpu, cpus);
+      return;
+    }
+    CPU_ZERO(&backgroundCpus);
+    for (int cpu = 0; cpu < cpus; ++cpu) {
+      if (cpu != this->renderCpu) {
+        CPU_SET(cpu, &backgroundCpus);
+      }
+    }
+    setAffinity(backgroundCpus, "main");
+    pinned = true;
+  }
+
+  // Called on the render thread once the helper threads are running, just before it
+  // starts rendering. Globals, frame buffers included, are already resident from mlockall.
+  void enterRenderThread() {
+    if (!enabled) {
+      return;
+    }
+    prefaultStack();
+    if (pinned) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(renderCpu, &cpus);
+      setAffinity(cpus, "render");
+    }
+    if (priority > 0) {
+      struct sched_param param = {};
+      param.sched_priority = priority;
+      int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+      if (error != 0) {
+        logf("Realtime: SCHED_FIFO priority %i refused: %s; needs root or an rtprio limit, "
+             "carrying on with normal scheduling", priority, strerror(error));
+        priority = 0;
+      }
+    }
+    char cpu[16] = "any CPU";
+    if (pinned) {
+      snprintf(cpu, sizeof(cpu), "CPU %i", renderCpu);
+    }
+    if (priority > 0) {
+      logf("Realtime: render thread on %s, SCHED_FIFO priority %i", cpu, priority);
+    } else {
+      logf("Realtime: render thread on %s, normal scheduling", cpu);
+    }
+  }
+
+  // For threads started from the render thread, which would otherwise inherit its CPU
+  // and priority.
+  void enterBackgroundThread() {
+    if (!enabled) {
+      return;
+    }
+    if (priority > 0) {
+      struct sched_param param = {};
+      pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    }
+    if (pinned) {
+      setAffinity(backgroundCpus, "background");
+    }
+  }
+};
+
+Realtime realtime;
+
+#endif
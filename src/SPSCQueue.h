@@ -0,0 +1,41 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+template <typename T, size_t Capacity>
+class SPSCQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0, "SPSCQueue capacity must be a power of two");
+
+  // head is only written by the consumer and tail only by the producer; keep them on
+  // separate cache lines so the two threads don't bounce a line between cores.
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+  T items[Capacity];
+public:
+  // Producer side. Returns false if the queue is full.
+  bool push(const T &item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+    items[t & (Capacity - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false if the queue is empty.
+  bool pop(T &item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = items[h & (Capacity - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+
+// Single-writer snapshot. The writer never waits; readers retry if they overlap a publish.
+template <typename T>
+class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value, "Seqlock values are copied bytewise");
+
+  std::atomic<uint32_t> sequence{0};
+  T value{};
+public:
+  void publish(const T &newValue) {
+    uint32_t seq = sequence.load(std::memory_order_relaxed);
+    sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy((void *)&value, &newValue, sizeof(T));
+    sequence.store(seq + 2, std::memory_order_release);
+  }
+
+  T read() const {
+    T copy;
+    uint32_t before, after;
+    do {
+      before = sequence.load(std::memory_order_acquire);
+      memcpy((void *)&copy, (const void *)&value, sizeof(T));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return copy;
+  }
+};
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <string>
+
+#include "util.h"
+
+// Flight recorder for frame stalls. TRACE_SCOPE("name") records how long the enclosing
+// scope took into a fixed-size ring owned by the calling thread, so recording is two clock
+// reads and a store. The last few seconds can be dumped as Chrome trace-event JSON
+// (chrome://tracing or ui.perfetto.dev) at any time. Build with ORTHO_TRACE=0 to compile
+// every trace point away.
+
+#ifndef ORTHO_TRACE
+#define ORTHO_TRACE 1
+#endif
+
+#if ORTHO_TRACE
+
+#include <atomic>
+#include <mutex>
+
+struct TraceEvent {
+  const char *name; // must point at a string with static lifetime
+  uint64_t start;
+  uint64_t duration;
+};
+
+// Written only by its owning thread; readers validate each copied slot against head.
+class TraceRing {
+public:
+  static const uint64_t capacity = 16384; // about 30 s of render thread at 60 fps
+
+  std::atomic<uint64_t> head{0};
+  TraceEvent events[capacity];
+  pid_t tid;
+  std::atomic<const char *> threadName{"thread"};
+
+  void record(const char *name, uint64_t start, uint64_t duration) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    TraceEvent &event = events[h & (capacity - 1)];
+    event.name = name;
+    event.start = start;
+    event.duration = duration;
+    head.store(h + 1, std::memory_order_release);
+  }
+};
+
+class TraceRegistry {
+  static const int maxThreads = 16;
+  std::mutex mutex;
+  TraceRing *rings[maxThreads] = {};
+  std::atomic<int> count{0};
+public:
+  // Called once per thread; rings outlive their threads so a dump can still show them.
+  TraceRing *registerThread() {
+    std::lock_guard<std::mutex> lock(mutex);
+    int n = count.load(std::memory_order_relaxed);
+    if (n >= maxThreads) {
+      return NULL;
+    }
+    TraceRing *ring = new TraceRing();
+    ring->tid = (pid_t)syscall(SYS_gettid);
+    rings[n] = ring;
+    count.store(n + 1, std::memory_order_release);
+    return ring;
+  }
+
+  int ringCount() {
+    return count.load(std::memory_order_acquire);
+  }
+
+  TraceRing *ring(int i) {
+    return rings[i];
+  }
+};
+
+TraceRegistry traceRegistry;
+thread_local TraceRing *traceRing = NULL;
+thread_local bool traceRingFailed = false;
+
+inline TraceRing *currentTraceRing() {
+  if (traceRing == NULL && !traceRingFailed) {
+    traceRing = traceRegistry.registerThread();
+    traceRingFailed = (traceRing == NULL);
+  }
+  return traceRing;
+}
+
+inline void traceSetThreadName(const char *name) {
+  TraceRing *ring = currentTraceRing();
+  if (ring) {
+    ring->threadName.store(name, std::memory_order_release);
+  }
+}
+
+class TraceScope {
+  const char *name;
+  uint64_t start;
+public:
+  TraceScope(const char *name) : name(name), start(monotonicNanos()) { }
+  ~TraceScope() {
+    TraceRing *ring = currentTraceRing();
+    if (ring) {
+      ring->record(name, start, monotonicNanos() - start);
+    }
+  }
+};
+
+static void traceAppendJsonString(std::string &out, const char *s) {
+  out += '"';
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      out += '\\';
+    }
+    out += *s;
+  }
+  out += '"';
+}
+
+// Chrome trace-event JSON for every event that ended within the last windowNanos.
+std::string traceDumpChromeJson(uint64_t windowNanos) {
+  uint64_t now = monotonicNanos();
+  uint64_t cutoff = (now > windowNanos ? now - windowNanos : 0);
+  pid_t pid = getpid();
+  std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  char line[192];
+
+  for (int r = 0; r < traceRegistry.ringCount(); ++r) {
+    TraceRing *ring = traceRegistry.ring(r);
+    snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+             first ? "" : ",", pid, ring->tid);
+    out += line;
+    traceAppendJsonString(out, ring->threadName.load(std::memory_order_acquire));
+    out += "}}";
+    first = false;
+
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t oldest = (head > TraceRing::capacity ? head - TraceRing::capacity : 0);
+    for (uint64_t i = oldest; i < head; ++i) {
+      TraceEvent event = ring->events[i & (TraceRing::capacity - 1)];
+      std::atomic_thread_fence(std::memory_order_acquire);
+      // the owner may have lapped us while we were copying; at head == i + capacity it's
+      // writing this very slot
+      if (ring->head.load(std::memory_order_relaxed) - i >= TraceRing::capacity) {
+        continue;
+      }
+      if (event.start + event.duration < cutoff || event.name == NULL) {
+        continue;
+      }
+      out += ",{\"name\":";
+      traceAppendJsonString(out, event.name);
+      snprintf(line, sizeof(line), ",\"cat\":\"ortho\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+               event.start / 1000., event.duration / 1000., pid, ring->tid);
+      out += line;
+    }
+  }
+  out += "]}\n";
+  return out;
+}
+
+#define TRACE_CONCAT_INNER(a, b) a ## b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) traceSetThreadName(name)
+
+#else
+
+std::string traceDumpChromeJson(uint64_t windowNanos) {
+  return "{\"traceEvents\":[]}\n";
+}
+
+#define TRACE_SCOPE(name)
+#define TRACE_THREAD_NAME(name)
+
+#endif
+
+// Writes the recent trace to /tmp and returns the path, or an empty string on failure.
+std::string traceDumpToFile(uint64_t windowNanos) {
+  char path[128];
+  snprintf(path, sizeof(path), "/tmp/ortho-trace-%d-%ld.json", (int)getpid(), (long)time(NULL));
+  std::string json = traceDumpChromeJson(windowNanos);
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    return "";
+  }
+  fwrite(json.data(), 1, json.size(), f);
+  fclose(f);
+  return path;
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef TRANSITIONS_H
+#define TRANSITIONS_H
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+
+#include "util.h"
+#include "drawing.h"
+
+// Ways of switching from one pattern to the next besides the plain crossfade.
+enum TransitionKind {
+  transitionCrossfade,
+  transitionWipe,          // along the strips
+  transitionStripWipe,     // strip by strip
+  transitionStickDissolve, // stick by stick, in a popcorn order like Breathe's
+  transitionRadial,        // out from the middle
+  transitionNoise,         // in blotches
+  transitionKindCount,
+};
+
+// Each transition is a threshold per LED: at progress p, LEDs whose threshold is below p show
+// the incoming pattern and the rest still show the outgoing one. Thresholds only depend on the
+// geometry, so the tables are all built up front; a frame of any transition is then a single
+// compare-and-select over the bytes of the two pattern buffers, no dearer than a crossfade.
+template <int COUNT>
+class Transitions {
+  static const int stickCount = COUNT / STICK_LENGTH;
+  static const int stripCount = COUNT / STRIP_LENGTH;
+
+  uint8_t wipe[COUNT];
+  uint8_t stripWipe[COUNT];
+  uint8_t radial[COUNT];
+  uint8_t noise[COUNT];
+  uint8_t stickOrder[ARRAY_SIZE(popcornGenerators)][stickCount];
+
+  // thresholds for the transition under way, one per byte so the select runs over bytes
+  uint8_t active[3 * COUNT];
+  TransitionKind kind = transitionCrossfade;
+
+  static_assert(sizeof(CRGB) == 3, "transitions select over the raw bytes of the LED buffers");
+
+  // spreads rank 0..count-1 over thresholds 0..254, so progress 255 always completes
+  static uint8_t threshold(float rank, float count) {
+    return (uint8_t)(rank * 255 / count);
+  }
+
+  static float lattice(int x, int y) {
+    uint32_t h = (uint32_t)x * 374761393u + (uint32_t)y * 668265263u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return ((h ^ (h >> 16)) & 0xFFFF) / 65536.f;
+  }
+
+  void buildTables() {
+    const float cx = (STRIP_LENGTH - 1) / 2.f;
+    const float cy = (stripCount - 1) / 2.f;
+    const float maxDistance = hypotf(cx, cy) + 1;
+    for (int i = 0; i < COUNT; ++i) {
+      int x = i % STRIP_LENGTH;
+      int y = i / STRIP_LENGTH;
+      wipe[i] = threshold(x, STRIP_LENGTH);
+      stripWipe[i] = threshold(y, stripCount);
+      radial[i] = threshold(hypotf(x - cx, y - cy), maxDistance);
+
+      // value noise with a lattice point every stick along the strips and every other strip
+      float fx = x / (float)STICK_LENGTH, fy = y / 2.f;
+      int lx = (int)fx, ly = (int)fy;
+      float tx = fx - lx, ty = fy - ly;
+      float top = lattice(lx, ly) + (lattice(lx + 1, ly) - lattice(lx, ly)) * tx;
+      float bottom = lattice(lx, ly + 1) + (lattice(lx + 1, ly + 1) - lattice(lx, ly + 1)) * tx;
+      noise[i] = threshold(top + (bottom - top) * ty, 1);
+    }
+    for (unsigned g = 0; g < ARRAY_SIZE(popcornGenerators); ++g) {
+      for (int i = 0; i < stickCount; ++i) {
+        stickOrder[g][((i + 1) * popcornGenerators[g]) % stickCount] = threshold(i, stickCount);
+      }
+    }
+  }
+
+  void setActive(int led, uint8_t t) {
+    active[3 * led] = active[3 * led + 1] = active[3 * led + 2] = t;
+  }
+public:
+  Transitions() {
+    buildTables();
+  }
+
+  // Picks up the tables for a new transition, in a random direction or order.
+  void begin(TransitionKind k) {
+    kind = k;
+    if (kind == transitionCrossfade) {
+      return;
+    }
+    bool reversed = random8(2);
+    const uint8_t *table = (kind == transitionWipe ? wipe : kind == transitionStripWipe ? stripWipe
+                            : kind == transitionRadial ? radial : noise);
+    int generator = random8(ARRAY_SIZE(popcornGenerators));
+    for (int i = 0; i < COUNT; ++i) {
+      uint8_t t = (kind == transitionStickDissolve ? stickOrder[generator][i / STICK_LENGTH] : table[i]);
+      setActive(i, reversed ? 254 - t : t);
+    }
+  }
+
+  TransitionKind currentKind() {
+    return kind;
+  }
+
+  // Writes the mix of the outgoing and incoming frames at this progress into out. With
+  // blendBrighten the mix is brightened over what out already holds.
+  void apply(const CRGB *from, const CRGB *to, CRGB *out, uint8_t progress, BlendMode blendMode) {
+    if (blendMode == blendSourceOver) {
+      select<false>(active, (const uint8_t *)from, (const uint8_t *)to, (uint8_t *)out, progress);
+    } else {
+      select<true>(active, (const uint8_t *)from, (const uint8_t *)to, (uint8_t *)out, progress);
+    }
+  }
+private:
+  // The buffers never overlap, and the select is written as a mask so both loads are
+  // unconditional; that's what lets the compiler vectorize it at -O2.
+  template <bool brighten>
+  static void select(const uint8_t *__restrict t, const uint8_t *__restrict a, const uint8_t *__restrict b,
+                     uint8_t *__restrict o, uint8_t progress) {
+    for (int j = 0; j < 3 * COUNT; ++j) {
+      uint8_t mask = -(uint8_t)(t[j] < progress);
+      uint8_t v = (b[j] & mask) | (a[j] & ~mask);
+      o[j] = (brighten ? std::max(o[j], v) : v);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,423 @@
+#define DEBUG 0
+
+// Microbenchmarks for the color and buffer primitives every pattern leans on. Each one is
+// calibrated to run for a few milliseconds per sample, warmed up, then sampled repeatedly;
+// the median is what gets compared against a baseline. Run through `make bench`:
+//   make bench SAVE=bench-baseline.json      record a baseline
+//   make bench BASELINE=bench-baseline.json  flag anything slower than the baseline
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <math.h>
+#include "ortho.h"
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+#include "util.h"
+#include "palettes.h"
+#include "Transitions.h"
+
+// Keeps the compiler from discarding a result or hoisting work out of the loop.
+template <typename T>
+inline void doNotOptimize(T const &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Benchmark {
+  const char *name;
+  std::function<void(long)> run; // runs the operation n times
+  // runs just the setup that run() repeats alongside the operation n times; its time is
+  // taken off each sample
+  std::function<void(long)> overhead = nullptr;
+};
+
+struct BenchResult {
+  std::string name;
+  long iterations;
+  double medianNanos;
+  double meanNanos;
+  double minNanos;
+  double stddevNanos;
+};
+
+const uint64_t sampleTargetNanos = 5 * 1000000;
+const uint64_t warmupNanos = 100 * 1000000;
+
+static uint64_t timeRun(const std::function<void(long)> &run, long iterations) {
+  uint64_t start = monotonicNanos();
+  run(iterations);
+  return monotonicNanos() - start;
+}
+
+static double timeSample(const Benchmark &bench, long iterations) {
+  double nanos = timeRun(bench.run, iterations);
+  if (bench.overhead) {
+    nanos -= timeRun(bench.overhead, iterations);
+  }
+  return nanos;
+}
+
+BenchResult measure(const Benchmark &bench, int samples) {
+  // grow the batch until one sample is long enough to time accurately
+  long iterations = 1;
+  while (timeRun(bench.run, iterations) < sampleTargetNanos && iterations < (1L << 40)) {
+    iterations *= 2;
+  }
+  uint64_t warmupStart = monotonicNanos();
+  while (monotonicNanos() - warmupStart < warmupNanos) {
+    timeSample(bench, iterations);
+  }
+
+  std::vector<double> perOp;
+  for (int s = 0; s < samples; ++s) {
+    perOp.push_back(timeSample(bench, iterations) / iterations);
+  }
+  std::sort(perOp.begin(), perOp.end());
+
+  BenchResult result;
+  result.name = bench.name;
+  result.iterations = iterations;
+  result.minNanos = perOp.front();
+  result.medianNanos = (samples % 2 ? perOp[samples / 2] : (perOp[samples / 2 - 1] + perOp[samples / 2]) / 2);
+  double sum = 0;
+  for (double v : perOp) {
+    sum += v;
+  }
+  result.meanNanos = sum / samples;
+  double variance = 0;
+  for (double v : perOp) {
+    variance += (v - result.meanNanos) * (v - result.meanNanos);
+  }
+  result.stddevNanos = sqrt(variance / samples);
+  return result;
+}
+
+/* ------------------- */
+
+DrawingContext sourceCtx;
+DrawingContext destCtx;
+DrawingContext outputCtx;
+// a handful of lit sticks, like Breathe's popcorn mode
+DrawingContext sparseCtx;
+Transitions<NUM_LEDS> transitions;
+
+void fillContexts() {
+  for (int i = 0; i < NUM_LEDS; ++i) {
+    sourceCtx.leds[i] = CRGB::HSB(i, 0xFF, (i * 7) & 0xFF);
+    destCtx.leds[i] = CRGB::HSB(i * 3, 0x80, (i * 13) & 0xFF);
+  }
+  sourceCtx.touchAll();
+  destCtx.touchAll();
+}
+
+void fillSparseContext() {
+  for (int stick = 5; stick < NUM_LEDS / STICK_LENGTH; stick += 16) {
+    for (int i = 0; i < STICK_LENGTH; ++i) {
+      sparseCtx.leds[stick * STICK_LENGTH + i] = CRGB::HSB(stick, 0xFF, 0xFF);
+    }
+    sparseCtx.touchStick(stick);
+  }
+}
+
+// the palette with the most stops, so getColor's search is the worst case
+Palette *busiestPalette() {
+  static Palette *busiest = NULL;
+  if (busiest == NULL) {
+    busiest = new Palette(gGradientPalettes[0]);
+    for (int p = 1; p < gGradientPaletteCount; ++p) {
+      Palette *candidate = new Palette(gGradientPalettes[p]);
+      if (candidate->count() > busiest->count()) {
+        std::swap(candidate, busiest);
+      }
+      delete candidate;
+    }
+  }
+  return busiest;
+}
+
+std::vector<Benchmark> benchmarks() {
+  return {
+    {"CRGB::HSB", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        doNotOptimize(CRGB::HSB(i, 0xFF - (i >> 8), i >> 3));
+      }
+    }},
+    {"CRGB::blendWith", [](long n) {
+      CRGB a(0x10, 0x80, 0xF0);
+      CRGB b(0xF0, 0x40, 0x08);
+      for (long i = 0; i < n; ++i) {
+        doNotOptimize(a.blendWith(b, (i & 0xFF) / 255.f));
+      }
+    }},
+    {"nscale8x3", [](long n) {
+      uint8_t r = 0xFF, g = 0x80, b = 0x40;
+      for (long i = 0; i < n; ++i) {
+        nscale8x3(r, g, b, 0xFE);
+        r |= i;
+        doNotOptimize(r);
+        doNotOptimize(g);
+        doNotOptimize(b);
+      }
+    }},
+    {"dim8_raw", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        doNotOptimize(dim8_raw(i));
+      }
+    }},
+    {"Palette::getColor", [](long n) {
+      Palette *palette = busiestPalette();
+      for (long i = 0; i < n; ++i) {
+        doNotOptimize(palette->getColor(i));
+      }
+    }},
+    // the pick, not the "Picked Palette" message it logs
+    {"PaletteManager::randomPalette", [](long n) {
+      logger.setMuted(true);
+      for (long i = 0; i < n; ++i) {
+        doNotOptimize(paletteManager.randomPalette(i & 0x3F));
+      }
+      logger.setMuted(false);
+    }},
+    {"util_cos", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        doNotOptimize(util_cos(i, 0.25, 8000, 0, 0xFF));
+      }
+    }},
+    {"fadeDownBy/768", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        if ((i & 0x3F) == 0) {
+          fillContexts();
+        }
+        fadeDownBy(0.05, destCtx);
+        doNotOptimize(destCtx.leds);
+      }
+    }, [](long n) {
+      for (long i = 0; i < n; ++i) {
+        if ((i & 0x3F) == 0) {
+          fillContexts();
+        }
+        doNotOptimize(destCtx.leds);
+      }
+    }},
+    {"fadeDownBy/6sticks", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        if ((i & 0x3F) == 0) {
+          fillSparseContext();
+        }
+        fadeDownBy(0.05, sparseCtx);
+        doNotOptimize(sparseCtx.leds);
+      }
+    }, [](long n) {
+      for (long i = 0; i < n; ++i) {
+        if ((i & 0x3F) == 0) {
+          fillSparseContext();
+        }
+        doNotOptimize(sparseCtx.leds);
+      }
+    }},
+    {"blendIntoContext/sourceOver/768", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        sourceCtx.blendIntoContext(destCtx, blendSourceOver, i);
+        doNotOptimize(destCtx.leds);
+      }
+    }},
+    {"blendIntoContext/brighten/768", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        sourceCtx.blendIntoContext(destCtx, blendBrighten, i);
+        doNotOptimize(destCtx.leds);
+      }
+    }},
+    {"blendIntoContext/brighten/6sticks", [](long n) {
+      fillSparseContext();
+      for (long i = 0; i < n; ++i) {
+        sparseCtx.blendIntoContext(destCtx, blendBrighten, i);
+        doNotOptimize(destCtx.leds);
+      }
+    }},
+    {"blendIntoContext/darken/768", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        sourceCtx.blendIntoContext(destCtx, blendDarken, i);
+        doNotOptimize(destCtx.leds);
+      }
+    }},
+    // a half-opaque layer
+    {"opacity/sourceOver/768", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        sourceCtx.blendIntoContextWithOpacity(destCtx, blendSourceOver, 0x80);
+        doNotOptimize(destCtx.leds);
+      }
+    }},
+    {"opacity/darken/768", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        sourceCtx.blendIntoContextWithOpacity(destCtx, blendDarken, 0x80);
+        doNotOptimize(destCtx.leds);
+      }
+    }},
+    // a frame of a pattern switch: the crossfade, then a mask transition
+    {"crossfade/768", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        sourceCtx.blendIntoContext(outputCtx, blendSourceOver, dim8_raw(0xFF - (i & 0xFF)));
+        destCtx.blendIntoContext(outputCtx, blendBrighten, dim8_raw(i & 0xFF));
+        doNotOptimize(outputCtx.leds);
+      }
+    }},
+    // an output frame between two renders of a pattern with a preferred frame rate
+    {"interpolate/768", [](long n) {
+      for (long i = 0; i < n; ++i) {
+        outputCtx.interpolate(sourceCtx, destCtx, i & 0xFF);
+        doNotOptimize(outputCtx.leds);
+      }
+    }},
+    {"transition/768", [](long n) {
+      transitions.begin(transitionStickDissolve);
+      for (long i = 0; i < n; ++i) {
+        transitions.apply(sourceCtx.leds, destCtx.leds, outputCtx.leds, i & 0xFF, blendSourceOver);
+        doNotOptimize(outputCtx.leds);
+      }
+    }},
+  };
+}
+
+/* ------------------- */
+
+bool writeJson(const std::vector<BenchResult> &results, const char *path) {
+  FILE *f = (strcmp(path, "-") == 0 ? stdout : fopen(path, "w"));
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  // one benchmark per line, which is also what readBaseline expects
+  fprintf(f, "{\"benchmarks\":[\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchResult &r = results[i];
+    fprintf(f, "  {\"name\":\"%s\",\"iterations\":%ld,\"median_ns\":%.4f,\"mean_ns\":%.4f,\"min_ns\":%.4f,\"stddev_ns\":%.4f}%s\n",
+            r.name.c_str(), r.iterations, r.medianNanos, r.meanNanos, r.minNanos, r.stddevNanos,
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "]}\n");
+  if (f != stdout) {
+    fclose(f);
+  }
+  return true;
+}
+
+// Reads back a file written by writeJson.
+bool readBaseline(const char *path, std::vector<BenchResult> &baseline) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    char name[128];
+    BenchResult r;
+    if (sscanf(line, " {\"name\":\"%127[^\"]\",\"iterations\":%ld,\"median_ns\":%lf,\"mean_ns\":%lf,\"min_ns\":%lf,\"stddev_ns\":%lf",
+               name, &r.iterations, &r.medianNanos, &r.meanNanos, &r.minNanos, &r.stddevNanos) == 6) {
+      r.name = name;
+      baseline.push_back(r);
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [--filter SUBSTRING] [--samples N] [--json PATH|-] [--baseline PATH] [--threshold PERCENT]\n", argv0);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  const char *filter = NULL;
+  const char *jsonPath = NULL;
+  const char *baselinePath = NULL;
+  double thresholdPercent = 10;
+  int samples = 15;
+
+  static struct option options[] = {
+    {"filter", required_argument, NULL, 'f'},
+    {"samples", required_argument, NULL, 'n'},
+    {"json", required_argument, NULL, 'j'},
+    {"baseline", required_argument, NULL, 'b'},
+    {"threshold", required_argument, NULL, 't'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "f:n:j:b:t:h", options, NULL)) != -1) {
+    switch (opt) {
+      case 'f':
+        filter = optarg;
+        break;
+      case 'n':
+        samples = atoi(optarg);
+        break;
+      case 'j':
+        jsonPath = optarg;
+        break;
+      case 'b':
+        baselinePath = optarg;
+        break;
+      case 't':
+        thresholdPercent = atof(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind < argc || samples <= 0) {
+    usage(argv[0]);
+  }
+
+  std::vector<BenchResult> baseline;
+  if (baselinePath && !readBaseline(baselinePath, baseline)) {
+    exit(EXIT_FAILURE);
+  }
+
+  // anything logged outside the timed benchmarks stays off the report
+  FILE *devNull = fopen("/dev/null", "w");
+  logger.start(devNull ? devNull : stderr);
+  srandom(1);
+  fillContexts();
+
+  // the table goes to stderr when the JSON is going to stdout
+  FILE *report = (jsonPath && strcmp(jsonPath, "-") == 0 ? stderr : stdout);
+  fprintf(report, "%-34s %12s %12s %10s %12s\n", "benchmark", "median ns", "min ns", "stddev", "vs baseline");
+
+  std::vector<BenchResult> results;
+  int regressions = 0;
+  for (const Benchmark &bench : benchmarks()) {
+    if (filter && strstr(bench.name, filter) == NULL) {
+      continue;
+    }
+    BenchResult r = measure(bench, samples);
+    results.push_back(r);
+
+    char comparison[32] = "";
+    for (const BenchResult &b : baseline) {
+      if (b.name == r.name && b.medianNanos > 0) {
+        double change = (r.medianNanos / b.medianNanos - 1) * 100;
+        bool regressed = change > thresholdPercent;
+        regressions += regressed;
+        snprintf(comparison, sizeof(comparison), "%+.1f%%%s", change, regressed ? " SLOWER" : "");
+      }
+    }
+    fprintf(report, "%-34s %12.2f %12.2f %9.1f%% %12s\n", r.name.c_str(), r.medianNanos, r.minNanos,
+            r.meanNanos > 0 ? r.stddevNanos / r.meanNanos * 100 : 0, comparison);
+    fflush(report);
+  }
+
+  logger.stop();
+  if (jsonPath && !writeJson(results, jsonPath)) {
+    exit(EXIT_FAILURE);
+  }
+  if (regressions > 0) {
+    fprintf(report, "%d benchmark%s regressed by more than %.0f%%\n", regressions, regressions == 1 ? "" : "s", thresholdPercent);
+    return 1;
+  }
+  return 0;
+}
@@ -3,6 +3,7 @@
 #define DRAWING_H
 
 #include <stack>
+#include <type_traits>
 #include "util.h"
 
 // // Workaround for linker issues when using copy-constructors for DrawStyle struct (since something is built with -fno-exceptions)
@@ -17,6 +18,20 @@ enum BlendMode {
   blendSourceOver, blendBrighten, blendDarken, /* add blending? but how to encode alpha? need CRGBA buffers, probs not worth it with current resolution */
 };
 
+// Reads a blend mode by name: over, brighten or darken.
+inline bool parseBlendMode(const char *name, BlendMode *mode) {
+  if (strcmp(name, "over") == 0) {
+    *mode = blendSourceOver;
+  } else if (strcmp(name, "brighten") == 0) {
+    *mode = blendBrighten;
+  } else if (strcmp(name, "darken") == 0) {
+    *mode = blendDarken;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 struct DrawStyle {
 public:
   BlendMode blendMode = blendSourceOver;
@@ -43,23 +58,306 @@ private:
       }
     }
   }
+  typedef CustomDrawingContext<WIDTH, HEIGHT, PixelType, PixelSetType> Context;
+
+  // Sticks that may have lit pixels, one bit per STICK_LENGTH span. A clear bit means the
+  // stick is certainly black, so clearing, fading and blending skip it; a set bit only means
+  // it might not be. Code that writes leds directly marks what it wrote with touch().
+  static constexpr int stickCount = (NUM_LEDS + STICK_LENGTH - 1) / STICK_LENGTH;
+  uint64_t litSticks[(stickCount + 63) / 64];
+
+  // The first stick at or after s whose bit is 'set', or stickCount.
+  static int nextStick(const uint64_t *mask, int s, bool set) {
+    while (s < stickCount) {
+      uint64_t word = (set ? mask[s / 64] : ~mask[s / 64]) & (~0ULL << (s % 64));
+      if (word) {
+        return std::min(stickCount, (s & ~63) + __builtin_ctzll(word));
+      }
+      s = (s & ~63) + 64;
+    }
+    return stickCount;
+  }
+
+  // Calls f(firstLed, ledCount) for each run of consecutive sticks set in mask, so dense
+  // frames still get one long loop.
+  template <typename F>
+  static void forEachRun(const uint64_t *mask, F f) {
+    for (int s = nextStick(mask, 0, true); s < stickCount; ) {
+      int end = nextStick(mask, s, false);
+      int first = s * STICK_LENGTH;
+      f(first, std::min(end * STICK_LENGTH, NUM_LEDS) - first);
+      s = nextStick(mask, end, true);
+    }
+  }
+
+  // Calls f(stick) for each stick set in mask.
+  template <typename F>
+  static void forEachStick(const uint64_t *mask, F f) {
+    for (int w = 0; w < (stickCount + 63) / 64; ++w) {
+      for (uint64_t word = mask[w]; word; word &= word - 1) {
+        f(w * 64 + __builtin_ctzll(word));
+      }
+    }
+  }
+
+  static int stickBytes(int stick) {
+    return 3 * (std::min((stick + 1) * STICK_LENGTH, NUM_LEDS) - stick * STICK_LENGTH);
+  }
+
+  void markBlack(int stick) {
+    litSticks[stick / 64] &= ~(1ULL << (stick % 64));
+  }
 public:
   PixelSetType leds;
   CustomDrawingContext() {  
     for (int i = 0; i < NUM_LEDS; ++i) {
       leds[i] = CRGB::Black;
     }
+    memset(litSticks, 0, sizeof(litSticks));
   }
-  
-  void blendIntoContext(CustomDrawingContext<WIDTH, HEIGHT, PixelType, PixelSetType> &otherContext, BlendMode blendMode, uint8_t brightness=0xFF) {
+
+  inline void touch(int index) {
+    touchStick(index / STICK_LENGTH);
+  }
+
+  inline void touchStick(int stick) {
+    litSticks[stick / 64] |= 1ULL << (stick % 64);
+  }
+
+  // For when the whole buffer was written behind our back.
+  void touchAll() {
+    for (int s = 0; s < stickCount; ++s) {
+      touchStick(s);
+    }
+  }
+
+  void clear() {
+    forEachRun(litSticks, [this](int first, int count) {
+      memset((void *)&leds[first], 0, count * sizeof(PixelType));
+    });
+    memset(litSticks, 0, sizeof(litSticks));
+  }
+
+  void fadeDownBy(double amount) {
+    // the same rounding as multiplying each channel, through a table
+    uint8_t faded[256];
+    for (int v = 0; v < 256; ++v) {
+      faded[v] = v * (1 - amount);
+    }
+    forEachStick(litSticks, [&](int stick) {
+      uint8_t *bytes = (uint8_t *)&leds[stick * STICK_LENGTH];
+      uint8_t any = 0;
+      for (int j = 0; j < stickBytes(stick); ++j) {
+        bytes[j] = faded[bytes[j]];
+        any |= bytes[j];
+      }
+      if (!any) {
+        markBlack(stick);
+      }
+    });
+  }
+
+  // Makes this the mix of two frames, 'amount' of the way from one to the other.
+  void interpolate(const Context &from, const Context &to, uint8_t amount) {
+    static_assert(sizeof(PixelType) == 3, "interpolation mixes the raw channel bytes");
+    // where both frames are black the mix is too, which also clears what this had lit there
+    uint64_t either[ARRAY_SIZE(litSticks)], any[ARRAY_SIZE(litSticks)];
+    for (unsigned w = 0; w < ARRAY_SIZE(litSticks); ++w) {
+      either[w] = from.litSticks[w] | to.litSticks[w];
+      any[w] = either[w] | litSticks[w];
+      litSticks[w] = either[w];
+    }
+    const uint8_t *a = (const uint8_t *)&from.leds[0];
+    const uint8_t *b = (const uint8_t *)&to.leds[0];
+    uint8_t *out = (uint8_t *)&leds[0];
+    forEachBlock(any, [=](int offset, auto count) {
+      lerpBytes<decltype(count)::value>(a + offset, b + offset, out + offset, amount);
+    });
+  }
+
+  bool allBlack() {
+    forEachStick(litSticks, [this](int stick) {
+      const uint8_t *bytes = (const uint8_t *)&leds[stick * STICK_LENGTH];
+      uint8_t any = 0;
+      for (int j = 0; j < stickBytes(stick); ++j) {
+        any |= bytes[j];
+      }
+      if (!any) {
+        markBlack(stick);
+      }
+    });
+    for (unsigned w = 0; w < ARRAY_SIZE(litSticks); ++w) {
+      if (litSticks[w]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void blendIntoContext(Context &otherContext, BlendMode blendMode, uint8_t brightness=0xFF) {
     // assert(otherContext.leds.size() == this->leds.size(), "context blending requires same-size buffers");
-    // FIXME: kinda crappy
-    for (int i = 0; i < NUM_LEDS; ++i) {
-      set_px(otherContext, leds[i], i, blendMode, brightness);
+    if constexpr (sizeof(PixelType) == 3) {
+      // Only sticks lit in one buffer or the other can change. Black source sticks are zeros,
+      // so running the kernel over them where it matters does the right thing.
+      const uint8_t *src = (const uint8_t *)&leds[0];
+      uint8_t *dst = (uint8_t *)&otherContext.leds[0];
+      uint64_t *dstSticks = otherContext.litSticks;
+      switch (blendMode) {
+        case blendSourceOver: {
+          uint64_t either[ARRAY_SIZE(litSticks)];
+          for (unsigned w = 0; w < ARRAY_SIZE(litSticks); ++w) {
+            either[w] = litSticks[w] | dstSticks[w];
+            dstSticks[w] = litSticks[w];
+          }
+          blendRuns<blendSourceOver>(either, src, dst, brightness);
+          break;
+        }
+        case blendBrighten:
+          blendRuns<blendBrighten>(litSticks, src, dst, brightness);
+          for (unsigned w = 0; w < ARRAY_SIZE(litSticks); ++w) {
+            dstSticks[w] |= litSticks[w];
+          }
+          break;
+        case blendDarken:
+          blendRuns<blendDarken>(dstSticks, src, dst, brightness);
+          for (unsigned w = 0; w < ARRAY_SIZE(litSticks); ++w) {
+            dstSticks[w] &= litSticks[w];
+          }
+          break;
+      }
+    } else {
+      for (int i = 0; i < NUM_LEDS; ++i) {
+        set_px(otherContext, leds[i], i, blendMode, brightness);
+      }
+      otherContext.touchAll();
+    }
+  }
+
+  // Blends as blendIntoContext does at full brightness, then mixes the result with what was
+  // there before by 'opacity', like alpha: an 'over' layer at half opacity lets half of
+  // what's underneath through, and a barely opaque 'darken' barely darkens.
+  void blendIntoContextWithOpacity(Context &otherContext, BlendMode blendMode, uint8_t opacity) {
+    if (opacity == 0xFF) {
+      blendIntoContext(otherContext, blendMode);
+      return;
+    }
+    if constexpr (sizeof(PixelType) == 3) {
+      // black source sticks leave the mix alone under brighten, black destination sticks
+      // under darken; 'over' mixes wherever either is lit
+      const uint8_t *src = (const uint8_t *)&leds[0];
+      uint8_t *dst = (uint8_t *)&otherContext.leds[0];
+      uint64_t *dstSticks = otherContext.litSticks;
+      uint64_t either[ARRAY_SIZE(litSticks)];
+      for (unsigned w = 0; w < ARRAY_SIZE(litSticks); ++w) {
+        either[w] = litSticks[w] | dstSticks[w];
+      }
+      switch (blendMode) {
+        case blendSourceOver:
+          mixRuns<blendSourceOver>(either, src, dst, opacity);
+          break;
+        case blendBrighten:
+          mixRuns<blendBrighten>(litSticks, src, dst, opacity);
+          break;
+        case blendDarken:
+          mixRuns<blendDarken>(dstSticks, src, dst, opacity);
+          break;
+      }
+      if (blendMode != blendDarken) {
+        memcpy(dstSticks, either, sizeof(either));
+      }
+    } else {
+      const float amount = opacity / 255.f;
+      for (int i = 0; i < NUM_LEDS; ++i) {
+        PixelType under = otherContext.leds[i];
+        set_px(otherContext, leds[i], i, blendMode, 0xFF);
+        PixelType blended = otherContext.leds[i];
+        otherContext.leds[i] = PixelType(under.r + (blended.r - under.r) * amount,
+                                         under.g + (blended.g - under.g) * amount,
+                                         under.b + (blended.b - under.b) * amount);
+      }
+      otherContext.touchAll();
+    }
+  }
+
+private:
+  // Walks the runs of sticks in mask in fixed-size blocks, eight sticks at a time and then one
+  // at a time, calling f(byteOffset, std::integral_constant<int, blockBytes>()), so each kernel
+  // call has a constant trip count the compiler vectorizes in full.
+  template <typename F>
+  static void forEachBlock(const uint64_t *mask, F f) {
+    static_assert(NUM_LEDS % STICK_LENGTH == 0, "blocks are whole sticks");
+    const int stickBytes = 3 * STICK_LENGTH;
+    forEachRun(mask, [=](int first, int leds) {
+      int offset = 3 * first;
+      int count = leds / STICK_LENGTH;
+      for (; count >= 8; count -= 8, offset += 8 * stickBytes) {
+        f(offset, std::integral_constant<int, 8 * stickBytes>());
+      }
+      for (; count > 0; --count, offset += stickBytes) {
+        f(offset, std::integral_constant<int, stickBytes>());
+      }
+    });
+  }
+
+  template <BlendMode blendMode>
+  static void blendRuns(const uint64_t *mask, const uint8_t *src, uint8_t *dst, uint8_t brightness) {
+    forEachBlock(mask, [=](int offset, auto count) {
+      blendBytes<blendMode, decltype(count)::value>(src + offset, dst + offset, brightness);
+    });
+  }
+
+  template <BlendMode blendMode>
+  static void mixRuns(const uint64_t *mask, const uint8_t *src, uint8_t *dst, uint8_t opacity) {
+    forEachBlock(mask, [=](int offset, auto count) {
+      mixBytes<blendMode, decltype(count)::value>(src + offset, dst + offset, opacity);
+    });
+  }
+
+  // The blend at full brightness, then a lerp from the old destination towards it. The
+  // weights add up to 256 as in lerpBytes, with 255 taken as all the way.
+  template <BlendMode blendMode, int COUNT>
+  static void mixBytes(const uint8_t *__restrict src, uint8_t *__restrict dst, uint8_t opacity) {
+    const uint16_t weight = opacity + (opacity >> 7);
+    for (int j = 0; j < COUNT; ++j) {
+      uint8_t d = dst[j];
+      uint8_t b = (blendMode == blendSourceOver ? src[j] : blendMode == blendBrighten ? std::max(src[j], d) : std::min(src[j], d));
+      dst[j] = (d * (256 - weight) + b * weight) >> 8;
+    }
+  }
+
+  // The same arithmetic as set_px over the raw channel bytes, with the blend mode hoisted out
+  // of the loop so the compiler can vectorize it.
+  template <BlendMode blendMode, int COUNT>
+  static void blendBytes(const uint8_t *__restrict src, uint8_t *__restrict dst, uint8_t brightness) {
+    const uint16_t scale = brightness + 1; // as nscale8
+    for (int j = 0; j < COUNT; ++j) {
+      uint8_t s = (src[j] * scale) >> 8;
+      dst[j] = (blendMode == blendSourceOver ? s : blendMode == blendBrighten ? std::max(s, dst[j]) : std::min(s, dst[j]));
+    }
+  }
+
+  // The weights add up to 256, so the sum fits in 16 bits.
+  template <int COUNT>
+  static void lerpBytes(const uint8_t *__restrict a, const uint8_t *__restrict b, uint8_t *__restrict out, uint8_t amount) {
+    const uint16_t bWeight = amount, aWeight = 256 - amount;
+    for (int j = 0; j < COUNT; ++j) {
+      out[j] = (a[j] * aWeight + b[j] * bWeight) >> 8;
     }
   }
 };
 
+// Fades every lit pixel towards black by 'amount'.
+template <typename Context>
+inline void fadeDownBy(double amount, Context &ctx) {
+  ctx.fadeDownBy(amount);
+}
+
+// The fade for one step of dt seconds that adds up to fading by 'amountPerSecond' over a
+// second, so fade rates don't depend on how often they're applied.
+inline double fadePerStep(double amountPerSecond, float dt) {
+  return 1 - pow(1 - amountPerSecond, dt);
+}
+
 /* Floating-point pixel buffer support */
 
 typedef struct FCRGB {
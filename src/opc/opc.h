@@ -13,6 +13,8 @@ specific language governing permissions and limitations under the License. */
 #ifndef OPC_H
 #define OPC_H
 
+#include <stddef.h>
+#include <sys/types.h>
 #include "types.h"
 
 #define OPC_DEFAULT_PORT 7890
@@ -22,7 +24,8 @@ specific language governing permissions and limitations under the License. */
 
 /* OPC command codes */
 #define OPC_SET_PIXELS 0
-#define OPC_STREAM_SYNC 0xff
+#define OPC_SYSTEM_EXCLUSIVE 0xff
+#define OPC_STREAM_SYNC 0xff  /* a system exclusive message with OPC_STREAM_SYNC_DATA */
 
 #define OPC_STREAM_SYNC_LENGTH 4
 #define OPC_STREAM_SYNC_DATA ((u8*) "\xf0\xca\x71\x2e")
@@ -34,6 +37,9 @@ specific language governing permissions and limitations under the License. */
 /* Maximum number of pixels in one message */
 #define OPC_MAX_PIXELS_PER_MESSAGE ((1 << 16) / 3)
 
+/* Maximum number of channel spans in one frame (one per non-broadcast channel) */
+#define OPC_MAX_SPANS 255
+
 // OPC client functions ----------------------------------------------------
 
 /* Handle for an OPC sink created by opc_new_sink. */
@@ -49,38 +55,219 @@ opc_sink opc_new_sink_socket(char* hostport);
 /* as needed for sending, and reopened if it closes. */
 opc_sink opc_new_sink_file(char* path);
 
+/* Creates a new OPC sink that connects to a SOCK_STREAM Unix-domain socket */
+/* at path, for a server on the same host.  Like a TCP sink, it is connected */
+/* as needed and reconnected if it closes. */
+opc_sink opc_new_sink_unix(char* path);
+
+/* Creates a new OPC sink that publishes into a shared memory ring named */
+/* 'name' (as for shm_open, starting with /), for a consumer on the same */
+/* host.  Sending a frame is a copy into the ring with no system call unless */
+/* a consumer is asleep waiting for it.  Frames are never blocked on: if the */
+/* consumer falls behind it skips to the newest.  Linux only. */
+opc_sink opc_new_sink_shm(char* name);
+
+/* Creates a sink from "unix:PATH", "shm:NAME", "file:PATH" or "host:port". */
+opc_sink opc_new_sink_spec(char* spec);
+
 /* Calls opc_new_sink_socket.  Present for backward compatibility. */
 opc_sink opc_new_sink(char* hostport);
 
+/* Returns the file descriptor of a connected sink, or -1 if it is not */
+/* currently connected.  The descriptor changes whenever the sink reconnects. */
+int opc_sink_fd(opc_sink sink);
+
+/* Connects a sink without waiting, for callers with an event loop of their */
+/* own.  Returns 1 if the sink is connected, 0 if the attempt failed, or -1 */
+/* if it's in progress: *fd is then set to a descriptor to wait on for */
+/* writability, after which calling again finishes the attempt. */
+s8 opc_connect_nonblocking(opc_sink sink, int* fd);
+
+/* Returns 1 if the sink is connected (or open, or mapped), 0 otherwise. */
+u8 opc_sink_connected(opc_sink sink);
+
 /* Sends RGB data for 'count' pixels to channel 'channel'.  Makes one attempt */
 /* to connect the sink if needed; if the connection could not be opened, the */
 /* the data is not sent.  Returns 1 if the data was sent, 0 otherwise. */
+/* 'count' must not exceed OPC_MAX_PIXELS_PER_MESSAGE; use opc_put_frame */
+/* for larger buffers. */
 u8 opc_put_pixels(opc_sink sink, u8 channel, u16 count, pixel* pixels);
 
+/* Maps a contiguous range of a frame buffer onto one OPC channel.  The span */
+/* is sent as a single message, so count is at most OPC_MAX_PIXELS_PER_MESSAGE. */
+typedef struct {
+  u8 channel;
+  u32 first;  /* index of the first pixel of the span in the frame buffer */
+  u16 count;
+} opc_span;
+
+/* Fills 'map' with spans covering 'count' pixels on consecutive channels */
+/* starting at 'first_channel'.  A frame that fits in one message keeps */
+/* 'first_channel' as is; a frame that has to be split never uses the */
+/* broadcast channel, so numbering then starts at 1 if 'first_channel' is 0. */
+/* Returns the number of spans written, or 0 if more than 'max_spans' would */
+/* be needed. */
+u8 opc_make_channel_map(u32 count, u8 first_channel, opc_span* map, u8 max_spans);
+
+/* Sends a frame whose pixels are split across channels according to 'map'. */
+/* All messages go out in one vectored write; if there is more than one, a */
+/* stream sync packet is appended so the receiver can present the frame */
+/* atomically.  Makes one attempt to connect the sink if needed.  Returns 1 */
+/* if the whole frame was sent, 0 otherwise. */
+u8 opc_put_frame(opc_sink sink, const opc_span* map, u8 span_count, pixel* pixels);
+
+/* Returns the number of bytes opc_layout_frame needs for 'map'. */
+size_t opc_frame_length(const opc_span* map, u8 span_count);
+
+/* Lays out a complete frame for 'map' in 'buffer', which must hold */
+/* opc_frame_length bytes: each span's header, room for its pixels, and a */
+/* trailing stream sync if there is more than one span.  Only the pixels */
+/* change from frame to frame, so this is done once; pixels for span i are */
+/* then written at opc_frame_pixels(buffer, map, i). */
+void opc_layout_frame(const opc_span* map, u8 span_count, u8* buffer);
+
+/* Where the pixels for span 'index' go in a buffer laid out by opc_layout_frame. */
+pixel* opc_frame_pixels(u8* buffer, const opc_span* map, u8 index);
+
+/* Sends a buffer laid out by opc_layout_frame in a single write.  Makes one */
+/* attempt to connect the sink if needed.  Returns 1 if the frame was sent, */
+/* 0 otherwise.  Socket sinks don't block on a full send buffer: a frame */
+/* none of which fits is left unsent and the sink stays connected, which the */
+/* caller can tell from opc_sink_fd, while one that only partly fits counts */
+/* as sent, its tail kept for opc_flush. */
+u8 opc_put_frame_buffer(opc_sink sink, u8* buffer, size_t length);
+
+/* Writes what's left of a message that only partly fit, without waiting. */
+/* Returns 1 once nothing is left, 0 if some still is (wait for the sink's */
+/* descriptor to be writable and call again), or -1 if the sink failed and */
+/* was closed.  Sending calls this first, and sends nothing until it's done. */
+s8 opc_flush(opc_sink sink);
+
+/* System exclusive ID for ortho's own messages. */
+#define OPC_SYSID_ORTHO 0x4f52
+
+/* Length of a frame timestamp message, header included. */
+#define OPC_TIMESTAMP_LENGTH 30
+
+/* Starting value for opc_hash. */
+#define OPC_HASH_INIT 2166136261u
+
+/* Continues a 32-bit FNV-1a hash over 'length' bytes. */
+u32 opc_hash(u32 hash, const u8* data, size_t length);
+
+/* Fills in a system exclusive message, sent just ahead of a frame, that */
+/* lets a test receiver measure latency and spot torn frames: the frame */
+/* number, when rendering started and when it was sent (CLOCK_MONOTONIC */
+/* nanoseconds), and the opc_hash of the frame's pixel bytes.  After the */
+/* header come the system ID and then those fields, all big-endian. */
+void opc_fill_timestamp(u8* buffer, u32 frame, uint64_t render_ns,
+                        uint64_t send_ns, u32 hash);
+
 /* Sends a stream sync packet to all channels.  Makes one attempt */
 /* to connect the sink if needed; if the connection could not be opened, the */
 /* the packet is not sent.  Returns 1 if the packet was sent, 0 otherwise. */
 u8 opc_stream_sync(opc_sink sink);
 
+// OPC shared memory ring ---------------------------------------------------
+
+/* Layout of the region behind a shared memory sink.  Each send fills the */
+/* next of OPC_SHM_SLOTS slots with the OPC messages exactly as they would */
+/* go over the wire, then bumps write_seq, which is also the futex consumers */
+/* sleep on. */
+#define OPC_SHM_MAGIC 0x3143504f  /* "OPC1" */
+#define OPC_SHM_SLOTS 4
+#define OPC_SHM_SLOT_SIZE (1 << 18)
+#define OPC_SHM_HEADER_SIZE 4096
+#define OPC_SHM_REGION_SIZE (OPC_SHM_HEADER_SIZE + OPC_SHM_SLOTS * OPC_SHM_SLOT_SIZE)
+
+typedef struct {
+  u32 magic;
+  u32 slot_count;
+  u32 slot_size;
+  u32 write_seq;  /* number of sends published so far */
+  u32 waiters;    /* consumers asleep on write_seq */
+  u32 lengths[OPC_SHM_SLOTS];
+} opc_shm_header;
+
+/* Maps the region published by a shared memory sink, or returns NULL if */
+/* the producer hasn't created it yet. */
+opc_shm_header* opc_shm_attach(char* name);
+
+void opc_shm_detach(opc_shm_header* region);
+
+/* Copies the newest published send into 'buffer', waiting up to timeout_ms */
+/* if there is none newer than *cursor, and advances *cursor.  Start with */
+/* *cursor = region->write_seq to skip whatever is already there.  Returns */
+/* the number of bytes copied, 0 on timeout, or -1 if 'size' is too small. */
+/* *skipped is set to the number of sends passed over. */
+ssize_t opc_shm_read(opc_shm_header* region, u32* cursor, u8* buffer,
+                     size_t size, u32 timeout_ms, u32* skipped);
+
 // OPC server functions ----------------------------------------------------
 
 /* Handle for an OPC source created by opc_new_source. */
 typedef s8 opc_source;
 
-/* Handler called by opc_receive when pixel data is received. */
+/* Maximum number of clients connected to one source at a time */
+#define OPC_MAX_CLIENTS 8
+
+/* Handler called by opc_receive when a pixel message is complete.  'pixels' */
+/* points into the source's pixel buffer and 'count' is how many of them the */
+/* message filled in. */
 typedef void opc_handler(u8 channel, u16 count, pixel* pixels);
 
-/* Creates a new OPC source by listening on the specified TCP port.  At most */
-/* one incoming connection is accepted at a time; if the connection closes, */
-/* the next call to opc_receive will begin listening for another connection. */
+/* What an opc_client_handler is called for. */
+#define OPC_EVENT_CONNECT 0  /* a client connected; count is 0 and pixels NULL */
+#define OPC_EVENT_PIXELS 1   /* a pixel message from the client is complete */
+#define OPC_EVENT_SYNC 2     /* the client sent a stream sync; count is 0 and pixels NULL */
+
+/* Handler called by opc_receive_clients, saying which of the source's */
+/* clients (0 to OPC_MAX_CLIENTS - 1) the event came from.  Pixel messages */
+/* are reported as for opc_handler. */
+typedef void opc_client_handler(u8 client, u8 event, u8 channel, u16 count,
+                                pixel* pixels);
+
+/* Creates a new OPC source by listening on the specified TCP port.  Up to */
+/* OPC_MAX_CLIENTS clients can be connected at once; all sockets are */
+/* non-blocking and messages are parsed incrementally as bytes arrive. */
 opc_source opc_new_source(u16 port);
 
-/* Handles the next I/O event for a given OPC source; if incoming data is */
-/* received that completes a pixel data packet, calls the handler with the */
-/* pixel data.  Returns 1 if there was any I/O, 0 if the timeout expired. */
+/* Sets the buffer pixel payloads are received into, with no intermediate */
+/* copy.  Pixels for channel c > 0 land at (c - 1) * */
+/* OPC_MAX_PIXELS_PER_MESSAGE, matching opc_make_channel_map, and channel 0 */
+/* at the start; anything past 'count' is dropped.  Pixels arrive as they */
+/* are read, so a handler that needs whole frames should point the source */
+/* at a different buffer each time one completes.  By default each source */
+/* has a buffer of its own for OPC_MAX_PIXELS_PER_MESSAGE pixels. */
+void opc_set_source_buffer(opc_source source, pixel* pixels, u32 count);
+
+/* Gives client slot 'client' a pixel buffer of its own, laid out as for */
+/* opc_set_source_buffer, so clients can't land pixels in each other's */
+/* frames.  It stays with the slot across reconnections; NULL goes back to */
+/* the source's buffer. */
+void opc_set_client_buffer(opc_source source, u8 client, pixel* pixels, u32 count);
+
+/* Accepts new clients and reads whatever the connected ones have sent, */
+/* waiting at most timeout_ms for something to happen (0 just polls). */
+/* Calls the handler for each pixel message completed.  Returns 1 if there */
+/* was any I/O, 0 if the timeout expired. */
 u8 opc_receive(opc_source source, opc_handler* handler, u32 timeout_ms);
 
-/* Resets an OPC source to its initial state by closing the connection. */
+/* Like opc_receive, but reports connections, pixel messages and stream */
+/* syncs per client to 'handler'. */
+u8 opc_receive_clients(opc_source source, opc_client_handler* handler,
+                       u32 timeout_ms);
+
+/* Returns 1 if 'client' is connected and partway through a message. */
+u8 opc_client_receiving(opc_source source, u8 client);
+
+/* Fills 'fds' with up to 'max' file descriptors to wait on for the source: */
+/* the listening socket and each connected client.  They change as clients */
+/* come and go, so fetch them again after each opc_receive.  Returns how */
+/* many were written. */
+int opc_source_fds(opc_source source, int* fds, int max);
+
+/* Resets an OPC source to its initial state by closing all connections. */
 void opc_reset_source(opc_source source);
 
 #endif  /* OPC_H */
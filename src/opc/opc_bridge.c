@@ -0,0 +1,175 @@
+/* Reference consumer for the same-host OPC sinks.  Accepts frames from a
+   Unix-domain socket or a shared memory ring and forwards them to any other
+   sink, typically fcserver over TCP:
+
+     opc-bridge unix:/tmp/ortho.sock 127.0.0.1:7890
+     opc-bridge shm:/ortho 127.0.0.1:7890
+
+   With "-" as the destination, frames are only counted, which is handy for
+   checking a producer without any hardware attached. */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "opc.h"
+
+#define BRIDGE_BUFFER_SIZE (OPC_SHM_SLOT_SIZE + 4 + 0xffff)
+#define BRIDGE_STATS_INTERVAL_MS 5000
+
+static opc_sink destination = -1;
+static u8 buffer[BRIDGE_BUFFER_SIZE];
+
+static long retry_after_ms = 0;
+
+static long frames = 0;
+static long skipped = 0;
+static long bytes = 0;
+static long last_stats_ms = 0;
+
+static long now_ms() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+static void report() {
+  long now = now_ms();
+  if (last_stats_ms == 0) {
+    last_stats_ms = now;
+  } else if (now - last_stats_ms >= BRIDGE_STATS_INTERVAL_MS) {
+    fprintf(stderr, "opc-bridge: %.1f sends/s, %.1f KB/s, %ld skipped\n",
+            frames * 1000. / (now - last_stats_ms),
+            bytes / 1.024 / (now - last_stats_ms), skipped);
+    frames = skipped = bytes = 0;
+    last_stats_ms = now;
+  }
+}
+
+/* Forwards whole OPC messages in one write. */
+static void forward(u8* data, size_t length) {
+  frames++;
+  bytes += length;
+  if (destination >= 0 && now_ms() >= retry_after_ms &&
+      !opc_put_frame_buffer(destination, data, length)) {
+    /* don't hammer a destination that isn't there */
+    retry_after_ms = now_ms() + 1000;
+  }
+  report();
+}
+
+/* Length of the complete OPC messages at the start of data. */
+static size_t complete_messages(u8* data, size_t length) {
+  size_t offset = 0;
+  size_t message;
+
+  while (length - offset >= 4) {
+    message = 4 + (data[offset + 2] << 8 | data[offset + 3]);
+    if (length - offset < message) {
+      break;
+    }
+    offset += message;
+  }
+  return offset;
+}
+
+static int bridge_unix(char* path) {
+  struct sockaddr_un address;
+  int server, client;
+  size_t filled, ready;
+  ssize_t received;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "opc-bridge: socket path is too long: %s\n", path);
+    return 1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  unlink(path);
+  server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0 || bind(server, (struct sockaddr*) &address, sizeof(address)) < 0 ||
+      listen(server, 1) < 0) {
+    perror(path);
+    return 1;
+  }
+  fprintf(stderr, "opc-bridge: listening on %s\n", path);
+
+  while (1) {
+    client = accept(server, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      return 1;
+    }
+    fprintf(stderr, "opc-bridge: producer connected\n");
+    filled = 0;
+    while ((received = read(client, buffer + filled, BRIDGE_BUFFER_SIZE - filled)) > 0) {
+      filled += received;
+      ready = complete_messages(buffer, filled);
+      if (ready > 0) {
+        forward(buffer, ready);
+        memmove(buffer, buffer + ready, filled - ready);
+        filled -= ready;
+      }
+    }
+    if (received < 0) {
+      perror("read");
+    }
+    fprintf(stderr, "opc-bridge: producer disconnected\n");
+    close(client);
+  }
+}
+
+static int bridge_shm(char* name) {
+  opc_shm_header* region = NULL;
+  u32 cursor;
+  u32 passed;
+  ssize_t length;
+
+  while ((region = opc_shm_attach(name)) == NULL) {
+    sleep(1);
+  }
+  fprintf(stderr, "opc-bridge: attached to %s\n", name);
+  cursor = region->write_seq;
+  while (1) {
+    length = opc_shm_read(region, &cursor, buffer, BRIDGE_BUFFER_SIZE, 1000, &passed);
+    if (length < 0) {
+      fprintf(stderr, "opc-bridge: corrupt frame in %s\n", name);
+      return 1;
+    }
+    skipped += passed;
+    if (length > 0) {
+      forward(buffer, length);
+    } else {
+      report();
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s unix:PATH|shm:NAME DESTINATION|-\n", argv[0]);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  if (strcmp(argv[2], "-") != 0) {
+    destination = opc_new_sink_spec(argv[2]);
+    if (destination < 0) {
+      return 1;
+    }
+  }
+  if (strncmp(argv[1], "unix:", 5) == 0) {
+    return bridge_unix(argv[1] + 5);
+  }
+  if (strncmp(argv[1], "shm:", 4) == 0) {
+    return bridge_shm(argv[1] + 4);
+  }
+  fprintf(stderr, "opc-bridge: unknown source %s\n", argv[1]);
+  return 1;
+}
@@ -12,30 +12,47 @@ specific language governing permissions and limitations under the License. */
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 #include "opc.h"
 
-/* Wait at most 0.5 second for a connection or a write. */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Wait at most 1 second for a blocking connection. */
 #define OPC_SEND_TIMEOUT_MS 1000
 
 #define OPC_SINK_TYPE_SOCKET 0
 #define OPC_SINK_TYPE_FILE 1
+#define OPC_SINK_TYPE_UNIX 2
+#define OPC_SINK_TYPE_SHM 3
 
 #define OPC_MAX_PATH 1024
 
-/* Internal structure for a socket sink.  sock >= 0 iff connected. */
+/* Internal structure for a socket sink.  sock >= 0 iff connected; */
+/* connecting >= 0 while a non-blocking connect is in progress. */
 typedef struct {
   struct sockaddr_in address;
   int sock;
+  int connecting;
   char address_string[64];
 } opc_sink_socket;
 
@@ -45,13 +62,32 @@ typedef struct {
   char path[OPC_MAX_PATH + 1];
 } opc_sink_file;
 
-/* Internal structure for a sink. */
+/* Internal structure for a Unix-domain socket sink.  sock >= 0 iff connected. */
+typedef struct {
+  struct sockaddr_un address;
+  int sock;
+} opc_sink_unix;
+
+/* Internal structure for a shared memory sink.  region != NULL iff mapped. */
+typedef struct {
+  opc_shm_header* region;
+  char name[OPC_MAX_PATH + 1];
+} opc_sink_shm;
+
+/* Internal structure for a sink.  pending holds the unsent tail of a */
+/* message that only partly fit, to be finished before anything else goes. */
 typedef struct {
   u8 type;
   union {
     opc_sink_socket socket;
     opc_sink_file file;
+    opc_sink_unix local;
+    opc_sink_shm shm;
   } u;
+  u8* pending;
+  size_t pending_offset;
+  size_t pending_length;
+  size_t pending_capacity;
 } opc_sink_info;
 
 static opc_sink_info opc_sinks[OPC_MAX_SINKS];
@@ -96,6 +132,7 @@ opc_sink opc_new_sink_socket(char* hostport) {
   info->type = OPC_SINK_TYPE_SOCKET;
   ss = &(info->u.socket);
   ss->sock = -1;
+  ss->connecting = -1;
 
   /* Resolve the server address. */
   if (!opc_resolve(hostport, &(ss->address), OPC_DEFAULT_PORT)) {
@@ -134,59 +171,161 @@ opc_sink opc_new_sink_file(char* path) {
   return opc_next_sink++;
 }
 
+opc_sink opc_new_sink_unix(char* path) {
+  opc_sink_info* info;
+  opc_sink_unix* su;
+
+  if (strlen(path) >= sizeof(su->address.sun_path)) {
+    fprintf(stderr, "OPC: Socket path is too long: %s\n", path);
+    return -1;
+  }
+
+  /* Allocate an opc_sink_info entry. */
+  if (opc_next_sink >= OPC_MAX_SINKS) {
+    fprintf(stderr, "OPC: No more sinks available\n");
+    return -1;
+  }
+  info = &opc_sinks[opc_next_sink];
+  info->type = OPC_SINK_TYPE_UNIX;
+  su = &(info->u.local);
+  su->sock = -1;
+  memset(&(su->address), 0, sizeof(su->address));
+  su->address.sun_family = AF_UNIX;
+  strcpy(su->address.sun_path, path);
+
+  /* Increment opc_next_sink only if we were successful. */
+  return opc_next_sink++;
+}
+
+opc_sink opc_new_sink_shm(char* name) {
+  opc_sink_info* info;
+  opc_sink_shm* sm;
+
+#ifndef __linux__
+  fprintf(stderr, "OPC: Shared memory sinks need Linux\n");
+  return -1;
+#endif
+  if (strlen(name) > OPC_MAX_PATH || name[0] != '/') {
+    fprintf(stderr, "OPC: Shared memory name must start with / (max %d chars)\n", OPC_MAX_PATH);
+    return -1;
+  }
+
+  /* Allocate an opc_sink_info entry. */
+  if (opc_next_sink >= OPC_MAX_SINKS) {
+    fprintf(stderr, "OPC: No more sinks available\n");
+    return -1;
+  }
+  info = &opc_sinks[opc_next_sink];
+  info->type = OPC_SINK_TYPE_SHM;
+  sm = &(info->u.shm);
+  sm->region = NULL;
+  strcpy(sm->name, name);
+
+  /* Increment opc_next_sink only if we were successful. */
+  return opc_next_sink++;
+}
+
+opc_sink opc_new_sink_spec(char* spec) {
+  if (strncmp(spec, "unix:", 5) == 0) {
+    return opc_new_sink_unix(spec + 5);
+  }
+  if (strncmp(spec, "shm:", 4) == 0) {
+    return opc_new_sink_shm(spec + 4);
+  }
+  if (strncmp(spec, "file:", 5) == 0) {
+    return opc_new_sink_file(spec + 5);
+  }
+  return opc_new_sink_socket(spec);
+}
+
 /* Backward compatibility. */
 opc_sink opc_new_sink(char* hostport) {
   return opc_new_sink_socket(hostport);
 }
 
-/* Makes one attempt to connect a socket sink, returning 1 on success. */
-static u8 opc_connect_socket(opc_sink_socket* ss, u32 timeout_ms) {
+/* Starts a non-blocking connect for a socket sink.  Returns 1 if it */
+/* connected straight away, 0 if it failed, or -1 if it's in progress in */
+/* ss->connecting. */
+static s8 opc_start_connect(opc_sink_socket* ss) {
   int sock;
-  struct timeval timeout;
-  fd_set writefds;
-  int opt_errno;
-  socklen_t len;
-
-  if (ss->sock >= 0) {  /* already connected */
-    return 1;
-  }
 
-  /* Do a non-blocking connect so we can control the timeout. */
   sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock < 0) {
+    perror("OPC: socket");
+    return 0;
+  }
   fcntl(sock, F_SETFL, O_NONBLOCK);
   if (connect(sock, (struct sockaddr*) &(ss->address),
-              sizeof(ss->address)) < 0 && errno != EINPROGRESS) {
+              sizeof(ss->address)) == 0) {
+    fprintf(stderr, "OPC: Connected to %s\n", ss->address_string);
+    ss->sock = sock;
+    return 1;
+  }
+  if (errno != EINPROGRESS) {
     fprintf(stderr, "OPC: Failed to connect to %s: ", ss->address_string);
     perror(NULL);
     close(sock);
     return 0;
   }
+  ss->connecting = sock;
+  return -1;
+}
+
+/* Completes the connect in progress once its socket is writable.  Returns 1 */
+/* if it succeeded; otherwise the socket is closed and *error, if given, */
+/* says why. */
+static u8 opc_finish_connect(opc_sink_socket* ss, int* error) {
+  int sock = ss->connecting;
+  int opt_errno = 0;
+  socklen_t len = sizeof(opt_errno);
+
+  ss->connecting = -1;
+  getsockopt(sock, SOL_SOCKET, SO_ERROR, &opt_errno, &len);
+  if (error) *error = opt_errno;
+  if (opt_errno == 0) {
+    fprintf(stderr, "OPC: Connected to %s\n", ss->address_string);
+    ss->sock = sock;
+    return 1;
+  }
+  fprintf(stderr, "OPC: Failed to connect to %s: %s\n",
+          ss->address_string, strerror(opt_errno));
+  close(sock);
+  return 0;
+}
+
+/* Makes one attempt to connect a socket sink, waiting up to timeout_ms, */
+/* returning 1 on success. */
+static u8 opc_connect_socket(opc_sink_socket* ss, u32 timeout_ms) {
+  struct pollfd pfd;
+  int opt_errno = 0;
+  s8 started;
+
+  if (ss->sock >= 0) {  /* already connected */
+    return 1;
+  }
+  if (ss->connecting < 0) {
+    started = opc_start_connect(ss);
+    if (started >= 0) {
+      return started;
+    }
+  }
 
   /* Wait for a result. */
-  FD_ZERO(&writefds);
-  FD_SET(sock, &writefds);
-  timeout.tv_sec = timeout_ms/1000;
-  timeout.tv_usec = timeout_ms % 1000;
-  select(sock + 1, NULL, &writefds, NULL, &timeout);
-  if (FD_ISSET(sock, &writefds)) {
-    opt_errno = 0;
-    getsockopt(sock, SOL_SOCKET, SO_ERROR, &opt_errno, &len);
-    if (opt_errno == 0) {
-      fprintf(stderr, "OPC: Connected to %s\n", ss->address_string);
-      ss->sock = sock;
+  pfd.fd = ss->connecting;
+  pfd.events = POLLOUT;
+  if (poll(&pfd, 1, timeout_ms) > 0) {
+    if (opc_finish_connect(ss, &opt_errno)) {
       return 1;
-    } else {
-      fprintf(stderr, "OPC: Failed to connect to %s: %s\n",
-              ss->address_string, strerror(opt_errno));
-      close(sock);
-      if (opt_errno == ECONNREFUSED) {
-        usleep(timeout_ms*1000);
-      }
-      return 0;
     }
+    if (opt_errno == ECONNREFUSED) {
+      usleep(timeout_ms*1000);
+    }
+    return 0;
   }
   fprintf(stderr, "OPC: No connection to %s after %d ms\n",
           ss->address_string, timeout_ms);
+  close(ss->connecting);
+  ss->connecting = -1;
   return 0;
 }
 
@@ -204,16 +343,129 @@ static u8 opc_open_file(opc_sink_file* sf) {
   return 1;
 }
 
+/* Makes one attempt to connect a Unix-domain socket sink, returning 1 on success. */
+static u8 opc_connect_unix(opc_sink_unix* su) {
+  int sock;
+
+  if (su->sock >= 0) {  /* already connected */
+    return 1;
+  }
+
+  /* A local connect completes or fails immediately, so it needs no timeout. */
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr*) &(su->address),
+                          sizeof(su->address)) < 0) {
+    fprintf(stderr, "OPC: Failed to connect to %s: %s\n",
+            su->address.sun_path, strerror(errno));
+    if (sock >= 0) close(sock);
+    return 0;
+  }
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  fprintf(stderr, "OPC: Connected to %s\n", su->address.sun_path);
+  su->sock = sock;
+  return 1;
+}
+
+#ifdef __linux__
+static int opc_futex(u32* word, int op, u32 value, u32 timeout_ms) {
+  struct timespec timeout;
+
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  return syscall(SYS_futex, word, op, value,
+                 op == FUTEX_WAIT ? &timeout : NULL, NULL, 0);
+}
+
+/* Maps a shared memory region, creating it if need be.  A region left */
+/* behind by an earlier producer is reused so attached consumers carry on. */
+static opc_shm_header* opc_shm_map(const char* name, u8 create) {
+  int fd;
+  struct stat st;
+  opc_shm_header* region;
+
+  fd = shm_open(name, create ? O_CREAT | O_RDWR : O_RDWR, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "OPC: %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+  if (create && ftruncate(fd, OPC_SHM_REGION_SIZE) < 0) {
+    fprintf(stderr, "OPC: %s: %s\n", name, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < OPC_SHM_REGION_SIZE) {
+    fprintf(stderr, "OPC: %s is not an OPC shared memory region\n", name);
+    close(fd);
+    return NULL;
+  }
+  region = (opc_shm_header*) mmap(NULL, OPC_SHM_REGION_SIZE,
+                                  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (region == MAP_FAILED) {
+    fprintf(stderr, "OPC: %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+  if (create && (region->magic != OPC_SHM_MAGIC ||
+                 region->slot_count != OPC_SHM_SLOTS ||
+                 region->slot_size != OPC_SHM_SLOT_SIZE)) {
+    memset(region, 0, sizeof(opc_shm_header));
+    region->slot_count = OPC_SHM_SLOTS;
+    region->slot_size = OPC_SHM_SLOT_SIZE;
+    __atomic_store_n(&region->magic, OPC_SHM_MAGIC, __ATOMIC_RELEASE);
+  }
+  if (!create && __atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != OPC_SHM_MAGIC) {
+    fprintf(stderr, "OPC: %s has not been set up by a producer yet\n", name);
+    munmap(region, OPC_SHM_REGION_SIZE);
+    return NULL;
+  }
+  return region;
+}
+
+/* Copies the data in iov into the next slot and publishes it.  Consumers */
+/* are only woken with a syscall if one is actually asleep. */
+static u8 opc_publish_shm(opc_sink_shm* sm, struct iovec* iov, int iovcnt) {
+  opc_shm_header* region = sm->region;
+  u32 seq = region->write_seq;
+  u32 slot = seq % OPC_SHM_SLOTS;
+  u8* data = (u8*) region + OPC_SHM_HEADER_SIZE + slot * OPC_SHM_SLOT_SIZE;
+  size_t length = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    if (length + iov[i].iov_len > OPC_SHM_SLOT_SIZE) {
+      fprintf(stderr, "OPC: Frame too large for %s (max %d bytes)\n",
+              sm->name, OPC_SHM_SLOT_SIZE);
+      return 0;
+    }
+    memcpy(data + length, iov[i].iov_base, iov[i].iov_len);
+    length += iov[i].iov_len;
+  }
+  region->lengths[slot] = length;
+  __atomic_store_n(&region->write_seq, seq + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&region->waiters, __ATOMIC_SEQ_CST) > 0) {
+    opc_futex(&region->write_seq, FUTEX_WAKE, INT_MAX, 0);
+  }
+  return 1;
+}
+#endif
+
 /* Closes the connection for a sink. */
 static void opc_close(opc_sink sink) {
-  opc_sink_info* info = &opc_sinks[sink];
+  opc_sink_info* info;
 
   if (sink < 0 || sink >= opc_next_sink) {
     fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
     return;
   }
+  info = &opc_sinks[sink];
+  /* the tail of a message means nothing on a new connection */
+  info->pending_offset = info->pending_length = 0;
   switch (info->type) {
     case OPC_SINK_TYPE_SOCKET:
+      if (info->u.socket.connecting >= 0) {
+        close(info->u.socket.connecting);
+        info->u.socket.connecting = -1;
+      }
       if (info->u.socket.sock >= 0) {
         close(info->u.socket.sock);
         info->u.socket.sock = -1;
@@ -228,133 +480,534 @@ static void opc_close(opc_sink sink) {
         fprintf(stderr, "OPC: Closed %s\n", info->u.file.path);
       }
       break;
+    case OPC_SINK_TYPE_UNIX:
+      if (info->u.local.sock >= 0) {
+        close(info->u.local.sock);
+        info->u.local.sock = -1;
+        fprintf(stderr, "OPC: Closed connection to %s\n",
+                info->u.local.address.sun_path);
+      }
+      break;
+    case OPC_SINK_TYPE_SHM:
+#ifdef __linux__
+      if (info->u.shm.region != NULL) {
+        munmap(info->u.shm.region, OPC_SHM_REGION_SIZE);
+        info->u.shm.region = NULL;
+      }
+#endif
+      break;
     default:
       fprintf(stderr, "OPC: Unknown sink type %d\n", info->type);
   }
 }
 
+int opc_sink_fd(opc_sink sink) {
+  opc_sink_info* info;
+
+  if (sink < 0 || sink >= opc_next_sink) {
+    return -1;
+  }
+  info = &opc_sinks[sink];
+  switch (info->type) {
+    case OPC_SINK_TYPE_SOCKET:
+      return info->u.socket.sock;
+    case OPC_SINK_TYPE_FILE:
+      return info->u.file.fd;
+    case OPC_SINK_TYPE_UNIX:
+      return info->u.local.sock;
+    default:
+      return -1;
+  }
+}
+
 /* Makes one attempt to open the connection for a sink if needed, timing out */
 /* after timeout_ms.  Returns 1 if connected, 0 if the timeout expired. */
 static u8 opc_connect(opc_sink sink, u32 timeout_ms) {
-  opc_sink_info* info = &opc_sinks[sink];
+  opc_sink_info* info;
 
   if (sink < 0 || sink >= opc_next_sink) {
     fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
     return 0;
   }
+  info = &opc_sinks[sink];
   switch (info->type) {
     case OPC_SINK_TYPE_SOCKET:
       return opc_connect_socket(&(info->u.socket), timeout_ms);
     case OPC_SINK_TYPE_FILE:
       return opc_open_file(&(info->u.file));
+    case OPC_SINK_TYPE_UNIX:
+      return opc_connect_unix(&(info->u.local));
+    case OPC_SINK_TYPE_SHM:
+#ifdef __linux__
+      if (info->u.shm.region == NULL) {
+        info->u.shm.region = opc_shm_map(info->u.shm.name, 1);
+      }
+      return info->u.shm.region != NULL;
+#else
+      return 0;
+#endif
     default:
       fprintf(stderr, "OPC: Unknown sink type %d\n", info->type);
       return 0;
   }
 }
 
-/* Sends data to a socket sink, making at most one attempt to open the */
-/* connection if needed and waiting at most timeout_ms for each I/O */
-/* operation.  Returns 1 if all the data was sent, 0 otherwise. */
-static u8 opc_send_socket(
-    opc_sink_socket* ss, const u8* data, ssize_t len, u32 timeout_ms) {
-  struct timeval timeout;
-  ssize_t total_sent = 0;
+s8 opc_connect_nonblocking(opc_sink sink, int* fd) {
+  opc_sink_socket* ss;
+  struct pollfd pfd;
+  s8 started;
+
+  *fd = -1;
+  if (sink < 0 || sink >= opc_next_sink) {
+    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+    return 0;
+  }
+  if (opc_sinks[sink].type != OPC_SINK_TYPE_SOCKET) {
+    /* the others connect or fail without waiting */
+    return opc_connect(sink, 0);
+  }
+  ss = &(opc_sinks[sink].u.socket);
+  if (ss->sock >= 0) {
+    return 1;
+  }
+  if (ss->connecting >= 0) {
+    pfd.fd = ss->connecting;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, 0) > 0) {
+      return opc_finish_connect(ss, NULL);
+    }
+  } else {
+    started = opc_start_connect(ss);
+    if (started >= 0) {
+      return started;
+    }
+  }
+  *fd = ss->connecting;
+  return -1;
+}
+
+u8 opc_sink_connected(opc_sink sink) {
+  opc_sink_info* info;
+
+  if (sink < 0 || sink >= opc_next_sink) {
+    return 0;
+  }
+  info = &opc_sinks[sink];
+  switch (info->type) {
+    case OPC_SINK_TYPE_SOCKET:
+      return info->u.socket.sock >= 0;
+    case OPC_SINK_TYPE_FILE:
+      return info->u.file.fd >= 0;
+    case OPC_SINK_TYPE_UNIX:
+      return info->u.local.sock >= 0;
+    case OPC_SINK_TYPE_SHM:
+#ifdef __linux__
+      return info->u.shm.region != NULL;
+#endif
+    default:
+      return 0;
+  }
+}
+
+/* Results of opc_writev_all. */
+#define OPC_WRITE_FAILED 0
+#define OPC_WRITE_DONE 1
+#define OPC_WRITE_BLOCKED 2  /* the buffer was full and nothing was written */
+
+/* Keeps what's left of iov in the sink's pending buffer. */
+static u8 opc_keep_pending(opc_sink_info* info, struct iovec* iov, int iovcnt) {
+  size_t length = 0;
+  u8* buffer;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    length += iov[i].iov_len;
+  }
+  if (length > info->pending_capacity) {
+    buffer = (u8*) realloc(info->pending, length);
+    if (buffer == NULL) {
+      return 0;
+    }
+    info->pending = buffer;
+    info->pending_capacity = length;
+  }
+  info->pending_offset = info->pending_length = 0;
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(info->pending + info->pending_length, iov[i].iov_base, iov[i].iov_len);
+    info->pending_length += iov[i].iov_len;
+  }
+  return 1;
+}
+
+/* Writes out every byte described by iov, resuming after partial writes. */
+/* The iov array is consumed in the process.  Socket sinks are non-blocking: */
+/* if none of the data fits it's left unsent; once some has gone out, the */
+/* rest is kept in the sink's pending buffer for opc_flush to finish, so */
+/* the stream never ends partway through a message and nothing waits. */
+static u8 opc_writev_all(opc_sink_info* info, int fd, struct iovec* iov,
+                         int iovcnt, const char* error_prefix) {
   ssize_t sent;
   sig_t pipe_sig;
+  u8 started = 0;
 
-  timeout.tv_sec = timeout_ms/1000;
-  timeout.tv_usec = timeout_ms % 1000;
-  setsockopt(ss->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-  while (total_sent < len) {
+  while (iovcnt > 0) {
     pipe_sig = signal(SIGPIPE, SIG_IGN);
-    sent = send(ss->sock, data + total_sent, len - total_sent, 0);
+    sent = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
     signal(SIGPIPE, pipe_sig);
-    if (sent <= 0) {
-      perror("OPC: Error sending data");
-      return 0;
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!started) {
+        return OPC_WRITE_BLOCKED;
+      }
+      if (!opc_keep_pending(info, iov, iovcnt)) {
+        fprintf(stderr, "%s: no memory for the rest of the message\n", error_prefix);
+        return OPC_WRITE_FAILED;
+      }
+      return OPC_WRITE_DONE;
+    }
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent < 0 || (sent == 0 && iov->iov_len > 0)) {
+      perror(error_prefix);
+      return OPC_WRITE_FAILED;
+    }
+    started = 1;
+    while (iovcnt > 0 && (size_t) sent >= iov->iov_len) {
+      sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (u8*) iov->iov_base + sent;
+      iov->iov_len -= sent;
     }
-    total_sent += sent;
   }
-  return 1;
+  return OPC_WRITE_DONE;
 }
 
-/* Writes data to a file sink, returning 1 if all the data was written. */
-static u8 opc_write_file(opc_sink_file* sf, const u8* data, ssize_t len) {
-  ssize_t total_sent = 0;
+/* Writes as much of a sink's pending bytes as fits, resuming after partial */
+/* writes.  Returns OPC_WRITE_BLOCKED if some are left. */
+static u8 opc_write_pending(opc_sink_info* info, const char* error_prefix) {
   ssize_t sent;
   sig_t pipe_sig;
+  int fd = -1;
 
-  while (total_sent < len) {
+  switch (info->type) {
+    case OPC_SINK_TYPE_SOCKET:
+      fd = info->u.socket.sock;
+      break;
+    case OPC_SINK_TYPE_FILE:
+      fd = info->u.file.fd;
+      break;
+    case OPC_SINK_TYPE_UNIX:
+      fd = info->u.local.sock;
+      break;
+  }
+  while (info->pending_offset < info->pending_length) {
     pipe_sig = signal(SIGPIPE, SIG_IGN);
-    sent = write(sf->fd, data + total_sent, len - total_sent);
+    sent = write(fd, info->pending + info->pending_offset,
+                 info->pending_length - info->pending_offset);
     signal(SIGPIPE, pipe_sig);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return OPC_WRITE_BLOCKED;
+    }
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
     if (sent <= 0) {
-      perror("OPC: Error writing data");
-      return 0;
+      perror(error_prefix);
+      return OPC_WRITE_FAILED;
     }
-    total_sent += sent;
+    info->pending_offset += sent;
+  }
+  info->pending_offset = info->pending_length = 0;
+  return OPC_WRITE_DONE;
+}
+
+s8 opc_flush(opc_sink sink) {
+  opc_sink_info* info;
+
+  if (sink < 0 || sink >= opc_next_sink) {
+    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+    return -1;
+  }
+  info = &opc_sinks[sink];
+  if (info->pending_length == 0) {
+    return 1;
+  }
+  switch (opc_write_pending(info, "OPC: Error sending data")) {
+    case OPC_WRITE_DONE:
+      return 1;
+    case OPC_WRITE_BLOCKED:
+      return 0;
+    default:
+      opc_close(sink);
+      return -1;
   }
-  return 1;
 }
 
-/* Sends data to a sink, making at most one attempt to open the connection */
-/* if needed and waiting at most timeout_ms for each I/O operation.  Returns */
-/* 1 if all the data was sent, 0 otherwise. */
-static u8 opc_send(opc_sink sink, const u8* data, ssize_t len, u32 timeout_ms) {
-  opc_sink_info* info = &opc_sinks[sink];
+/* Sends the buffers in iov to a sink with a single vectored write where */
+/* possible, making at most one attempt to open the connection if needed and */
+/* waiting at most timeout_ms for it.  Returns 1 if the data was sent or the */
+/* unsent part kept for opc_flush, 0 otherwise.  The connection is closed on */
+/* errors, but not when a full socket buffer (or the unfinished tail of the */
+/* last message) meant nothing was sent. */
+static u8 opc_sendv(opc_sink sink, struct iovec* iov, int iovcnt,
+                    u32 timeout_ms) {
+  opc_sink_info* info;
   int result = 0;
 
   if (sink < 0 || sink >= opc_next_sink) {
     fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
     return 0;
   }
+  info = &opc_sinks[sink];
   if (!opc_connect(sink, timeout_ms)) {
     return 0;
   }
+  if (opc_flush(sink) <= 0) {
+    return 0;
+  }
   switch (info->type) {
     case OPC_SINK_TYPE_SOCKET:
-      result = opc_send_socket(&(info->u.socket), data, len, timeout_ms);
+      result = opc_writev_all(info, info->u.socket.sock, iov, iovcnt,
+                              "OPC: Error sending data");
       break;
     case OPC_SINK_TYPE_FILE:
-      result = opc_write_file(&(info->u.file), data, len);
+      result = opc_writev_all(info, info->u.file.fd, iov, iovcnt,
+                              "OPC: Error writing data");
+      break;
+    case OPC_SINK_TYPE_UNIX:
+      result = opc_writev_all(info, info->u.local.sock, iov, iovcnt,
+                              "OPC: Error sending data");
       break;
+    case OPC_SINK_TYPE_SHM:
+#ifdef __linux__
+      /* A frame that doesn't fit is dropped, but the region stays usable. */
+      return opc_publish_shm(&(info->u.shm), iov, iovcnt);
+#else
+      return 0;
+#endif
     default:
       fprintf(stderr, "OPC: Unknown sink type %d\n", info->type);
       return 0;
   }
 
-  if (result == 0) opc_close(sink);
-  return result;
+  if (result == OPC_WRITE_FAILED) opc_close(sink);
+  return result == OPC_WRITE_DONE;
 }
 
-u8 opc_send_header(opc_sink sink, u8 channel, u8 command, u16 len) {
-  u8 header[4];
-
+static void opc_fill_header(u8* header, u8 channel, u8 command, u16 len) {
   header[0] = channel;
   header[1] = command;
   header[2] = len >> 8;
   header[3] = len & 0xff;
-  return opc_send(sink, header, 4, OPC_SEND_TIMEOUT_MS);
 }
 
 u8 opc_put_pixels(opc_sink sink, u8 channel, u16 count, pixel* pixels) {
-  ssize_t len;
+  u8 header[4];
+  struct iovec iov[2];
 
-  if (count > 0xffff / 3) {
+  if (count > OPC_MAX_PIXELS_PER_MESSAGE) {
     fprintf(stderr, "OPC: Maximum pixel count exceeded (%d > %d)\n",
-            count, 0xffff / 3);
+            count, OPC_MAX_PIXELS_PER_MESSAGE);
+    return 0;
+  }
+
+  opc_fill_header(header, channel, OPC_SET_PIXELS, count * 3);
+  iov[0].iov_base = header;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = pixels;
+  iov[1].iov_len = count * 3;
+  return opc_sendv(sink, iov, 2, OPC_SEND_TIMEOUT_MS);
+}
+
+u8 opc_make_channel_map(u32 count, u8 first_channel, opc_span* map, u8 max_spans) {
+  u32 first = 0;
+  u8 spans = 0;
+
+  if (count > OPC_MAX_PIXELS_PER_MESSAGE && first_channel == OPC_BROADCAST) {
+    first_channel = 1;
+  }
+  do {
+    if (spans >= max_spans || (u32) first_channel + spans > 0xff) {
+      fprintf(stderr, "OPC: %u pixels do not fit in %d channels\n",
+              count, max_spans);
+      return 0;
+    }
+    map[spans].channel = first_channel + spans;
+    map[spans].first = first;
+    map[spans].count = count - first < OPC_MAX_PIXELS_PER_MESSAGE ?
+        count - first : OPC_MAX_PIXELS_PER_MESSAGE;
+    first += map[spans].count;
+    spans++;
+  } while (first < count);
+  return spans;
+}
+
+u8 opc_put_frame(opc_sink sink, const opc_span* map, u8 span_count, pixel* pixels) {
+  u8 headers[OPC_MAX_SPANS + 1][4];
+  struct iovec iov[2 * (OPC_MAX_SPANS + 1)];
+  int iovcnt = 0;
+  u8 i;
+
+  for (i = 0; i < span_count; i++) {
+    if (map[i].count > OPC_MAX_PIXELS_PER_MESSAGE) {
+      fprintf(stderr, "OPC: Span for channel %d too long (%d > %d)\n",
+              map[i].channel, map[i].count, OPC_MAX_PIXELS_PER_MESSAGE);
+      return 0;
+    }
+    opc_fill_header(headers[i], map[i].channel, OPC_SET_PIXELS,
+                    map[i].count * 3);
+    iov[iovcnt].iov_base = headers[i];
+    iov[iovcnt++].iov_len = 4;
+    iov[iovcnt].iov_base = pixels + map[i].first;
+    iov[iovcnt++].iov_len = map[i].count * 3;
+  }
+  if (span_count > 1) {
+    opc_fill_header(headers[span_count], 0, OPC_STREAM_SYNC,
+                    OPC_STREAM_SYNC_LENGTH);
+    iov[iovcnt].iov_base = headers[span_count];
+    iov[iovcnt++].iov_len = 4;
+    iov[iovcnt].iov_base = OPC_STREAM_SYNC_DATA;
+    iov[iovcnt++].iov_len = OPC_STREAM_SYNC_LENGTH;
+  }
+  return opc_sendv(sink, iov, iovcnt, OPC_SEND_TIMEOUT_MS);
+}
+
+size_t opc_frame_length(const opc_span* map, u8 span_count) {
+  size_t length = 0;
+  u8 i;
+
+  for (i = 0; i < span_count; i++) {
+    length += 4 + map[i].count * 3;
+  }
+  if (span_count > 1) {
+    length += 4 + OPC_STREAM_SYNC_LENGTH;
+  }
+  return length;
+}
+
+void opc_layout_frame(const opc_span* map, u8 span_count, u8* buffer) {
+  u8 i;
+
+  for (i = 0; i < span_count; i++) {
+    opc_fill_header(buffer, map[i].channel, OPC_SET_PIXELS, map[i].count * 3);
+    memset(buffer + 4, 0, map[i].count * 3);
+    buffer += 4 + map[i].count * 3;
+  }
+  if (span_count > 1) {
+    opc_fill_header(buffer, 0, OPC_STREAM_SYNC, OPC_STREAM_SYNC_LENGTH);
+    memcpy(buffer + 4, OPC_STREAM_SYNC_DATA, OPC_STREAM_SYNC_LENGTH);
+  }
+}
+
+pixel* opc_frame_pixels(u8* buffer, const opc_span* map, u8 index) {
+  /* spans before this one each add a header and their pixels */
+  size_t offset = 4;
+  u8 i;
+
+  for (i = 0; i < index; i++) {
+    offset += 4 + map[i].count * 3;
+  }
+  return (pixel*) (buffer + offset);
+}
+
+u8 opc_put_frame_buffer(opc_sink sink, u8* buffer, size_t length) {
+  struct iovec iov;
+
+  iov.iov_base = buffer;
+  iov.iov_len = length;
+  return opc_sendv(sink, &iov, 1, OPC_SEND_TIMEOUT_MS);
+}
+
+u32 opc_hash(u32 hash, const u8* data, size_t length) {
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static void opc_put_be(u8* buffer, uint64_t value, int bytes) {
+  while (bytes-- > 0) {
+    buffer[bytes] = value & 0xff;
+    value >>= 8;
   }
-  len = count * 3;
+}
 
-  return opc_send_header(sink, channel, OPC_SET_PIXELS, len) &&
-      opc_send(sink, (u8*) pixels, len, OPC_SEND_TIMEOUT_MS);
+void opc_fill_timestamp(u8* buffer, u32 frame, uint64_t render_ns,
+                        uint64_t send_ns, u32 hash) {
+  opc_fill_header(buffer, 0, OPC_SYSTEM_EXCLUSIVE, OPC_TIMESTAMP_LENGTH - 4);
+  opc_put_be(buffer + 4, OPC_SYSID_ORTHO, 2);
+  opc_put_be(buffer + 6, frame, 4);
+  opc_put_be(buffer + 10, render_ns, 8);
+  opc_put_be(buffer + 18, send_ns, 8);
+  opc_put_be(buffer + 26, hash, 4);
 }
 
 u8 opc_stream_sync(opc_sink sink) {
-  ssize_t len = OPC_STREAM_SYNC_LENGTH;
-  u8* data = OPC_STREAM_SYNC_DATA;
+  u8 header[4];
+  struct iovec iov[2];
+
+  opc_fill_header(header, 0, OPC_STREAM_SYNC, OPC_STREAM_SYNC_LENGTH);
+  iov[0].iov_base = header;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = OPC_STREAM_SYNC_DATA;
+  iov[1].iov_len = OPC_STREAM_SYNC_LENGTH;
+  return opc_sendv(sink, iov, 2, OPC_SEND_TIMEOUT_MS);
+}
+
+// OPC shared memory consumer functions -------------------------------------
+
+#ifdef __linux__
+opc_shm_header* opc_shm_attach(char* name) {
+  return opc_shm_map(name, 0);
+}
+
+void opc_shm_detach(opc_shm_header* region) {
+  munmap(region, OPC_SHM_REGION_SIZE);
+}
+
+ssize_t opc_shm_read(opc_shm_header* region, u32* cursor, u8* buffer,
+                     size_t size, u32 timeout_ms, u32* skipped) {
+  u32 seq, latest, length;
+  u8* data;
+
+  *skipped = 0;
+  while (1) {
+    seq = __atomic_load_n(&region->write_seq, __ATOMIC_SEQ_CST);
+    if (seq == *cursor) {
+      /* nothing new; sleep on the doorbell */
+      __atomic_add_fetch(&region->waiters, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&region->write_seq, __ATOMIC_SEQ_CST) == *cursor) {
+        opc_futex(&region->write_seq, FUTEX_WAIT, *cursor, timeout_ms);
+      }
+      __atomic_sub_fetch(&region->waiters, 1, __ATOMIC_SEQ_CST);
+      seq = __atomic_load_n(&region->write_seq, __ATOMIC_SEQ_CST);
+      if (seq == *cursor) {
+        return 0;
+      }
+    }
 
-  return opc_send_header(sink, 0, OPC_STREAM_SYNC, len) &&
-      opc_send(sink, data, len, OPC_SEND_TIMEOUT_MS);
+    /* Only the newest frame matters; anything older is skipped. */
+    latest = seq - 1;
+    length = region->lengths[latest % OPC_SHM_SLOTS];
+    if (length > size || length > OPC_SHM_SLOT_SIZE) {
+      return -1;
+    }
+    data = (u8*) region + OPC_SHM_HEADER_SIZE + (latest % OPC_SHM_SLOTS) * OPC_SHM_SLOT_SIZE;
+    memcpy(buffer, data, length);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    /* The producer reuses a slot once it is OPC_SHM_SLOTS frames behind; */
+    /* if that happened while copying, the copy may be torn, so try again. */
+    if (__atomic_load_n(&region->write_seq, __ATOMIC_RELAXED) - latest >= OPC_SHM_SLOTS) {
+      continue;
+    }
+    *skipped = latest - *cursor;
+    *cursor = seq;
+    return length;
+  }
 }
+#endif
@@ -0,0 +1,405 @@
+/* Stand-in for fcserver that measures what actually arrives.  Accepts the OPC
+   stream from ortho, notes when each frame lands and hashes its pixels, and
+   reports frame rate, inter-arrival jitter and partial frames:
+
+     opc-loopback -p 7891 &
+     bin/ortho --sink 127.0.0.1:7891 --opc-timestamps
+
+   With --opc-timestamps, ortho sends a system exclusive message ahead of each
+   frame (see opc_fill_timestamp), and end-to-end latency (render to arrival),
+   transport latency (send to arrival), torn frames and dropped frames are
+   reported as well.  Both ends must be on the same host, since the timestamps
+   are CLOCK_MONOTONIC.
+
+   A frame ends with a stream sync, once the expected number of pixels has
+   arrived, or when the next frame visibly begins. */
+
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "opc.h"
+
+#define LOOPBACK_DEFAULT_PORT 7891
+#define LOOPBACK_DEFAULT_PIXELS 768  /* ortho's NUM_LEDS */
+#define LOOPBACK_READ_SIZE 65536
+#define LOOPBACK_SYSEX_LENGTH (OPC_TIMESTAMP_LENGTH - 4)
+
+typedef struct {
+  uint64_t* values;
+  size_t count;
+  size_t capacity;
+} series;
+
+/* Arrival times of every frame, and latencies of the timestamped ones. */
+static series arrivals;
+static series render_latency;
+static series send_latency;
+
+static long partial_frames = 0;
+static long torn_frames = 0;
+static long dropped_frames = 0;
+
+/* Parser state for the current message. */
+static u8 header[4];
+static int header_length = 0;
+static u32 payload_length = 0;
+static u32 payload_received = 0;
+static u8 sysex[LOOPBACK_SYSEX_LENGTH];
+
+/* The frame being received. */
+static int frame_open = 0;
+static u8 channels_seen[256];
+static u32 pixel_bytes = 0;
+static u32 hash = OPC_HASH_INIT;
+static int has_timestamp = 0;
+static u32 frame_number = 0;
+static uint64_t render_ns = 0;
+static uint64_t send_ns = 0;
+static u32 expected_hash = 0;
+static int have_last_number = 0;
+static u32 last_number = 0;
+
+static u32 expected_pixel_bytes = 3 * LOOPBACK_DEFAULT_PIXELS;
+
+static volatile sig_atomic_t stopping = 0;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void append(series* s, uint64_t value) {
+  if (s->count == s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 4096;
+    s->values = (uint64_t*) realloc(s->values, s->capacity * sizeof(uint64_t));
+    if (s->values == NULL) {
+      perror("opc-loopback");
+      exit(1);
+    }
+  }
+  s->values[s->count++] = value;
+}
+
+static uint64_t get_be(const u8* data, int bytes) {
+  uint64_t value = 0;
+  int i;
+
+  for (i = 0; i < bytes; i++) {
+    value = value << 8 | data[i];
+  }
+  return value;
+}
+
+static void close_frame(uint64_t now) {
+  if (!frame_open) {
+    return;
+  }
+  frame_open = 0;
+  append(&arrivals, now);
+  if (pixel_bytes < expected_pixel_bytes) {
+    partial_frames++;
+  }
+  if (!has_timestamp) {
+    return;
+  }
+  if (hash != expected_hash) {
+    torn_frames++;
+  }
+  append(&render_latency, now - render_ns);
+  append(&send_latency, now - send_ns);
+  /* ortho numbers every frame it renders, so gaps are frames it didn't send */
+  if (have_last_number && frame_number > last_number) {
+    dropped_frames += frame_number - last_number - 1;
+  }
+  have_last_number = 1;
+  last_number = frame_number;
+}
+
+static void open_frame() {
+  frame_open = 1;
+  memset(channels_seen, 0, sizeof(channels_seen));
+  pixel_bytes = 0;
+  hash = OPC_HASH_INIT;
+  has_timestamp = 0;
+}
+
+static void header_complete(uint64_t now) {
+  if (header[1] != OPC_SET_PIXELS) {
+    return;
+  }
+  /* pixels for a channel we already have mean the next frame has begun */
+  if (frame_open && channels_seen[header[0]]) {
+    close_frame(now);
+  }
+  if (!frame_open) {
+    open_frame();
+  }
+  channels_seen[header[0]] = 1;
+}
+
+static void message_complete(uint64_t now) {
+  if (header[1] == OPC_SET_PIXELS) {
+    if (pixel_bytes >= expected_pixel_bytes) {
+      close_frame(now);
+    }
+  } else if (header[1] == OPC_SYSTEM_EXCLUSIVE) {
+    if (payload_length == OPC_STREAM_SYNC_LENGTH &&
+        memcmp(sysex, OPC_STREAM_SYNC_DATA, OPC_STREAM_SYNC_LENGTH) == 0) {
+      close_frame(now);
+    } else if (payload_length == LOOPBACK_SYSEX_LENGTH &&
+               get_be(sysex, 2) == OPC_SYSID_ORTHO) {
+      close_frame(now);
+      open_frame();
+      has_timestamp = 1;
+      frame_number = get_be(sysex + 2, 4);
+      render_ns = get_be(sysex + 6, 8);
+      send_ns = get_be(sysex + 14, 8);
+      expected_hash = get_be(sysex + 22, 4);
+    }
+  }
+}
+
+/* Feeds bytes that arrived at 'now' through the parser. */
+static void consume(u8* data, size_t length, uint64_t now) {
+  size_t n;
+
+  while (length > 0) {
+    if (header_length < 4) {
+      header[header_length++] = *data++;
+      length--;
+      if (header_length < 4) continue;
+      payload_length = header[2] << 8 | header[3];
+      payload_received = 0;
+      header_complete(now);
+    } else {
+      n = payload_length - payload_received;
+      if (n > length) n = length;
+      if (header[1] == OPC_SET_PIXELS && frame_open) {
+        hash = opc_hash(hash, data, n);
+        pixel_bytes += n;
+      } else if (header[1] == OPC_SYSTEM_EXCLUSIVE &&
+                 payload_received < LOOPBACK_SYSEX_LENGTH) {
+        memcpy(sysex + payload_received, data,
+               n < LOOPBACK_SYSEX_LENGTH - payload_received ?
+               n : LOOPBACK_SYSEX_LENGTH - payload_received);
+      }
+      payload_received += n;
+      data += n;
+      length -= n;
+    }
+    if (header_length == 4 && payload_received == payload_length) {
+      message_complete(now);
+      header_length = 0;
+    }
+  }
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Prints mean, deviation and percentiles of durations in nanoseconds, as ms. */
+static void describe(const char* label, const uint64_t* values, size_t count) {
+  uint64_t* sorted;
+  double sum = 0, squares = 0, mean;
+  size_t i;
+
+  if (count == 0) {
+    fprintf(stderr, "  %-10s  -\n", label);
+    return;
+  }
+  sorted = (uint64_t*) malloc(count * sizeof(uint64_t));
+  memcpy(sorted, values, count * sizeof(uint64_t));
+  qsort(sorted, count, sizeof(uint64_t), compare_u64);
+  for (i = 0; i < count; i++) {
+    sum += values[i];
+  }
+  mean = sum / count;
+  for (i = 0; i < count; i++) {
+    squares += (values[i] - mean) * (values[i] - mean);
+  }
+  fprintf(stderr, "  %-10s  mean %7.3f  stddev %7.3f  p50 %7.3f  p99 %7.3f  max %7.3f ms\n",
+          label, mean / 1e6, sqrt(squares / count) / 1e6,
+          sorted[count / 2] / 1e6, sorted[count * 99 / 100] / 1e6,
+          sorted[count - 1] / 1e6);
+  free(sorted);
+}
+
+/* The most frames that arrived within any one second. */
+static size_t max_sustained(const uint64_t* times, size_t count) {
+  size_t best = 0, first = 0, i;
+
+  for (i = 0; i < count; i++) {
+    while (times[i] - times[first] >= 1000000000ULL) {
+      first++;
+    }
+    if (i - first + 1 > best) {
+      best = i - first + 1;
+    }
+  }
+  return best;
+}
+
+/* Summarizes the frames from index 'frame' and latencies from index 'latency' on. */
+static void report(const char* title, size_t frame, size_t latency) {
+  size_t count = arrivals.count - frame;
+  uint64_t* intervals;
+  double seconds;
+  size_t i;
+
+  if (count < 2) {
+    fprintf(stderr, "opc-loopback: %s: %zu frames\n", title, count);
+    return;
+  }
+  seconds = (arrivals.values[arrivals.count - 1] - arrivals.values[frame]) / 1e9;
+  fprintf(stderr, "opc-loopback: %s: %zu frames in %.1f s, %.1f fps, max sustained %zu fps\n",
+          title, count, seconds, (count - 1) / seconds,
+          max_sustained(arrivals.values + frame, count));
+  intervals = (uint64_t*) malloc((count - 1) * sizeof(uint64_t));
+  for (i = 1; i < count; i++) {
+    intervals[i - 1] = arrivals.values[frame + i] - arrivals.values[frame + i - 1];
+  }
+  describe("interval", intervals, count - 1);
+  free(intervals);
+  if (render_latency.count > latency) {
+    describe("render", render_latency.values + latency, render_latency.count - latency);
+    describe("transport", send_latency.values + latency, send_latency.count - latency);
+  }
+}
+
+static void summary() {
+  report("total", 0, 0);
+  fprintf(stderr, "  %ld partial, %ld torn, %ld dropped\n",
+          partial_frames, torn_frames, dropped_frames);
+  if (arrivals.count > 0 && render_latency.count == 0) {
+    fprintf(stderr, "  no timestamps seen; run ortho with --opc-timestamps for latency\n");
+  }
+}
+
+static void handle_signal(int signum) {
+  stopping = 1;
+}
+
+static int listen_on(u16 port) {
+  struct sockaddr_in address;
+  int sock;
+  int one = 1;
+
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return -1;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(sock, (struct sockaddr*) &address, sizeof(address)) < 0 ||
+      listen(sock, 1) < 0) {
+    fprintf(stderr, "opc-loopback: could not listen on port %d: %s\n", port,
+            strerror(errno));
+    close(sock);
+    return -1;
+  }
+  fprintf(stderr, "opc-loopback: listening on 127.0.0.1:%d\n", port);
+  return sock;
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [-p PORT] [-n PIXELS] [-d SECONDS] [-i INTERVAL_SECONDS]\n", argv0);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  static u8 buffer[LOOPBACK_READ_SIZE];
+  struct sigaction action;
+  struct pollfd fds;
+  u16 port = LOOPBACK_DEFAULT_PORT;
+  int duration = 0;
+  int interval = 5;
+  int server, client;
+  ssize_t received;
+  uint64_t now, last_report;
+  size_t report_frame = 0, report_latency = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:n:d:i:h")) != -1) {
+    switch (opt) {
+      case 'p': port = atoi(optarg); break;
+      case 'n': expected_pixel_bytes = 3 * atoi(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'i': interval = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind < argc || expected_pixel_bytes == 0 || interval <= 0) {
+    usage(argv[0]);
+  }
+
+  /* no SA_RESTART, so a signal interrupts accept and poll */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGALRM, &action, NULL);
+  if (duration > 0) {
+    alarm(duration);
+  }
+
+  server = listen_on(port);
+  if (server < 0) {
+    return 1;
+  }
+  last_report = now_ns();
+  while (!stopping) {
+    client = accept(server, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      return 1;
+    }
+    fprintf(stderr, "opc-loopback: client connected\n");
+    header_length = 0;
+    fds.fd = client;
+    fds.events = POLLIN;
+    while (!stopping) {
+      if (poll(&fds, 1, 1000) > 0) {
+        received = read(client, buffer, sizeof(buffer));
+        now = now_ns();
+        if (received <= 0) {
+          if (received < 0 && errno == EINTR) continue;
+          if (received < 0) perror("read");
+          break;
+        }
+        consume(buffer, received, now);
+      }
+      now = now_ns();
+      if (now - last_report >= interval * 1000000000ULL) {
+        report("last interval", report_frame, report_latency);
+        report_frame = arrivals.count;
+        report_latency = render_latency.count;
+        last_report = now;
+      }
+    }
+    /* whatever was in flight when the client went away is partial */
+    close_frame(now_ns());
+    close(client);
+    fprintf(stderr, "opc-loopback: client disconnected\n");
+    /* a reconnecting ortho starts numbering frames again */
+    have_last_number = 0;
+  }
+  summary();
+  return 0;
+}
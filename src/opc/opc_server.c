@@ -0,0 +1,340 @@
+/* Copyright 2013 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "opc.h"
+
+/* Internal structure for one connected client.  sock >= 0 iff connected. */
+/* Messages are parsed as bytes arrive: first the 4-byte header, then the */
+/* payload, which goes straight into the client's pixel buffer if it has */
+/* one and the source's otherwise.  The start of a system exclusive payload */
+/* is kept to recognize stream syncs. */
+typedef struct {
+  int sock;
+  u8 header[4];
+  u8 header_length;
+  u32 payload_length;
+  u32 payload_received;
+  pixel* pixels;
+  u32 pixel_count;
+  u8 sysex[OPC_STREAM_SYNC_LENGTH];
+} opc_client_state;
+
+/* Internal structure for a source.  listen_sock >= 0 iff listening. */
+typedef struct {
+  u16 port;
+  int listen_sock;
+  opc_client_state clients[OPC_MAX_CLIENTS];
+  pixel* pixels;
+  u32 pixel_count;
+  pixel* own_pixels;
+} opc_source_info;
+
+static opc_source_info opc_sources[OPC_MAX_SOURCES];
+static opc_source opc_next_source = 0;
+
+/* Payload bytes that don't land in the pixel buffer are read into here. */
+static u8 opc_discard[4096];
+
+static u8 opc_listen(opc_source_info* info) {
+  struct sockaddr_in address;
+  int sock;
+  int one = 1;
+
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    perror("OPC: socket");
+    return 0;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(info->port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(sock, (struct sockaddr*) &address, sizeof(address)) < 0 ||
+      listen(sock, OPC_MAX_CLIENTS) < 0) {
+    fprintf(stderr, "OPC: Could not listen on port %d: %s\n", info->port,
+            strerror(errno));
+    close(sock);
+    return 0;
+  }
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  fprintf(stderr, "OPC: Listening on port %d\n", info->port);
+  info->listen_sock = sock;
+  return 1;
+}
+
+opc_source opc_new_source(u16 port) {
+  opc_source_info* info;
+  int i;
+
+  /* Allocate an opc_source_info entry. */
+  if (opc_next_source >= OPC_MAX_SOURCES) {
+    fprintf(stderr, "OPC: No more sources available\n");
+    return -1;
+  }
+  info = &opc_sources[opc_next_source];
+  info->port = port ? port : OPC_DEFAULT_PORT;
+  info->listen_sock = -1;
+  for (i = 0; i < OPC_MAX_CLIENTS; i++) {
+    info->clients[i].sock = -1;
+    info->clients[i].pixels = NULL;
+  }
+  info->own_pixels = (pixel*) calloc(OPC_MAX_PIXELS_PER_MESSAGE, sizeof(pixel));
+  info->pixels = info->own_pixels;
+  info->pixel_count = OPC_MAX_PIXELS_PER_MESSAGE;
+  if (info->own_pixels == NULL || !opc_listen(info)) {
+    free(info->own_pixels);
+    return -1;
+  }
+
+  /* Increment opc_next_source only if we were successful. */
+  return opc_next_source++;
+}
+
+void opc_set_source_buffer(opc_source source, pixel* pixels, u32 count) {
+  opc_source_info* info = &opc_sources[source];
+
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return;
+  }
+  info->pixels = pixels;
+  info->pixel_count = count;
+}
+
+void opc_set_client_buffer(opc_source source, u8 client, pixel* pixels, u32 count) {
+  opc_source_info* info = &opc_sources[source];
+
+  if (source < 0 || source >= opc_next_source || client >= OPC_MAX_CLIENTS) {
+    fprintf(stderr, "OPC: Source %d client %d does not exist\n", source, client);
+    return;
+  }
+  info->clients[client].pixels = pixels;
+  info->clients[client].pixel_count = count;
+}
+
+static void opc_close_client(opc_source_info* info, opc_client_state* client) {
+  close(client->sock);
+  client->sock = -1;
+  fprintf(stderr, "OPC: Client disconnected from port %d\n", info->port);
+}
+
+static void opc_accept(opc_source_info* info, opc_client_handler* client_handler) {
+  int sock;
+  int i;
+
+  while ((sock = accept(info->listen_sock, NULL, NULL)) >= 0) {
+    for (i = 0; i < OPC_MAX_CLIENTS; i++) {
+      if (info->clients[i].sock < 0) break;
+    }
+    if (i == OPC_MAX_CLIENTS) {
+      fprintf(stderr, "OPC: Too many clients on port %d\n", info->port);
+      close(sock);
+      continue;
+    }
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    info->clients[i].sock = sock;
+    info->clients[i].header_length = 0;
+    fprintf(stderr, "OPC: Client connected to port %d\n", info->port);
+    if (client_handler) {
+      client_handler(i, OPC_EVENT_CONNECT, 0, 0, NULL);
+    }
+  }
+}
+
+/* Where the payload byte at 'offset' of the current message goes, and how */
+/* many bytes after it are contiguous there.  Pixels for channel c > 0 start */
+/* at (c - 1) * OPC_MAX_PIXELS_PER_MESSAGE, matching opc_make_channel_map; */
+/* channel 0 starts at the beginning. */
+static u8* opc_payload_target(opc_source_info* info, opc_client_state* client,
+                              u32 offset, u32* length) {
+  u32 remaining = client->payload_length - offset;
+  u32 first, position;
+  pixel* pixels = client->pixels ? client->pixels : info->pixels;
+  u32 pixel_count = client->pixels ? client->pixel_count : info->pixel_count;
+
+  if (client->header[1] == OPC_SET_PIXELS) {
+    first = client->header[0] > 0 ?
+        (client->header[0] - 1) * OPC_MAX_PIXELS_PER_MESSAGE * 3 : 0;
+    position = first + offset;
+    if (position < pixel_count * 3) {
+      *length = pixel_count * 3 - position;
+      if (*length > remaining) *length = remaining;
+      return (u8*) pixels + position;
+    }
+  } else if (client->header[1] == OPC_SYSTEM_EXCLUSIVE && offset < sizeof(client->sysex)) {
+    *length = sizeof(client->sysex) - offset;
+    if (*length > remaining) *length = remaining;
+    return client->sysex + offset;
+  }
+  *length = remaining < sizeof(opc_discard) ? remaining : sizeof(opc_discard);
+  return opc_discard;
+}
+
+/* Reads whatever a client has sent, calling the handlers for each complete */
+/* pixel message and stream sync.  Returns 0 if the client went away. */
+static u8 opc_read_client(opc_source_info* info, u8 index, opc_handler* handler,
+                          opc_client_handler* client_handler) {
+  opc_client_state* client = &info->clients[index];
+  ssize_t received;
+  u32 length;
+  u8* target;
+  u32 first, count;
+  pixel* pixels = client->pixels ? client->pixels : info->pixels;
+  u32 pixel_count = client->pixels ? client->pixel_count : info->pixel_count;
+
+  while (1) {
+    if (client->header_length < 4) {
+      received = recv(client->sock, client->header + client->header_length,
+                      4 - client->header_length, 0);
+      if (received <= 0) break;
+      client->header_length += received;
+      if (client->header_length < 4) continue;
+      client->payload_length = client->header[2] << 8 | client->header[3];
+      client->payload_received = 0;
+    } else {
+      target = opc_payload_target(info, client, client->payload_received, &length);
+      received = recv(client->sock, target, length, 0);
+      if (received <= 0) break;
+      client->payload_received += received;
+    }
+
+    if (client->payload_received == client->payload_length) {
+      if (client->header[1] == OPC_SET_PIXELS) {
+        first = client->header[0] > 0 ?
+            (client->header[0] - 1) * OPC_MAX_PIXELS_PER_MESSAGE : 0;
+        count = first < pixel_count ? pixel_count - first : 0;
+        if (count > client->payload_length / 3) count = client->payload_length / 3;
+        if (handler) {
+          handler(client->header[0], count, pixels + first);
+        }
+        if (client_handler) {
+          client_handler(index, OPC_EVENT_PIXELS, client->header[0], count, pixels + first);
+        }
+      } else if (client->header[1] == OPC_SYSTEM_EXCLUSIVE && client_handler &&
+                 client->payload_length == OPC_STREAM_SYNC_LENGTH &&
+                 memcmp(client->sysex, OPC_STREAM_SYNC_DATA, OPC_STREAM_SYNC_LENGTH) == 0) {
+        client_handler(index, OPC_EVENT_SYNC, client->header[0], 0, NULL);
+      }
+      client->header_length = 0;
+    }
+  }
+  if (received == 0) {
+    return 0;
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    perror("OPC: Error receiving data");
+    return 0;
+  }
+  return 1;
+}
+
+static u8 opc_receive_any(opc_source source, opc_handler* handler,
+                          opc_client_handler* client_handler, u32 timeout_ms) {
+  opc_source_info* info = &opc_sources[source];
+  struct pollfd fds[OPC_MAX_CLIENTS + 1];
+  int client_index[OPC_MAX_CLIENTS + 1];
+  int nfds = 0;
+  int i;
+
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return 0;
+  }
+  if (info->listen_sock < 0 && !opc_listen(info)) {
+    return 0;
+  }
+
+  fds[nfds].fd = info->listen_sock;
+  fds[nfds].events = POLLIN;
+  client_index[nfds++] = -1;
+  for (i = 0; i < OPC_MAX_CLIENTS; i++) {
+    if (info->clients[i].sock >= 0) {
+      fds[nfds].fd = info->clients[i].sock;
+      fds[nfds].events = POLLIN;
+      client_index[nfds++] = i;
+    }
+  }
+  if (poll(fds, nfds, timeout_ms) <= 0) {
+    return 0;
+  }
+
+  for (i = 0; i < nfds; i++) {
+    if (!fds[i].revents) continue;
+    if (client_index[i] < 0) {
+      opc_accept(info, client_handler);
+    } else if (!opc_read_client(info, client_index[i], handler, client_handler)) {
+      opc_close_client(info, &info->clients[client_index[i]]);
+    }
+  }
+  return 1;
+}
+
+u8 opc_receive(opc_source source, opc_handler* handler, u32 timeout_ms) {
+  return opc_receive_any(source, handler, NULL, timeout_ms);
+}
+
+u8 opc_receive_clients(opc_source source, opc_client_handler* handler,
+                       u32 timeout_ms) {
+  return opc_receive_any(source, NULL, handler, timeout_ms);
+}
+
+u8 opc_client_receiving(opc_source source, u8 client) {
+  if (source < 0 || source >= opc_next_source || client >= OPC_MAX_CLIENTS) {
+    return 0;
+  }
+  return opc_sources[source].clients[client].sock >= 0 &&
+      opc_sources[source].clients[client].header_length > 0;
+}
+
+int opc_source_fds(opc_source source, int* fds, int max) {
+  opc_source_info* info = &opc_sources[source];
+  int count = 0;
+  int i;
+
+  if (source < 0 || source >= opc_next_source) {
+    return 0;
+  }
+  if (info->listen_sock >= 0 && count < max) {
+    fds[count++] = info->listen_sock;
+  }
+  for (i = 0; i < OPC_MAX_CLIENTS && count < max; i++) {
+    if (info->clients[i].sock >= 0) {
+      fds[count++] = info->clients[i].sock;
+    }
+  }
+  return count;
+}
+
+void opc_reset_source(opc_source source) {
+  opc_source_info* info = &opc_sources[source];
+  int i;
+
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return;
+  }
+  for (i = 0; i < OPC_MAX_CLIENTS; i++) {
+    if (info->clients[i].sock >= 0) {
+      opc_close_client(info, &info->clients[i]);
+    }
+  }
+}
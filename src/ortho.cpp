@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <getopt.h>
 #if RASPBERRY_PI
 #include <wiringPi.h>
 #endif
@@ -11,14 +12,52 @@
 #include "ortho.h"
 
 #include <algorithm>
+#include <thread>
 #include "util.h"
 #include "PatternManager.h"
 #include "HomeBridgeListener.h"
+#include "EventLoop.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "QualityGovernor.h"
+#include "OutputStage.h"
+#include "ButtonInput.h"
+#include "Realtime.h"
 
 #define SERIAL_LOGGING 0
 #define UNCONNECTED_PIN 14
 
 opc_sink sink;
+#if RASPBERRY_PI
+const char *sinkSpec = "127.0.0.1:7890";
+#else
+const char *sinkSpec = "10.0.0.100:7890";
+#endif
+#define MAX_CHANNEL_SPANS ((NUM_LEDS + OPC_MAX_PIXELS_PER_MESSAGE - 1) / OPC_MAX_PIXELS_PER_MESSAGE)
+opc_span channelMap[MAX_CHANNEL_SPANS];
+u8 channelSpans = 0;
+
+// The whole frame as it goes out over the wire, headers included, so sending is one write.
+// The output stage writes the final pixels straight into it. Room is left in front for a
+// timestamp message, sent along with the frame when --opc-timestamps is on.
+u8 opcMessages[OPC_TIMESTAMP_LENGTH + 4 * (MAX_CHANNEL_SPANS + 1) + 3 * NUM_LEDS + OPC_STREAM_SYNC_LENGTH];
+u8 *const opcFrame = opcMessages + OPC_TIMESTAMP_LENGTH;
+size_t frameBytes = 0;
+
+// for measuring latency with bin/opc-loopback
+bool opcTimestamps = false;
+u32 frameNumber = 0;
+uint64_t frameStartNanos = 0;
+
+// brightness, color correction and power limiting
+OutputStage<NUM_LEDS> outputStage;
+
+// pixels streamed in over OPC, with --opc-listen
+OPCLayer<DrawingContext> opcLayer;
+
+// patterns that run for good over the rotation, with --layer
+LayerSpec layers[4];
+int layerCount = 0;
 
 DrawingContext ctx;
 PatternManager<DrawingContext> patternManager(ctx);
@@ -27,30 +66,52 @@ unsigned long lastTrigger = 0;
 FrameCounter fc;
 HomeBridgeListener *hbl;
 
+EventLoop eventLoop;
+FrameTimer frameTimer;
+SignalWatcher *signalWatcher;
+
 int first_pattern = -1;
-long lastFrame = 0;
 const int fps_cap = 60;
+const long frameIntervalNanos = 1000000000L / fps_cap;
+QualityGovernor governor(frameIntervalNanos);
+
+// OPC socket is only written once epoll reports room for the previous frame to have drained
+int opcFd = -1;
+bool opcWritable = true;
+bool opcPollable = false; // a file sink can't be polled, so it's always writable
+// Connecting happens in the background: a connect in progress is watched for EPOLLOUT and
+// failed ones are retried off a timer, so fcserver being down never stalls the loop.
+int opcConnectingFd = -1;
+OneShotTimer opcRetryTimer;
+const uint64_t opcRetryNanos = 2000 * 1000000ULL;
+
+// how much history SIGUSR1 writes out
+const int traceDumpSeconds = 10;
+
+int shutdownSignal = 0;
+long shutdownStartMillis = 0;
 
 #if RASPBERRY_PI
-const int modeButtonPin = 18;
+// the mode button, pulled down, on BCM 18
+const char *buttonSpec = "gpio:/dev/gpiochip0:18";
+#else
+const char *buttonSpec = NULL;
 #endif
+ButtonInput modeButton;
 bool displayOn = true;
 
 bool allPixelsOff() {
-  for (int i = 0; i < NUM_LEDS; ++i) {
-    if (ctx.leds[i].r != 0 || ctx.leds[i].g != 0 || ctx.leds[i].b != 0) {
-      return false;
-    }
-  }
-  return true;
+  return ctx.allBlack();
 }
 
 void setup() {
-#if RASPBERRY_PI
-  sink = opc_new_sink((char *)"127.0.0.1:7890");
-#else
-  sink = opc_new_sink((char *)"10.0.0.100:7890");
-#endif
+  sink = opc_new_sink_spec((char *)sinkSpec);
+  if (sink < 0) {
+    exit(EXIT_FAILURE);
+  }
+  channelSpans = opc_make_channel_map(NUM_LEDS, 0, channelMap, ARRAY_SIZE(channelMap));
+  frameBytes = opc_frame_length(channelMap, channelSpans);
+  opc_layout_frame(channelMap, channelSpans, opcFrame);
   // printf("sizeof(short) = %lu\n", sizeof(short));
   // printf("sizeof(int) = %lu\n", sizeof(int));
   // printf("sizeof(long) = %lu\n", sizeof(long));
@@ -70,122 +131,404 @@ void setup() {
 
 #if RASPBERRY_PI
   wiringPiSetupGpio();
-  pinMode(modeButtonPin, INPUT);
-  pullUpDnControl(modeButtonPin, PUD_DOWN); // pull pin down when button is not pressed
-  printf("Initialized mode pin\n");
 #endif
 
+  patternManager.enableBackgroundPreparation();
   patternManager.setup();
+  for (int i = 0; i < layerCount; ++i) {
+    if (patternManager.addPatternLayer(layers[i].patternIndex, layers[i].blendMode, layers[i].opacity) < 0) {
+      logf("Couldn't add pattern %i as a layer", layers[i].patternIndex);
+    }
+  }
+  metrics.displayOn.set(displayOn);
 
   fc.tick();
 }
 
+void updateFrameTimer();
+
 void setDisplayOn(bool on) {
   if (on) {
     patternManager.nextPattern();
   } else {
-    printf("Turning off...\n");
+    logf("Turning off...");
     patternManager.stopPattern();
   }
   displayOn = on;
+  hbl->publishStatus(displayOn);
+  metrics.displayOn.set(displayOn);
+  updateFrameTimer();
 }
 
-void checkButtons() {
-#if RASPBERRY_PI
-  static long powerDownInterval = 2000;
-  static bool modeButtonPressed = false;
-  static long modeButtonPressedMillis = -1;
+// A short press turns the display on, or moves to the next pattern if it's already on;
+// holding the button turns it off.
+void handleButton(ButtonAction action) {
+  if (action == buttonShortPress) {
+    setDisplayOn(true);
+  } else if (displayOn) {
+    setDisplayOn(false);
+  }
+}
 
-  bool oldModeButtonPressed = modeButtonPressed;
-  modeButtonPressed = (digitalRead(modeButtonPin) == HIGH);
+// Dark and not fading out; nothing to render until something turns the display back on.
+bool isIdle() {
+  return !displayOn && shutdownSignal == 0 && allPixelsOff();
+}
 
-  if (modeButtonPressed && !oldModeButtonPressed) {
-    printf("Mode button press down\n");
-    modeButtonPressedMillis = millis();
-  }
-  if (!modeButtonPressed && oldModeButtonPressed 
-    && millis() - modeButtonPressedMillis < powerDownInterval) { // don't turn back on if we just turned off
-    printf("Mode button press up\n");
-    patternManager.nextPattern();
-    displayOn = true;
-  }
-  if (displayOn && modeButtonPressed && millis() - modeButtonPressedMillis > powerDownInterval) {
-    setDisplayOn(false);
+void updateFrameTimer() {
+  if (isIdle()) {
+    frameTimer.stop();
+  } else {
+    frameTimer.start(governor.frameIntervalNanos());
   }
-#endif
 }
 
-void loop() {
-  checkButtons();
+void outputWritable();
 
-  if (!displayOn) {
-    if (allPixelsOff()) {
-      sleep(3);
+void watchOutput(int fd) {
+  if (fd != opcFd) {
+    if (opcFd >= 0 && opcPollable) {
+      eventLoop.unwatch(opcFd);
     }
-    fadeDownBy(0.1, ctx);
+    opcFd = fd;
+    if (opcFd >= 0) {
+      metrics.reconnects.inc();
+      opcPollable = eventLoop.watch(opcFd, EPOLLOUT | EPOLLONESHOT, [](uint32_t events) {
+        outputWritable();
+      });
+    }
+  } else if (opcFd >= 0 && opcPollable) {
+    eventLoop.modify(opcFd, EPOLLOUT | EPOLLONESHOT);
+  }
+  opcWritable = (opcFd < 0 || !opcPollable);
+}
+
+void retryOutput() {
+  logRateLimited(10000, logLevelWarn, "opc_put_frame_buffer failed");
+  watchOutput(-1);
+  opcRetryTimer.startAt(monotonicNanos() + opcRetryNanos);
+}
+
+// There's room again: finish any frame that only partly went out before letting the next go.
+void outputWritable() {
+  s8 flushed = opc_flush(sink);
+  if (flushed > 0) {
+    opcWritable = true;
+  } else if (flushed == 0) {
+    eventLoop.modify(opcFd, EPOLLOUT | EPOLLONESHOT);
   } else {
-    patternManager.loop();
+    retryOutput();
   }
+}
 
-  if (0 == opc_put_pixels(sink, 0, NUM_LEDS, (pixel*)ctx.leds)) {
+void connectOutput() {
+  int fd;
+  s8 result = opc_connect_nonblocking(sink, &fd);
+  if (result > 0) {
+    watchOutput(opc_sink_fd(sink));
+  } else if (result < 0) {
+    opcConnectingFd = fd;
+    eventLoop.watch(fd, EPOLLOUT | EPOLLONESHOT, [](uint32_t events) {
+      eventLoop.unwatch(opcConnectingFd);
+      opcConnectingFd = -1;
+      connectOutput();
+    });
+  } else {
     // Failed to connect to fadecandy, don't spam it
-    printf("opc_put_pixels failed");
-    sleep(2);
+    logRateLimited(10000, logLevelWarn, "Couldn't connect to the OPC sink, retrying");
+    opcRetryTimer.startAt(monotonicNanos() + opcRetryNanos);
   }
+}
 
-  RemoteCommand command = hbl->poll(displayOn);
-  if (command != none) {
-    setDisplayOn(command == on);
+void sendFrame() {
+  if (!opc_sink_connected(sink)) {
+    // a connect is in hand
+    return;
+  }
+  if (!opcWritable) {
+    // fcserver hasn't drained the last frame yet; drop this one rather than block
+    metrics.backpressureFrames.inc();
+    return;
+  }
+  {
+    TRACE_SCOPE("outputStage");
+    outputStage.process(ctx.leds, opcFrame, channelMap, channelSpans);
+  }
+  u8 *message = opcFrame;
+  size_t messageBytes = frameBytes;
+  if (opcTimestamps) {
+    u32 hash = OPC_HASH_INIT;
+    for (u8 span = 0; span < channelSpans; ++span) {
+      hash = opc_hash(hash, (u8 *)opc_frame_pixels(opcFrame, channelMap, span), 3 * channelMap[span].count);
+    }
+    opc_fill_timestamp(opcMessages, frameNumber, frameStartNanos, monotonicNanos(), hash);
+    message = opcMessages;
+    messageBytes += OPC_TIMESTAMP_LENGTH;
   }
+  u8 sent;
+  {
+    TRACE_SCOPE("opc_put_frame_buffer");
+    ScopedTimer timer(&metrics.opcSendTime);
+    sent = opc_put_frame_buffer(sink, message, messageBytes);
+  }
+  if (0 == sent && opc_sink_fd(sink) >= 0) {
+    // still connected, so the socket was full and nothing went out; wait for room
+    metrics.backpressureFrames.inc();
+    watchOutput(opc_sink_fd(sink));
+    return;
+  }
+  if (0 == sent) {
+    retryOutput();
+    return;
+  }
+  metrics.bytesSent.inc(messageBytes);
+  watchOutput(opc_sink_fd(sink));
+}
 
-  long frameTime = millis() - lastFrame;
-  if (frameTime < 1000./fps_cap) {
-    usleep((1000./fps_cap - frameTime) * 1000);
+void loop() {
+  if (isIdle()) {
+    return;
   }
-  lastFrame = millis();
+  TRACE_SCOPE("frame");
+  frameStartNanos = monotonicNanos();
+  ++frameNumber;
 
+  if (!displayOn) {
+    fadeDownBy(0.1, ctx);
+  } else {
+    patternManager.loop();
+  }
+
+  sendFrame();
   fc.tick();
-}
 
-void we_get_signal(int signum)
-{
-  printf("Caught sig %i!\n", signum);
-  setDisplayOn(false);
-  long start = millis();
-  while (1) {
-    loop();
+  uint64_t frameNanos = monotonicNanos() - frameStartNanos;
+  metrics.frameTime.observe(frameNanos);
+  metrics.frames.inc();
+  if (frameNanos > governor.frameIntervalNanos()) {
+    metrics.lateFrames.inc();
+  }
+  if (governor.recordFrame(frameNanos, millis())) {
+    logf("Quality governor: level %i (%s), average frame %.2f ms", governor.currentLevel(),
+           governor.description(), governor.averageFrameNanos() / 1e6);
+    patternManager.setShortCrossfade(governor.shortCrossfade());
+    patternManager.setPatternQuality(governor.patternQuality());
+    metrics.qualityLevel.set(governor.currentLevel());
+  }
+  metrics.averageFrameTime.set(governor.averageFrameNanos() / 1e9);
+
+  if (shutdownSignal != 0) {
     if (allPixelsOff()) {
-      printf("Turned off.\n");
-      break;
-    }
-    if (millis() - start > 1000) {
-      printf("Timed out.\n");
-      break;
+      logf("Turned off.");
+      eventLoop.stop();
+    } else if (millis() - shutdownStartMillis > 1000) {
+      logf("Timed out.");
+      eventLoop.stop();
     }
   }
-  exit(signum);
+  updateFrameTimer();
 }
 
-void handle_signals() {
-    struct sigaction termaction;
-    memset(&termaction, 0, sizeof(termaction));
-    termaction.sa_handler = we_get_signal;
-    sigaction(SIGTERM, &termaction, NULL);
+void handleSignal(int signum) {
+  if (signum == SIGUSR1) {
+    // formatting the dump takes a while, keep it off the render thread
+    std::thread([]() {
+      realtime.enterBackgroundThread();
+      std::string path = traceDumpToFile(traceDumpSeconds * 1000000000ULL);
+      logf("Wrote trace to %s", path.c_str());
+    }).detach();
+    return;
+  }
+  logf("Caught sig %i!", signum);
+  if (shutdownSignal != 0) {
+    // second signal while fading out, give up on the fade
+    eventLoop.stop();
+    return;
+  }
+  shutdownSignal = signum;
+  shutdownStartMillis = millis();
+  setDisplayOn(false);
+}
 
-    struct sigaction intaction;
-    memset(&intaction, 0, sizeof(intaction));
-    intaction.sa_handler = we_get_signal;
-    sigaction(SIGINT, &intaction, NULL);
+void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [--log-file PATH] [--sink HOST:PORT|unix:PATH|shm:NAME] [--brightness PERCENT] [--power-budget MILLIAMPS]\n"
+          "       [--color-correction GAMMA[:WHITEPOINT]] [--opc-timestamps] [--opc-listen PORT [--opc-layer over|under|brighten|darken]]\n"
+          "       [--layer INDEX[:over|brighten|darken[:OPACITY_PERCENT]]]... [--audio alsa:DEVICE|wav:PATH|raw:PATH[@RATE]]\n"
+          "       [--button gpio:CHIP:LINE|fifo:PATH] [--realtime[=PRIORITY] [--render-cpu CPU]] [first_pattern]\n", argv0);
+  exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
-  if (argc == 2) {
-    first_pattern = atoi(argv[1]);
+  const char *logPath = NULL;
+  int brightnessPercent = 100;
+  long powerBudget = 0; // --power-budget opts in to the limiter
+  // fcserver corrects color itself; sinks that don't can have it done here instead
+  float colorGamma = 0;
+  float whitepoint = 1;
+  int opcListenPort = 0;
+  BlendMode opcBlendMode = blendBrighten;
+  bool opcAbovePatterns = true;
+  const char *audioSpec = NULL;
+  bool realtimeMode = false;
+  int realtimePriority = 0;
+  int renderCpu = -1;
+  static struct option options[] = {
+    {"log-file", required_argument, NULL, 'l'},
+    {"sink", required_argument, NULL, 's'},
+    {"brightness", required_argument, NULL, 'b'},
+    {"power-budget", required_argument, NULL, 'p'},
+    {"color-correction", required_argument, NULL, 'g'},
+    {"opc-listen", required_argument, NULL, 'o'},
+    {"opc-layer", required_argument, NULL, 'L'},
+    {"opc-timestamps", no_argument, NULL, 't'},
+    {"layer", required_argument, NULL, 'y'},
+    {"audio", required_argument, NULL, 'a'},
+    {"button", required_argument, NULL, 'B'},
+    {"realtime", optional_argument, NULL, 'R'},
+    {"render-cpu", required_argument, NULL, 'C'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "l:s:b:p:g:o:L:ty:a:B:R::C:h", options, NULL)) != -1) {
+    switch (opt) {
+      case 'l':
+        logPath = optarg;
+        break;
+      case 's':
+        sinkSpec = optarg;
+        break;
+      case 'b':
+        brightnessPercent = atoi(optarg);
+        break;
+      case 'p':
+        powerBudget = atol(optarg);
+        break;
+      case 'g':
+        if (sscanf(optarg, "%f:%f", &colorGamma, &whitepoint) < 1 || colorGamma <= 0 || whitepoint <= 0 || whitepoint > 1) {
+          usage(argv[0]);
+        }
+        break;
+      case 'o':
+        opcListenPort = atoi(optarg);
+        break;
+      case 'L':
+        if (strcmp(optarg, "under") == 0) {
+          opcAbovePatterns = false;
+        } else if (!parseBlendMode(optarg, &opcBlendMode)) {
+          usage(argv[0]);
+        }
+        break;
+      case 'y':
+        if (layerCount == ARRAY_SIZE(layers) || !layers[layerCount++].parse(optarg)) {
+          usage(argv[0]);
+        }
+        break;
+      case 't':
+        opcTimestamps = true;
+        break;
+      case 'a':
+        audioSpec = optarg;
+        break;
+      case 'B':
+        buttonSpec = optarg;
+        break;
+      case 'R':
+        realtimeMode = true;
+        if (optarg) {
+          realtimePriority = atoi(optarg);
+          if (realtimePriority < sched_get_priority_min(SCHED_FIFO) || realtimePriority > sched_get_priority_max(SCHED_FIFO)) {
+            usage(argv[0]);
+          }
+        }
+        break;
+      case 'C':
+        renderCpu = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind < argc) {
+    first_pattern = atoi(argv[optind]);
+  }
+  if (brightnessPercent < 0 || brightnessPercent > 100 || powerBudget < 0) {
+    usage(argv[0]);
+  }
+  outputStage.setBrightness(brightnessPercent * 0xFF / 100);
+  outputStage.setPowerBudget(powerBudget);
+  if (colorGamma > 0) {
+    const float white[3] = {whitepoint, whitepoint, whitepoint};
+    outputStage.setColorCorrection(colorGamma, white);
+  }
+  if (opcListenPort > 0) {
+    if (!opcLayer.listen(opcListenPort)) {
+      exit(EXIT_FAILURE);
+    }
+    patternManager.addExternalLayer(&opcLayer, opcBlendMode, opcAbovePatterns);
+    opcLayer.watch(eventLoop);
+  }
+
+  // block the shutdown signals before any thread starts so they all inherit the mask
+  signalWatcher = new SignalWatcher({SIGTERM, SIGINT, SIGUSR1});
+
+  FILE *logFile = stdout;
+  if (logPath && (logFile = fopen(logPath, "a")) == NULL) {
+    perror(logPath);
+    exit(EXIT_FAILURE);
+  }
+  if (realtimeMode) {
+    // before the logger starts, so it and every other helper thread stays off the render CPU;
+    // anything this reports waits in the log ring until then
+    realtime.start(realtimePriority, renderCpu);
   }
-  handle_signals();
+  logger.start(logFile);
+  if (audioSpec && !audioAnalyzer.start(audioSpec)) {
+    logger.stop();
+    exit(EXIT_FAILURE);
+  }
+  TRACE_THREAD_NAME("render");
   setup();
-  while (1) {
-    loop();
+  hbl->start();
+
+  eventLoop.watch(frameTimer.fd(), EPOLLIN, [](uint32_t events) {
+    uint64_t ticks = frameTimer.expirations();
+    if (ticks > 0) {
+      metrics.frameLateness.observe(frameTimer.lateness(monotonicNanos()));
+      if (ticks > 1 && displayOn) {
+        metrics.droppedFrames.inc(ticks - 1);
+      }
+      loop();
+    }
+  });
+  eventLoop.watch(hbl->commandFd(), EPOLLIN, [](uint32_t events) {
+    TRACE_SCOPE("remote command");
+    hbl->clearCommandFd();
+    RemoteCommand command;
+    while (hbl->commands.pop(command)) {
+      setDisplayOn(command == on);
+    }
+  });
+  eventLoop.watch(opcRetryTimer.fd(), EPOLLIN, [](uint32_t events) {
+    if (opcRetryTimer.fired()) {
+      connectOutput();
+    }
+  });
+  connectOutput();
+  if (buttonSpec && !modeButton.start(buttonSpec, eventLoop, handleButton)) {
+    logf("Mode button unavailable, carrying on without it");
   }
-}
+  eventLoop.watch(signalWatcher->fd(), EPOLLIN, [](uint32_t events) {
+    int signum;
+    while ((signum = signalWatcher->next()) != 0) {
+      handleSignal(signum);
+    }
+  });
+  updateFrameTimer();
 
+  realtime.enterRenderThread();
+  eventLoop.run();
+  audioAnalyzer.stop();
+  logger.stop();
+  return shutdownSignal;
+}
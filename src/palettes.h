@@ -1,5 +1,6 @@
 #include <vector>
 #include "util.h"
+#include "Metrics.h"
 
 #define DEFINE_GRADIENT_PALETTE(X) \
 const uint8_t X[] = 
@@ -675,6 +676,7 @@ public:
     } while (belowMinBrightness && tries++ < 10);
     assert(tries < 10, "Tried too many times to pick a palette below threshold");
     logf("Picked Palette %u", choice);
+    metrics.paletteIndex.set(choice);
     return palette;
   }
 };
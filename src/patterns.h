@@ -3,24 +3,38 @@
 
 #include <unistd.h>
 #include <math.h>
-#include <list>
-#include <vector>
-#include <random>
 #include <algorithm>
-#include <unordered_set>
 
 #include "ortho.h"
 #include "util.h"
 #include "palettes.h"
+#include "QualityGovernor.h"
+#include "AudioAnalyzer.h"
 
 class Pattern {
 private:  
   long startTime = -1;
   long stopTime = -1;
   long lastUpdateTime = -1;
+  bool prepared = false;
+  long lastStepMillis = -1;
+  long stepBacklog = 0; // in thousandths of a step
+
+  // after a stall, drop the backlog rather than spend the next frame catching up
+  static const int maxStepsPerUpdate = 10;
+protected:
+  PatternQuality quality = qualityFull;
 public:
   DrawingContext ctx;
   int expectedRunDuration = 40;
+  // Slow patterns can set how often they need updating, and the frames in between are
+  // interpolated; 0 updates every frame.
+  int preferredFrameRate = 0;
+  // Patterns that move things along or fade from one frame to the next do it in step(),
+  // stepRate times a second however often frames are drawn, so they look the same at any
+  // frame rate and replay exactly under a virtual clock; update() then only has to draw.
+  // 0 for patterns that draw straight from the clock.
+  int stepRate = 0;
   Pattern() { }
   Pattern(int expectedDuration) : expectedRunDuration(expectedDuration) { }
   virtual ~Pattern() { }
@@ -29,11 +43,51 @@ public:
     logf("Starting %s", description());
     startTime = millis();
     stopTime = -1;
+    lastStepMillis = -1;
+    if (!prepared) {
+      setup();
+    }
+    prepared = false;
+  }
+
+  // Does the setup ahead of start(), off the render thread.
+  void prepare() {
     setup();
+    prepared = true;
   }
 
   void loop() {
+    for (int steps = stepsDue(); steps > 0; --steps) {
+      step(stepInterval());
+    }
     update();
+    didUpdate();
+  }
+
+  // How many steps to run before this frame's update(), for the time since the last frame.
+  int stepsDue() {
+    if (stepRate == 0) {
+      return 0;
+    }
+    long now = millis();
+    if (lastStepMillis == -1) {
+      // one step to start with, and half a step in hand so millisecond jitter in the frame
+      // times doesn't make frames alternate between no steps and two
+      lastStepMillis = now;
+      stepBacklog = 1500;
+    }
+    stepBacklog += (now - lastStepMillis) * stepRate;
+    lastStepMillis = now;
+    int steps = stepBacklog / 1000;
+    stepBacklog -= steps * 1000;
+    return std::min(steps, maxStepsPerUpdate);
+  }
+
+  float stepInterval() {
+    return 1.f / stepRate;
+  }
+
+  void didUpdate() {
     lastUpdateTime = millis();
   }
 
@@ -41,6 +95,9 @@ public:
     return true;
   }
 
+  // The constructor, wantsToRun() and setup() may run on the prepare thread while the render
+  // thread draws, so they mustn't touch state the render thread writes without locking; the
+  // RNG and logf are safe, single-writer metrics aren't.
   virtual bool wantsToRun() {
     // for idle patterns that require microphone input and may opt not to run if there is no sound
     return true;
@@ -53,6 +110,8 @@ public:
     startTime = -1;
   }
 
+  virtual void step(float dt) { }
+
   virtual void update() { }
   
   virtual const char *description() = 0;
@@ -71,13 +130,23 @@ public:
   }
 
   virtual void colorModeChanged() { }
+
+  void setQuality(PatternQuality newQuality) {
+    if (newQuality != quality) {
+      quality = newQuality;
+      qualityChanged();
+    }
+  }
+
+  // The frame budget is tight; patterns that have a cheaper way to render should switch to it.
+  virtual void qualityChanged() { }
 };
 
 
 /* --------------------------- */
 
 // FIXME: add auto-palette-rotation
-class Needles : public Pattern {
+class Needles final : public Pattern {
   static const int needleLength = STICK_LENGTH;
 
   class Needle {
@@ -90,6 +159,7 @@ class Needles : public Pattern {
     CRGB color;
     int rangeMin;
     int rangeMax;
+    Needle() { }
     Needle(int index, int min, int max) {
       stickIndex = index;
       rangeMin = min;
@@ -113,10 +183,15 @@ class Needles : public Pattern {
     }
   };
 
+  static const int needleCount = NUM_LEDS / needleLength;
+
   int leader;
-  std::list<Needle *> activeNeedles;
-  std::unordered_set<Needle *> inactiveNeedles;
-  long lastStartMillis = 0;
+  // Needles live in place; the active and inactive sets are index lists into the array
+  Needle needles[needleCount];
+  int activeNeedles[needleCount];
+  int activeCount = 0;
+  int inactiveNeedles[needleCount];
+  int inactiveCount = 0;
   int mode;
   int colorMode;
   Palette *palette;
@@ -124,73 +199,55 @@ public:
   Needles() {
     mode = random8(2);
     colorMode = random8(4);
-    printf("  mode = %i, colorMode %i\n", mode, colorMode);
+    logf("  mode = %i, colorMode %i", mode, colorMode);
     palette = paletteManager.randomPalette();
-    lastStartMillis = millis();
+    // the needles move a pixel a step
+    stepRate = 60;
 
-    for (int i = 0; i < NUM_LEDS / needleLength; ++i) {
-      Needle *needle = new Needle(
+    for (int i = 0; i < needleCount; ++i) {
+      needles[i] = Needle(
         i,
         (mode == 0 ? 0            : -needleLength/2), 
         (mode == 0 ? needleLength : 3 * needleLength/2) - 1);
 
-      inactiveNeedles.insert(needle);
+      inactiveNeedles[inactiveCount++] = i;
     }
   }
-  ~Needles() {
-    activeNeedles.clear();
-    inactiveNeedles.clear();
-  }
 
   Needle *getActiveNeedle() {
-    std::vector<Needle *> sampled;
-    size_t nelems = 1;
-    std::sample(
-        inactiveNeedles.begin(),
-        inactiveNeedles.end(),
-        std::back_inserter(sampled),
-        1,
-        std::mt19937{std::random_device{}()}
-    );
-    Needle *needle = NULL;
-    if (sampled.size() > 0) {
-      needle = sampled[0];
-      needle->reset();
-      activeNeedles.push_back(needle);
-      inactiveNeedles.erase(needle);
+    if (inactiveCount == 0) {
+      return NULL;
     }
+    int pick = random() % inactiveCount;
+    int index = inactiveNeedles[pick];
+    inactiveNeedles[pick] = inactiveNeedles[--inactiveCount];
+    activeNeedles[activeCount++] = index;
+
+    Needle *needle = &needles[index];
+    needle->reset();
     return needle;
   }
 
-  void update() {
-    long mils = millis();
-
+  // The trails are drawn as the needles move, so all of it happens here.
+  void step(float dt) {
     if (mode == 0) {
-      fadeDownBy(0.02, ctx);
+      fadeDownBy(fadePerStep(0.7, dt), ctx);
     }
 
-    const float stickStartInterval = 10;
-    
-    long elapsed = mils - lastStartMillis;
-    while (elapsed > stickStartInterval) {
-      elapsed -= stickStartInterval;
-      lastStartMillis = mils;
-      
-      Needle *needle = getActiveNeedle();
-      if (!needle) continue;
-
+    // a new needle every step
+    Needle *started = getActiveNeedle();
+    if (started) {
       if (colorMode == 0) { // rainbow
-        int hue = leader % 0x100;
-        needle->color = CRGB::HSB(leader % 0x100, 0xFF, 0xFF);
+        started->color = CRGB::HSB(leader % 0x100, 0xFF, 0xFF);
       } else {  // palette
-        needle->color = palette->getRandom();
+        started->color = palette->getRandom();
       }
-      needle->speed = (mode == 0 ? 1 : 0.2);
+      started->speed = (mode == 0 ? 1 : 0.2);
     }
     
     bool hasActiveNeedles = false;
-    for (auto it = activeNeedles.begin(); it != activeNeedles.end();) {
-      Needle *needle = *it;
+    for (int a = 0; a < activeCount;) {
+      Needle *needle = &needles[activeNeedles[a]];
       if (needle->active) {
         hasActiveNeedles = true;
 
@@ -200,6 +257,7 @@ public:
         
         if (mode == 0) {
           ctx.leds[index] = color;
+          ctx.touch(index);
         } else {
           for (int j = 0; j < needleLength; ++j) {
             float bright = 0;
@@ -215,14 +273,15 @@ public:
             c.g = color.g * bright;
             c.b = color.b * bright;
             ctx.leds[needle->stickIndex * needleLength + j] = c;
+            ctx.touch(needle->stickIndex * needleLength + j);
           }
         }
         needle->tick();
 
-        ++it;
+        ++a;
       } else {
-        inactiveNeedles.insert(*it);
-        it = activeNeedles.erase(it);
+        inactiveNeedles[inactiveCount++] = activeNeedles[a];
+        activeNeedles[a] = activeNeedles[--activeCount];
       }
     }
 
@@ -236,7 +295,7 @@ public:
 
 /* -------------------- */
 
-class Bits : public Pattern {
+class Bits final : public Pattern {
     enum BitColor {
       monotone, fromPalette, mix, white, pink
     };
@@ -267,22 +326,24 @@ class Bits : public Pattern {
         bool alive;
         unsigned long lastTick;
         CRGB color;
-        Bit(CRGB color) : color(CRGB::Black) {
-          reset(color);
+        Bit() { }
+        Bit(CRGB color, unsigned long now) : color(CRGB::Black) {
+          reset(color, now);
         }
-        void reset(CRGB color) {
-          birthdate = millis();
+        void reset(CRGB color, unsigned long now) {
+          birthdate = now;
+          lastTick = now;
           alive = true;
           pos = random() % NUM_LEDS;
           direction = random() % 2 == 0 ? 1 : -1;
           this->color = color;
         }
-        unsigned int age() {
-          return millis() - birthdate;
+        unsigned int age(unsigned long now) {
+          return now - birthdate;
         }
-        float ageBrightness() {
+        float ageBrightness(unsigned long now) {
           // FIXME: assumes 3000ms lifespan
-          float theAge = age();
+          float theAge = age(now);
           if (theAge < 500) {
             return theAge / 500.;
           } else if (theAge > 2500) {
@@ -290,16 +351,22 @@ class Bits : public Pattern {
           }
           return 1.0;
         }
-        void tick() {
+        void tick(unsigned long now) {
           pos = mod_wrap(pos + direction, NUM_LEDS);
-          lastTick = millis();
+          lastTick = now;
         }
     };
 
-    Bit *bits;
+    // largest maxBits of any preset, so bits can live in place
+    static const unsigned int bitCapacity = 80;
+    Bit bits[bitCapacity];
     unsigned int numBits;
-    unsigned int lastBitCreation;
+    unsigned int bitLimit; // preset.maxBits, cut down when quality drops
+    unsigned int lastBitCreation = 0;
     BitsPreset preset;
+    double fadePerSecond;
+    // the pattern's own clock, advanced by step()
+    double stepMillis = 0;
     char constPreset;
 
     CRGB color;
@@ -322,12 +389,17 @@ class Bits : public Pattern {
       // for monotone
       color = CRGB::HSB(random8(), random8(8) == 0 ? 0 : random8(200, 255), 255);
 
-      bits = (Bit *)calloc(preset.maxBits, sizeof(Bit));
+      assert(preset.maxBits <= bitCapacity, "Bits preset has more than %u bits", bitCapacity);
       numBits = 0;
+      bitLimit = preset.maxBits;
+      // presets give the fade a frame at 60 fps
+      fadePerSecond = 1 - pow(1 - 1. / preset.fadedown, 60);
+      stepRate = 60;
     }
 
-    ~Bits() {
-      free(bits);
+    void qualityChanged() {
+      // bits past the limit stop being drawn and fade out on their own
+      bitLimit = (quality == qualityMinimal ? preset.maxBits / 2 : quality == qualityReduced ? preset.maxBits * 2 / 3 : preset.maxBits);
     }
   private:
     CRGB getBitColor() {
@@ -345,32 +417,36 @@ class Bits : public Pattern {
           return CRGB::DeepPink;
       }
     }
-
-    void update() {
-      unsigned long mils = millis();
-      for (unsigned int i = 0; i < numBits; ++i) {
+  public:
+    // The bits leave trails as they move, so they're drawn here too.
+    void step(float dt) {
+      stepMillis += dt * 1000;
+      unsigned long mils = stepMillis;
+      unsigned int liveBits = std::min(numBits, bitLimit);
+      for (unsigned int i = 0; i < liveBits; ++i) {
         Bit *bit = &bits[i];
-        if (bit->age() > preset.bitLifespan) {
+        if (bit->age(mils) > preset.bitLifespan) {
           bit->alive = false;
         }
         if (bit->alive) {
-          CRGB c = CRGB::Black.blendWith(bit->color, bit->ageBrightness());
+          CRGB c = CRGB::Black.blendWith(bit->color, bit->ageBrightness(mils));
           ctx.leds[bit->pos].r = c.red;
           ctx.leds[bit->pos].g = c.green;
           ctx.leds[bit->pos].b = c.blue;
+          ctx.touch(bit->pos);
           if (mils - bit->lastTick > preset.updateInterval) {
-            bit->tick();
+            bit->tick(mils);
           }
         } else {
-          bit->reset(getBitColor());
+          bit->reset(getBitColor(), mils);
         }
       }
 
-      if (isRunning() && numBits < preset.maxBits && mils - lastBitCreation > preset.bitLifespan / preset.maxBits) {
-        bits[numBits++] = Bit(getBitColor());
+      if (isRunning() && numBits < bitLimit && mils - lastBitCreation > preset.bitLifespan / preset.maxBits) {
+        bits[numBits++] = Bit(getBitColor(), mils);
         lastBitCreation = mils;
       }
-      fadeDownBy(1./preset.fadedown, ctx);
+      fadeDownBy(fadePerStep(fadePerSecond, dt), ctx);
     }
 
     const char *description() {
@@ -380,7 +456,7 @@ class Bits : public Pattern {
 
 /* ------------------- */
 
-class Undulation : public Pattern {
+class Undulation final : public Pattern {
   class Highlight {
   public:
     static const long lifespan = 2000;
@@ -389,7 +465,8 @@ class Undulation : public Pattern {
     CRGB color;
     long startMillis;
     bool dead = false;
-    Highlight() {
+    Highlight() { }
+    void start() {
       stick = random8(NUM_LEDS / STICK_LENGTH);
       startMillis = millis();
       tick();
@@ -405,17 +482,21 @@ class Undulation : public Pattern {
     }
   };
 
-  std::vector<Highlight> highlights;
+  // a new highlight every 140 ms lasting 2 s never needs more than 15 at once
+  static const int maxHighlights = 32;
+  Highlight highlights[maxHighlights];
+  int highlightCount = 0;
   long lastHighlight = 0;
 
   int submode;
   int baseHue;
 public:
   Undulation() {
-    highlights.clear();
     submode = random8(2); // FIXME: don't use submode 2 cause it's boring
-    printf("  submode %i\n", submode);
+    logf("  submode %i", submode);
     baseHue = random8();
+    // 4 s waves and 2 s highlights
+    preferredFrameRate = 20;
   }
 
   void update() {
@@ -443,36 +524,43 @@ public:
         }
         
         ctx.leds[index] = c;
+        ctx.touch(index);
       }
     }
 
-    if (millis() - lastHighlight > 140) {
-      Highlight h;
+    if (millis() - lastHighlight > 140 && highlightCount < maxHighlights) {
+      Highlight &h = highlights[highlightCount];
       if (submode == 0) {
+        h.start();
         h.color = CRGB::HSB(random8(), 0xFF, 0xFF);
-        highlights.push_back(h);
+        ++highlightCount;
       } else if (submode == 1) {
+        h.start();
         h.color = CRGB::HSB(0, 0, 0xFF);
-        highlights.push_back(h);
+        ++highlightCount;
       } else if (submode == 2) {
         // no highlights
       }
       
       lastHighlight = millis();
     }
-    for (std::vector<Highlight>::iterator it = highlights.begin(); it < highlights.end(); ++it) {
+    int live = 0;
+    for (int h = 0; h < highlightCount; ++h) {
+      Highlight *it = &highlights[h];
       for (int i = 0; i < STICK_LENGTH; ++i) {
         int index = it->stick * STICK_LENGTH + i;
         ctx.leds[index].r = it->amount * it->color.red + (1-it->amount) * ctx.leds[index].r;
         ctx.leds[index].g = it->amount * it->color.green + (1-it->amount) * ctx.leds[index].g;
         ctx.leds[index].b = it->amount * it->color.blue + (1-it->amount) * ctx.leds[index].b;
+        ctx.touch(index);
       }
 
       it->tick();
-      if (it->dead) {
-        it = highlights.erase(it);
+      if (!it->dead) {
+        highlights[live++] = *it;
       }
     }
+    highlightCount = live;
   }
   const char *description() {
     return "Undulation Pattern";
@@ -481,7 +569,7 @@ public:
 
 /* ------------------- */
 
-class RaverPlaid : public Pattern {
+class RaverPlaid final : public Pattern {
   // how many sine wave cycles are squeezed into our n_pixels
   // 24 happens to create nice diagonal stripes on the wall layout
   const int default_freq = 24;
@@ -492,7 +580,7 @@ class RaverPlaid : public Pattern {
 public:
   RaverPlaid() {
     if (random8(2) == 0) {
-      printf("  Default frequencies\n");
+      logf("  Default frequencies");
       freq_r = default_freq;
       freq_g = default_freq;
       freq_b = default_freq;
@@ -500,7 +588,7 @@ public:
       freq_r = random8(18, 30);
       freq_g = random8(18, 30);
       freq_b = random8(18, 30);;
-      printf("  frequencies %f, %f, %f\n", freq_r, freq_g, freq_b);
+      logf("  frequencies %f, %f, %f", freq_r, freq_g, freq_b);
     }
     // 20% chance to cut out each channel
     mode = random8(5);
@@ -516,7 +604,9 @@ public:
     float speed_g = -13;
     float speed_b = 19;
     float t = runTime() / 1000. * 5;
-    for (int ii = 0; ii < n_pixels; ++ii) {
+    // at reduced quality, compute every second (or fourth) pixel and repeat it
+    int step = (quality == qualityMinimal ? 4 : quality == qualityReduced ? 2 : 1);
+    for (int ii = 0; ii < n_pixels; ii += step) {
         float pct = (ii / (float)n_pixels);
         // diagonal black stripes
         float pct_jittered = fmod_wrap(pct * 77, 37);
@@ -533,9 +623,12 @@ public:
         b = (mode == 4 ? 0 : b);
 
         const float brightness = 0.7;
-        ctx.leds[ii].r = r * brightness;
-        ctx.leds[ii].g = g * brightness;
-        ctx.leds[ii].b = b * brightness;
+        for (int jj = ii; jj < ii + step && jj < n_pixels; ++jj) {
+          ctx.leds[jj].r = r * brightness;
+          ctx.leds[jj].g = g * brightness;
+          ctx.leds[jj].b = b * brightness;
+          ctx.touch(jj);
+        }
     }
     // usleep(1. / fps * 1000000);
   }
@@ -546,7 +639,7 @@ public:
 
 /* ------------------- */
 
-class Breathe : public Pattern {
+class Breathe final : public Pattern {
   class Stick {
   public:
     int stick;
@@ -570,21 +663,25 @@ class Breathe : public Pattern {
   int hueOffset;
   int mode;
 
-  std::vector<Stick> sticks;
+  static const int maxSticks = NUM_LEDS / STICK_LENGTH;
+  Stick sticks[maxSticks];
+  int stickCount = 0;
   int generator = -1;
 public:
   Breathe() : Pattern(21) {
-    sticks.clear();
     lastValue = -1;
     mode = 1;//random8(2);
-    printf("  mode %i\n", mode);
+    logf("  mode %i", mode);
 
     if (random8(3) == 0) {
       hueOffset = -1;
     } else {
       hueOffset = random8();
     }
-    printf("  hue offset %i\n", hueOffset);
+    logf("  hue offset %i", hueOffset);
+    // sticks take half a second to fade in or out
+    preferredFrameRate = 20;
+    stepRate = 60;
   }
 private:
 
@@ -613,18 +710,18 @@ private:
       ctx.leds[prelightIndex].r = prelightColor.red;
       ctx.leds[prelightIndex].g = prelightColor.green;
       ctx.leds[prelightIndex].b = prelightColor.blue;
+      ctx.touch(prelightIndex);
       
       ctx.leds[lightIndex].r = lightColor.red;
       ctx.leds[lightIndex].g = lightColor.green;
       ctx.leds[lightIndex].b = lightColor.blue;
+      ctx.touch(lightIndex);
     }
     lastValue = value;
   }
 
   void popcornBreathe() {
-    // use generators for group of size 96
     int numSticks = NUM_LEDS / STICK_LENGTH;
-    const int generators[] = {37, 53, 67, 83, 101, 137, 163};
 
     float value = util_cos(runTime(), 0.5, 7000, -4, numSticks);
     if (lastValue == -1) {
@@ -634,23 +731,22 @@ private:
       // pause in between
       generator = -1;
     } else if (generator == -1) {
-      generator = generators[random8(ARRAY_SIZE(generators))];
-      for (std::vector<Stick>::iterator it = sticks.begin(); it != sticks.end(); ++it) {
-        it->direction = 0;
+      generator = popcornGenerators[random8(ARRAY_SIZE(popcornGenerators))];
+      for (int i = 0; i < stickCount; ++i) {
+        sticks[i].direction = 0;
       }
     }
     
     if (lastValue > value) {
-      for (int i = sticks.size() - 1; i >= 0 && i >= value; --i) {
+      for (int i = stickCount - 1; i >= 0 && i >= value; --i) {
         if (sticks[i].direction != -1) {
           sticks[i].fadeDown();
         }
       }
     } else {
-      for (int i = 0; i < value; ++i) {
-        while (i > (long)sticks.size() - 1) {
-          Stick s;
-          sticks.push_back(s);
+      for (int i = 0; i < value && i < maxSticks; ++i) {
+        while (i > stickCount - 1) {
+          sticks[stickCount++] = Stick();
         }
         if (sticks[i].direction != 1) {
           sticks[i].stick = ((i + 1) * generator) % numSticks;
@@ -662,7 +758,8 @@ private:
     float alphaLimiter = 0.4;
     int saturation = (hueOffset == -1 ? 0 : 200);
     
-    for (std::vector<Stick>::iterator it = sticks.begin(); it != sticks.end(); ++it) {
+    for (int s = 0; s < stickCount; ++s) {
+      Stick *it = &sticks[s];
       if (it->direction == 0) {
         continue;
       }
@@ -673,17 +770,22 @@ private:
         ctx.leds[index * STICK_LENGTH + i].g = alphaLimiter * lightColor.green;
         ctx.leds[index * STICK_LENGTH + i].b = alphaLimiter * lightColor.blue;
       }
+      ctx.touchStick(index);
     }
     lastValue = value;
   }
 
+public:
   void update() {
     if (mode == 0) {
       linearBreathe();
     } else {
       popcornBreathe();
     }
-    fadeDownBy(0.02, ctx);
+  }
+
+  void step(float dt) {
+    fadeDownBy(fadePerStep(0.7, dt), ctx);
   }
 
   const char *description() {
@@ -691,6 +793,66 @@ private:
   }
 };
 
-#endif
+/* ------------------- */
+
+// A spectrum analyzer: one band per strip, with the bars jumping hue on each beat.
+class Spectrum final : public Pattern {
+  static_assert(AudioFeatures::bandCount == STRIP_COUNT, "one band per strip");
+
+  float heights[STRIP_COUNT] = {};
+  float targets[STRIP_COUNT] = {};
+  uint32_t lastBeats = 0;
+  uint8_t hue;
+  float flash = 0;
+public:
+  Spectrum() : Pattern(30) {
+    hue = random8();
+    stepRate = 60;
+  }
+
+  bool wantsToRun() {
+    return audioAnalyzer.isLive();
+  }
+
+  void setup() {
+    // peek, as latest() records into a render thread histogram
+    lastBeats = audioAnalyzer.peek().beats;
+  }
+
+  void step(float dt) {
+    // the tops of the bars trail off as they fall
+    fadeDownBy(fadePerStep(0.9999, dt), ctx);
+    // and the bars settle back slowly
+    float settle = fadePerStep(0.998, dt);
+    for (int s = 0; s < STRIP_COUNT; ++s) {
+      heights[s] += (targets[s] - heights[s]) * settle;
+    }
+    flash = std::max(0.f, flash - dt * 6);
+  }
+
+  void update() {
+    AudioFeatures audio = audioAnalyzer.latest();
+    if (audio.beats != lastBeats) {
+      lastBeats = audio.beats;
+      hue += 40;
+      flash = 1;
+    }
+    for (int s = 0; s < STRIP_COUNT; ++s) {
+      // jump up with the sound
+      targets[s] = audio.bands[s] * STRIP_LENGTH;
+      heights[s] = std::max(heights[s], targets[s]);
+      int height = std::min(STRIP_LENGTH, (int)heights[s]);
+      for (int i = 0; i < height; ++i) {
+        int led = s * STRIP_LENGTH + i;
+        ctx.leds[led] = CRGB::HSB(hue + s * 4 + i, 0xFF - flash * 0x80, 0xFF);
+        ctx.touch(led);
+      }
+    }
+  }
 
+  const char *description() {
+    return "Spectrum";
+  }
+};
 
+#endif
@@ -0,0 +1,147 @@
+#define DEBUG 0
+
+// Offline renderer: runs the patterns against a virtual clock and writes every frame out
+// as fast as the CPU allows. Frames are raw RGB, one STRIP_LENGTH x STRIP_COUNT image per
+// frame, so they can be previewed with e.g.
+//   ffmpeg -f rawvideo -pix_fmt rgb24 -s 64x12 -r 60 -i frames.rgb preview.mp4
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "ortho.h"
+
+#include "util.h"
+#include "PatternManager.h"
+
+static_assert(sizeof(CRGB) == 3, "frames are written straight out of the LED buffer");
+
+DrawingContext ctx;
+PatternManager<DrawingContext> patternManager(ctx);
+VirtualClock virtualClock;
+
+void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [--pattern INDEX] [--fps N] [--duration SECONDS[s|m|h]] [--seed N] [--output PATH|-]\n"
+          "       [--layer INDEX[:over|brighten|darken[:OPACITY_PERCENT]]]...\n", argv0);
+  fprintf(stderr, "  without --pattern, patterns rotate as they do on the wall\n");
+  fprintf(stderr, "  without --output, frames are rendered and discarded, for profiling\n");
+  exit(EXIT_FAILURE);
+}
+
+// Seconds, with an optional s/m/h suffix. Returns -1 if malformed.
+long parseDuration(const char *text) {
+  char *end;
+  double value = strtod(text, &end);
+  long scale = 1;
+  if (*end == 'm') {
+    scale = 60;
+    ++end;
+  } else if (*end == 'h') {
+    scale = 3600;
+    ++end;
+  } else if (*end == 's') {
+    ++end;
+  }
+  if (end == text || *end != '\0' || value < 0) {
+    return -1;
+  }
+  return value * scale * 1000;
+}
+
+int main(int argc, char *argv[]) {
+  int patternIndex = -1;
+  int fps = 60;
+  long durationMillis = 60 * 1000;
+  unsigned int seed = 1;
+  const char *outputPath = NULL;
+  LayerSpec layers[4];
+  int layerCount = 0;
+
+  static struct option options[] = {
+    {"pattern", required_argument, NULL, 'p'},
+    {"fps", required_argument, NULL, 'f'},
+    {"duration", required_argument, NULL, 'd'},
+    {"seed", required_argument, NULL, 's'},
+    {"output", required_argument, NULL, 'o'},
+    {"layer", required_argument, NULL, 'y'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "p:f:d:s:o:y:h", options, NULL)) != -1) {
+    switch (opt) {
+      case 'p':
+        patternIndex = atoi(optarg);
+        break;
+      case 'f':
+        fps = atoi(optarg);
+        break;
+      case 'd':
+        durationMillis = parseDuration(optarg);
+        break;
+      case 's':
+        seed = strtoul(optarg, NULL, 10);
+        break;
+      case 'o':
+        outputPath = optarg;
+        break;
+      case 'y':
+        if (layerCount == ARRAY_SIZE(layers) || !layers[layerCount++].parse(optarg)) {
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind < argc || fps <= 0 || durationMillis < 0 || patternIndex >= patternManager.patternCount()) {
+    usage(argv[0]);
+  }
+
+  FILE *output = NULL;
+  if (outputPath && strcmp(outputPath, "-") == 0) {
+    output = stdout;
+  } else if (outputPath && (output = fopen(outputPath, "wb")) == NULL) {
+    perror(outputPath);
+    exit(EXIT_FAILURE);
+  }
+
+  // stdout may be carrying frames
+  logger.start(stderr);
+  timeSource = &virtualClock;
+  srandom(seed);
+
+  if (patternIndex >= 0) {
+    patternManager.pinPattern(patternIndex);
+  } else {
+    patternManager.setup();
+  }
+  for (int i = 0; i < layerCount; ++i) {
+    if (patternManager.addPatternLayer(layers[i].patternIndex, layers[i].blendMode, layers[i].opacity) < 0) {
+      logf("Couldn't add pattern %i as a layer", layers[i].patternIndex);
+    }
+  }
+
+  long frameCount = durationMillis * fps / 1000;
+  uint64_t start = monotonicNanos();
+  for (long frame = 0; frame < frameCount; ++frame) {
+    // computed from the frame number so rounding never accumulates over long renders
+    virtualClock.set(frame * 1000 / fps);
+    patternManager.loop();
+    if (output && fwrite(ctx.leds, sizeof(CRGB), NUM_LEDS, output) != NUM_LEDS) {
+      perror("fwrite");
+      exit(EXIT_FAILURE);
+    }
+  }
+  double elapsed = (monotonicNanos() - start) / 1e9;
+
+  if (output && output != stdout) {
+    fclose(output);
+  } else if (output) {
+    fflush(output);
+  }
+  logf("Rendered %ld frames (%.1f s at %d fps) in %.2f s, %.1fx real time",
+       frameCount, durationMillis / 1000., fps, elapsed, elapsed > 0 ? durationMillis / 1000. / elapsed : 0);
+  logger.stop();
+  return 0;
+}
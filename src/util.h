@@ -1,77 +1,106 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <math.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "Logger.h"
+
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
 
-#ifndef __WIRING_PI_H__
-long millis() {
-  static long start_sec = 0;
-  struct timeval tv;
-  if (start_sec == 0) {
-    gettimeofday(&tv, (struct timezone *)0);
-    start_sec = tv.tv_sec;
-  }
-  gettimeofday(&tv, (struct timezone *)0);
-  return (unsigned long)(1000 * (tv.tv_sec - start_sec) + tv.tv_usec / 1000.);
-}
-#endif
+// Everything that animates asks millis() for the time. In production that is the wall
+// clock; the offline renderer swaps in a VirtualClock that only moves when it is stepped,
+// so output can be rendered as fast as the CPU allows.
+class TimeSource {
+public:
+  virtual ~TimeSource() { }
+  virtual long now() = 0;
+};
 
-#define fadeDownBy(amt, ctx)     for (int i = 0; i < NUM_LEDS; ++i) { \
-      ctx.leds[i].r *= (1 - amt); \
-      ctx.leds[i].g *= (1 - amt); \
-      ctx.leds[i].b *= (1 - amt); \
+class WallClock : public TimeSource {
+public:
+  long now() {
+#ifdef __WIRING_PI_H__
+    return ::millis();
+#else
+    static long start_sec = 0;
+    struct timeval tv;
+    if (start_sec == 0) {
+      gettimeofday(&tv, (struct timezone *)0);
+      start_sec = tv.tv_sec;
     }
+    gettimeofday(&tv, (struct timezone *)0);
+    return (unsigned long)(1000 * (tv.tv_sec - start_sec) + tv.tv_usec / 1000.);
+#endif
+  }
+};
 
-static void _logf(bool newline, const char *format, va_list argptr)
-{
-  if (strlen(format) == 0) {
-    if (newline) {
-      printf("\n");
-    }
-    return;
+class VirtualClock : public TimeSource {
+  long current;
+public:
+  VirtualClock(long start = 0) : current(start) { }
+  long now() {
+    return current;
   }
-  char *buf;
-  vasprintf(&buf, format, argptr);
-  if (newline) {
-    printf("%s\n", buf ? buf : "LOGF MEMORY ERROR");
-  } else {
-    printf("%s", buf ? buf : "LOGF MEMORY ERROR");
+  void set(long nowMillis) {
+    current = nowMillis;
   }
-#if DEBUG
-  fflush(stdout);
-  fflush(stderr);
+};
+
+WallClock wallClock;
+TimeSource *timeSource = &wallClock;
+
+inline long clockMillis() {
+  return timeSource->now();
+}
+
+#ifdef __WIRING_PI_H__
+// wiringPi already declares millis(), so route callers past it
+#define millis() clockMillis()
+#else
+long millis() {
+  return clockMillis();
+}
 #endif
-  free(buf);
+
+// Monotonic, high resolution, and never affected by wall clock changes; for measuring durations.
+inline uint64_t monotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
+void logf(const char *format, ...) __attribute__((format(printf, 1, 2)));
 void logf(const char *format, ...)
 {
   va_list argptr;
   va_start(argptr, format);
-  _logf(true, format, argptr);
+  logger.vlog(logLevelInfo, true, format, argptr);
   va_end(argptr);
 }
 
+void loglf(const char *format, ...) __attribute__((format(printf, 1, 2)));
 void loglf(const char *format, ...)
 {
   va_list argptr;
   va_start(argptr, format);
-  _logf(false, format, argptr);
+  logger.vlog(logLevelInfo, false, format, argptr);
   va_end(argptr);
 }
 
 void assert_func(bool result, const char *pred, const char *reasonFormat, ...) {
   if (!result) {
-    logf("ASSERTION FAILED: %s", pred);
+    logError("ASSERTION FAILED: %s", pred);
     va_list argptr;
     va_start(argptr, reasonFormat);
-    logf(reasonFormat, argptr);
+    logger.vlog(logLevelError, true, reasonFormat, argptr);
     va_end(argptr);
 #if DEBUG
     while (1) sleep(100);
@@ -102,7 +131,7 @@ class FrameCounter {
       long elapsed = mil - lastPrint;
       if (elapsed > printInterval) {
         if (lastPrint != 0) {
-          printf("Framerate: %f\n", frames / (float)elapsed * 1000);
+          logf("Framerate: %f", frames / (float)elapsed * 1000);
         }
         frames = 0;
         lastPrint = mil;
@@ -125,6 +154,9 @@ uint8_t random8() {
   return random() % 0x100;
 }
 
+// Multipliers that visit all NUM_LEDS / STICK_LENGTH sticks in a scattered "popcorn" order
+const int popcornGenerators[] = {37, 53, 67, 83, 101, 137, 163};
+
 float remap(float x, float oldmin, float oldmax, float newmin, float newmax) {
   float zero_to_one = (x-oldmin) / (oldmax-oldmin);
   return zero_to_one*(newmax-newmin) + newmin;